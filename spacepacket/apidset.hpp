@@ -0,0 +1,139 @@
+/**************************************************************************//**
+ * @file apidset.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a class representing a set of APIDs
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_APID_SET_HPP
+#define CCSDS_APID_SET_HPP
+
+#include "spacepacket/primaryhdr.hpp"
+#include <bitset>
+#include <cstdint>
+
+namespace ccsds
+{
+
+/**
+ * @brief Set of APIDs, stored as a bitmap of every possible APID (including idle). Checking if an
+ *        APID is part of the set is a single bit test.
+ * @code
+ *          ApidSet housekeeping;
+ *          housekeeping.addRange(0x100, 0x1FF);    // every APID from 0x100 to 0x1FF
+ *          housekeeping.addMask(0x020, 0x7F0);     // every APID from 0x020 to 0x02F
+ *          housekeeping.add(0x42);
+ *          service.registerListener(&listener, housekeeping);
+ * @endcode
+ */
+class ApidSet
+{
+public:
+    enum {
+        /** Amount of possible APIDs (including idle) */
+        NB_APIDS = SpPrimaryHeader::PacketApid::IDLE_VALUE + 1,
+    };
+
+    ApidSet() = default;
+
+    /**
+     * @brief Add an APID to the set
+     * 
+     * @param apid The APID
+     * @return A reference to this set
+     */
+    ApidSet& add(SpPrimaryHeader::PacketApid apid) {
+        bits.set(apid.getValue());
+        return *this;
+    }
+
+    /**
+     * @brief Add a range of APIDs to the set
+     * 
+     * @param first The first APID of the range
+     * @param last The last APID of the range (included)
+     * @return A reference to this set
+     */
+    ApidSet& addRange(SpPrimaryHeader::PacketApid first, SpPrimaryHeader::PacketApid last) {
+        for(uint32_t apid = first.getValue(); apid <= last.getValue(); apid++) {
+            bits.set(apid);
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Add every APID that matches a value on the bits of a mask, i.e every APID for which
+     *        (APID & mask) == (value & mask).
+     * 
+     * @param value The value to match
+     * @param mask The bits of the APID that have to match the value
+     * @return A reference to this set
+     */
+    ApidSet& addMask(uint16_t value, uint16_t mask) {
+        for(uint32_t apid = 0; apid < NB_APIDS; apid++) {
+            if((apid & mask) == (value & mask & SpPrimaryHeader::PacketApid::IDLE_VALUE)) {
+                bits.set(apid);
+            }
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Add every APID of another set to this set
+     * 
+     * @param other The other set
+     * @return A reference to this set
+     */
+    ApidSet& add(const ApidSet& other) {
+        bits |= other.bits;
+        return *this;
+    }
+
+    /**
+     * @brief Remove an APID from the set
+     * 
+     * @param apid The APID
+     * @return A reference to this set
+     */
+    ApidSet& remove(SpPrimaryHeader::PacketApid apid) {
+        bits.reset(apid.getValue());
+        return *this;
+    }
+
+    /**
+     * @brief Remove every APID from the set
+     */
+    void clear() {
+        bits.reset();
+    }
+
+    /**
+     * @param apid The APID
+     * @return true if the APID is part of the set, false otherwise
+     */
+    bool contains(SpPrimaryHeader::PacketApid apid) const {
+        return bits.test(apid.getValue());
+    }
+
+    /**
+     * @return The amount of APIDs in the set
+     */
+    std::size_t count() const {
+        return bits.count();
+    }
+
+    /**
+     * @return true if the set has no APID, false otherwise
+     */
+    bool isEmpty() const {
+        return bits.none();
+    }
+
+private:
+    /** One bit per APID */
+    std::bitset<NB_APIDS> bits;
+};
+
+} //namespace
+
+#endif //CCSDS_APID_SET_HPP
@@ -0,0 +1,502 @@
+/**************************************************************************//**
+ * @file asyncdispatch.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains classes for notifying spacepacket listeners asynchronously,
+ *        from a pool of worker threads
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_ASYNC_DISPATCH_HPP
+#define CCSDS_ASYNC_DISPATCH_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "spacepacket/listener.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+namespace ccsds
+{
+
+/**
+ * @brief What to do with a new spacepacket when the queue of an asynchronous listener is full
+ */
+enum SpBackpressurePolicy {
+    /** Wait until the queue has room. The thread receiving the spacepackets is stalled. */
+    SP_BACKPRESSURE_BLOCK,
+    /** Drop the oldest spacepacket of the queue to make room for the new one */
+    SP_BACKPRESSURE_DROP_OLDEST,
+    /** Drop the new spacepacket */
+    SP_BACKPRESSURE_DROP_NEWEST,
+};
+
+/**
+ * @brief Metrics of the queue of an asynchronous listener
+ */
+struct SpAsyncQueueStats {
+    /** Amount of spacepackets currently waiting in the queue */
+    std::size_t depth = 0;
+    /** Highest amount of spacepackets that waited in the queue */
+    std::size_t high_water = 0;
+    /** Amount of spacepackets delivered to the listener */
+    uint64_t    nb_delivered = 0;
+    /** Amount of spacepackets dropped because the queue was full */
+    uint64_t    nb_dropped = 0;
+    /** Amount of spacepackets dropped because they were larger than a queue slot */
+    uint64_t    nb_oversized = 0;
+    /** Amount of times the receiving thread waited for room in the queue */
+    uint64_t    nb_blocked = 0;
+    /** Amount of spacepackets dropped because the worker pool was stopped */
+    uint64_t    nb_stopped = 0;
+};
+
+class SpWorkerPool;
+
+/**
+ * @brief Queue of spacepackets that is drained by a worker pool. @see{SpAsyncListener}
+ */
+class ISpAsyncQueue
+{
+protected:
+    /**
+     * @brief Deliver some of the spacepackets of the queue. Called by a single worker at a time.
+     * 
+     * @param max_packets The maximum amount of spacepackets to deliver
+     * @return true if spacepackets are still waiting in the queue, false if the queue is now idle
+     */
+    virtual bool drain(std::size_t max_packets) = 0;
+
+    /**
+     * @brief Drop the spacepackets of the queue, which will never be drained: the worker pool was
+     *        stopped. The queue is no longer scheduled after the call.
+     */
+    virtual void abandon() = 0;
+
+private:
+    friend class SpWorkerPool;
+    /** Next queue in the list of queues waiting for a worker */
+    ISpAsyncQueue* next_ready = nullptr;
+};
+
+/**
+ * @brief Pool of threads that deliver the spacepackets queued by asynchronous listeners.
+ * 
+ * @details Queues with waiting spacepackets are scheduled in a FIFO list. A worker takes the first
+ *          queue, delivers a batch of spacepackets and puts it back at the end of the list if more
+ *          are waiting, so that a slow listener cannot starve the others. A queue is handled by one
+ *          worker at a time, which keeps the spacepackets of a listener in order.
+ */
+class SpWorkerPool
+{
+public:
+    /**
+     * @brief Construct a new SpWorkerPool object and start the workers
+     * 
+     * @param nb_workers The amount of threads
+     * @param batch_size The maximum amount of spacepackets delivered to a listener before moving
+     *                   to the next one
+     */
+    SpWorkerPool(std::size_t nb_workers = 1, std::size_t batch_size = 32)
+    : batch_size(batch_size > 0 ? batch_size : 1), nb_workers(0) {
+        if(nb_workers > MAX_WORKERS) {
+            nb_workers = MAX_WORKERS;
+        }
+
+        for(std::size_t i = 0; i < nb_workers; i++) {
+            workers[i] = std::thread([this]() { this->run(); });
+            this->nb_workers++;
+        }
+    }
+
+    SpWorkerPool(const SpWorkerPool& other) = delete;
+    SpWorkerPool& operator=(const SpWorkerPool& other) = delete;
+
+    /**
+     * @brief Stop the workers. The spacepackets still queued are not delivered.
+     */
+    ~SpWorkerPool() {
+        this->stop();
+    }
+
+    /**
+     * @brief Stop the workers, and wait for them to finish their current batch
+     * 
+     * @details The spacepackets still waiting in the queues are dropped (and counted as nb_stopped
+     *          by their queue), and so are the spacepackets queued after the call.
+     */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready_cond.notify_all();
+
+        for(std::size_t i = 0; i < nb_workers; i++) {
+            if(workers[i].joinable()) {
+                workers[i].join();
+            }
+        }
+
+        // no worker left: the waiting queues will never be drained
+        ISpAsyncQueue* queue = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue = ready_head;
+            ready_head = nullptr;
+            ready_tail = nullptr;
+        }
+        while(queue != nullptr) {
+            ISpAsyncQueue* next = queue->next_ready;
+            queue->next_ready = nullptr;
+            queue->abandon();
+            queue = next;
+        }
+    }
+
+    /**
+     * @return The amount of threads of the pool
+     */
+    std::size_t getNbWorkers() const {
+        return nb_workers;
+    }
+
+    /**
+     * @brief Put a queue in the list of queues waiting for a worker
+     * 
+     * @param queue The queue, which must not already be scheduled
+     * @return false if the pool is stopped: the queue was not scheduled
+     */
+    bool schedule(ISpAsyncQueue* queue) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(stopping) {
+                return false;
+            }
+            queue->next_ready = nullptr;
+            if(ready_tail != nullptr) {
+                ready_tail->next_ready = queue;
+            } else {
+                ready_head = queue;
+            }
+            ready_tail = queue;
+        }
+        ready_cond.notify_one();
+        return true;
+    }
+
+private:
+    enum {
+        /** Maximum amount of threads in a pool */
+        MAX_WORKERS = 64,
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(true) {
+            ready_cond.wait(lock, [this]() { return stopping || ready_head != nullptr; });
+            if(stopping) {
+                return;
+            }
+
+            ISpAsyncQueue* queue = ready_head;
+            ready_head = queue->next_ready;
+            if(ready_head == nullptr) {
+                ready_tail = nullptr;
+            }
+
+            lock.unlock();
+            bool pending = queue->drain(batch_size);
+            lock.lock();
+
+            // more to deliver: back at the end of the list
+            if(pending) {
+                queue->next_ready = nullptr;
+                if(ready_tail != nullptr) {
+                    ready_tail->next_ready = queue;
+                } else {
+                    ready_head = queue;
+                }
+                ready_tail = queue;
+            }
+        }
+    }
+
+    std::mutex              mutex;
+    std::condition_variable ready_cond;
+    ISpAsyncQueue*          ready_head = nullptr;
+    ISpAsyncQueue*          ready_tail = nullptr;
+    bool                    stopping = false;
+
+    const std::size_t       batch_size;
+    std::size_t             nb_workers;
+    std::thread             workers[MAX_WORKERS];
+};
+
+/**
+ * @brief Listener that notifies another listener asynchronously. Spacepackets are copied in a
+ *        bounded queue and delivered later by a worker pool, so a slow listener doesn't stall
+ *        the thread receiving the spacepackets.
+ * @code
+ *          SpWorkerPool pool(2);
+ *          SpAsyncListener<> async_archiver(archiver, pool, 256, 4096, SP_BACKPRESSURE_DROP_OLDEST);
+ *          service.registerListener(&async_archiver);
+ * @endcode
+ * 
+ * @details The memory of the queue is allocated once: one slot of @p max_packet_size bytes per
+ *          queued spacepacket, plus the slot being delivered. Spacepackets larger than a slot
+ *          are dropped and counted in the metrics.
+ * @note The worker pool must outlive the listener, and the listener must be unregistered from
+ *       the transfer service before being destroyed. Once the pool is stopped, the queued and new
+ *       spacepackets are dropped and counted as nb_stopped.
+ * 
+ * @tparam Allocator The allocator used for the queue memory. @see{isAllocator}
+ */
+template<typename Allocator = DefaultAllocator>
+class SpAsyncListener : public SpListener, public ISpAsyncQueue, private AllocatorHolder<Allocator>
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+public:
+    /**
+     * @brief Construct a new SpAsyncListener object
+     * 
+     * @param target The listener to notify asynchronously
+     * @param pool The worker pool delivering the spacepackets
+     * @param queue_depth The maximum amount of spacepackets waiting in the queue
+     * @param max_packet_size The maximum size (in bytes) of a queued spacepacket
+     * @param policy What to do when the queue is full
+     * @param alloc The allocator to use for the queue memory
+     */
+    SpAsyncListener(SpListener& target, SpWorkerPool& pool, std::size_t queue_depth, std::size_t max_packet_size,
+                    SpBackpressurePolicy policy = SP_BACKPRESSURE_BLOCK, const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), target(target), pool(pool), policy(policy),
+      queue_depth(queue_depth > 0 ? queue_depth : 1), slot_size(max_packet_size) {
+
+        // one more slot than the depth, for the spacepacket being delivered
+        const std::size_t nb_slots = this->queue_depth + 1;
+        memory = this->getAllocator().allocateBuffer(nb_slots * (slot_size + 2 * sizeof(std::size_t)),
+                                                     ALLOC_SITE_ASYNC_QUEUE);
+        if(memory.getStart() == nullptr) {
+            this->queue_depth = 0;
+            return;
+        }
+
+        slot_sizes = reinterpret_cast<std::size_t*>(memory.getStart());
+        ring       = slot_sizes + nb_slots;
+        slots      = reinterpret_cast<uint8_t*>(ring + nb_slots);
+
+        // every slot is free
+        for(std::size_t i = 0; i < nb_slots; i++) {
+            ring[i] = i;
+        }
+        nb_free = nb_slots;
+    }
+
+    SpAsyncListener(const SpAsyncListener& other) = delete;
+    SpAsyncListener& operator=(const SpAsyncListener& other) = delete;
+
+    /**
+     * @brief Wait until the queue is no longer handled by a worker, then release the queue memory
+     */
+    ~SpAsyncListener() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            count = 0;
+            idle_cond.wait(lock, [this]() { return !scheduled; });
+        }
+        this->getAllocator().deallocateBuffer(memory, ALLOC_SITE_ASYNC_QUEUE);
+    }
+
+    /**
+     * @brief Queue a spacepacket, to be delivered by the worker pool
+     * 
+     * @param bytes The spacepacket
+     */
+    void newSpacepacket(const IBuffer& bytes) override {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if(stopped) {
+            stats.nb_stopped++;
+            return;
+        }
+
+        if(bytes.getSize() > slot_size || queue_depth == 0) {
+            stats.nb_oversized++;
+            return;
+        }
+
+        if(count >= queue_depth) {
+            switch(policy) {
+                case SP_BACKPRESSURE_BLOCK:
+                    stats.nb_blocked++;
+                    room_cond.wait(lock, [this]() { return count < queue_depth || stopped; });
+                    if(stopped) {
+                        stats.nb_stopped++;
+                        return;
+                    }
+                    break;
+                case SP_BACKPRESSURE_DROP_OLDEST:
+                    // the oldest slot becomes free, its memory is reused right away
+                    this->releaseSlot(this->popSlot());
+                    stats.nb_dropped++;
+                    break;
+                default:
+                    stats.nb_dropped++;
+                    return;
+            }
+        }
+
+        std::size_t slot = this->takeFreeSlot();
+        std::memcpy(this->getSlotStart(slot), bytes.getStart(), bytes.getSize());
+        slot_sizes[slot] = bytes.getSize();
+        this->pushSlot(slot);
+
+        if(count > stats.high_water) {
+            stats.high_water = count;
+        }
+
+        if(!scheduled) {
+            scheduled = true;
+            lock.unlock();
+            if(!pool.schedule(this)) {
+                this->abandon();
+            }
+        }
+    }
+
+    /**
+     * @brief Wait until every queued spacepacket was delivered
+     */
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle_cond.wait(lock, [this]() { return !scheduled; });
+    }
+
+    /**
+     * @return The metrics of the queue
+     */
+    SpAsyncQueueStats getStats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        SpAsyncQueueStats current = stats;
+        current.depth = count;
+        return current;
+    }
+
+protected:
+    bool drain(std::size_t max_packets) override {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        for(std::size_t i = 0; i < max_packets && count > 0; i++) {
+            std::size_t slot = this->popSlot();
+            room_cond.notify_one();
+            lock.unlock();
+
+            // the slot is neither free nor queued while delivered: no one else touches it
+            UserBuffer packet(this->getSlotStart(slot), slot_sizes[slot]);
+            target.newSpacepacket(packet);
+
+            lock.lock();
+            this->releaseSlot(slot);
+            stats.nb_delivered++;
+        }
+
+        if(count == 0) {
+            scheduled = false;
+            idle_cond.notify_all();
+            return false;
+        }
+        return true;
+    }
+
+    void abandon() override {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        stopped = true;
+        while(count > 0) {
+            this->releaseSlot(this->popSlot());
+            stats.nb_stopped++;
+        }
+
+        scheduled = false;
+        room_cond.notify_all();
+        idle_cond.notify_all();
+    }
+
+private:
+    uint8_t* getSlotStart(std::size_t slot) {
+        return slots + slot * slot_size;
+    }
+
+    /*
+     * The ring holds the indices of the queued slots (count of them, from head) followed by the
+     * indices of the free slots (nb_free of them). The slot being delivered is in neither.
+     */
+    std::size_t takeFreeSlot() {
+        const std::size_t nb_slots = queue_depth + 1;
+        nb_free--;
+        return ring[(head + count + nb_free) % nb_slots];
+    }
+
+    void pushSlot(std::size_t slot) {
+        const std::size_t nb_slots = queue_depth + 1;
+        // the first free index is overwritten, move it to where the taken free index was
+        std::size_t tail = (head + count) % nb_slots;
+        ring[(head + count + nb_free) % nb_slots] = ring[tail];
+        ring[tail] = slot;
+        count++;
+    }
+
+    std::size_t popSlot() {
+        const std::size_t nb_slots = queue_depth + 1;
+        std::size_t slot = ring[head];
+        head = (head + 1) % nb_slots;
+        count--;
+        return slot;
+    }
+
+    void releaseSlot(std::size_t slot) {
+        const std::size_t nb_slots = queue_depth + 1;
+        ring[(head + count + nb_free) % nb_slots] = slot;
+        nb_free++;
+    }
+
+    /** The listener notified asynchronously */
+    SpListener&             target;
+    /** The workers delivering the spacepackets */
+    SpWorkerPool&           pool;
+    /** What to do when the queue is full */
+    SpBackpressurePolicy    policy;
+    /** The maximum amount of queued spacepackets */
+    std::size_t             queue_depth;
+    /** The size of a slot */
+    const std::size_t       slot_size;
+
+    /** The memory of the queue: slot sizes, ring of slot indices, then the slots */
+    UserBuffer              memory;
+    std::size_t*            slot_sizes = nullptr;
+    std::size_t*            ring = nullptr;
+    uint8_t*                slots = nullptr;
+    /** Position of the oldest queued slot in the ring */
+    std::size_t             head = 0;
+    /** Amount of queued slots */
+    std::size_t             count = 0;
+    /** Amount of free slots */
+    std::size_t             nb_free = 0;
+
+    /** If the queue is in the worker pool (waiting or being drained) */
+    bool                    scheduled = false;
+    /** If the worker pool was stopped: nothing is queued anymore */
+    bool                    stopped = false;
+    SpAsyncQueueStats       stats;
+
+    mutable std::mutex      mutex;
+    std::condition_variable room_cond;
+    std::condition_variable idle_cond;
+};
+
+} //namespace
+
+#endif //CCSDS_ASYNC_DISPATCH_HPP
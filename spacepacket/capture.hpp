@@ -0,0 +1,900 @@
+/**************************************************************************//**
+ * @file capture.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a recorder of the spacepackets going through a stack of layers,
+ *        in a memory-mapped capture file, and a reader of such files
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_CAPTURE_HPP
+#define CCSDS_CAPTURE_HPP
+
+#include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
+#include "utils/clock.hpp"
+#include "utils/commlayer.hpp"
+#include "utils/span.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include "spacepacket/spacepacket.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ccsds
+{
+
+/**
+ * @brief Direction of a recorded spacepacket. They can be combined with a bitwise OR.
+ */
+enum SpCaptureDirection : uint8_t {
+    /** Received from the sub-layer */
+    SP_CAPTURE_RX   = 1U << 0,
+    /** Transmitted to the sub-layer */
+    SP_CAPTURE_TX   = 1U << 1,
+    SP_CAPTURE_BOTH = SP_CAPTURE_RX | SP_CAPTURE_TX,
+};
+
+/**
+ * @brief Layout of a capture file. All the fields are in the byte order of the recording host
+ *        (checked when opened).
+ * @verbatim
+ *          | file header | chunk 0 | chunk 1 | ... | chunk N-1 |
+ *          chunk: | chunk header | record | record | ... | zeros |
+ *          record: | record header | spacepacket bytes | padding to 8 bytes |
+ * @endverbatim
+ * @details The chunks all have the same size, and are appended one at a time. The header of each
+ *          chunk is its index: the time span of its records, and the APIDs they belong to. A record
+ *          is written before its sync word, and the chunk header is updated after it: after a crash,
+ *          only the last chunk has to be walked again, up to the first record that is incomplete.
+ */
+struct SpCaptureFormat {
+    enum : uint32_t {
+        VERSION     = 1,
+        ENDIANNESS_MARK  = 0x01020304U,
+        CHUNK_MAGIC = 0x4B4E4843U,
+        RECORD_SYNC = 0x53504B54U,
+        /** APID of the records too short to hold a primary header */
+        NO_APID     = 0xFFFFU,
+    };
+
+    struct FileHeader {
+        char        magic[8];
+        uint32_t    version;
+        uint32_t    endianness_mark;
+        /** Offset of the first chunk, a multiple of the page size */
+        uint64_t    data_offset;
+        /** Size of a chunk, a multiple of the page size */
+        uint64_t    chunk_size;
+        /** Amount of chunks started */
+        uint64_t    nb_chunks;
+    };
+
+    struct ChunkHeader {
+        uint32_t    magic;
+        uint32_t    nb_records;
+        /** Timestamp of the first and of the last record, in nanoseconds */
+        uint64_t    first_time;
+        uint64_t    last_time;
+        /** Bytes used in the chunk, its header included */
+        uint64_t    end;
+        /** One bit per APID present in the chunk */
+        uint64_t    apids[(SpPrimaryHeader::PacketApid::IDLE_VALUE + 1) / 64];
+
+        bool hasApid(uint16_t apid_value) const {
+            return apid_value <= SpPrimaryHeader::PacketApid::IDLE_VALUE && ((apids[apid_value / 64] >> (apid_value % 64)) & 1U);
+        }
+    };
+
+    struct RecordHeader {
+        /** Written last: RECORD_SYNC once the record is complete */
+        uint32_t    sync;
+        /** Size of the spacepacket */
+        uint32_t    size;
+        /** Reception or transmission time, in nanoseconds */
+        uint64_t    timestamp;
+        uint16_t    apid;
+        uint8_t     direction;
+        uint8_t     reserved;
+        /** FNV-1a hash of the fields above (after the sync word) and of the spacepacket */
+        uint32_t    checksum;
+    };
+
+    static constexpr char MAGIC[8] = {'C', 'C', 'S', 'D', 'S', 'C', 'A', 'P'};
+
+    /**
+     * @return The size of a record holding a spacepacket of a given size
+     */
+    static std::size_t getRecordSize(std::size_t packet_size) {
+        return (sizeof(RecordHeader) + packet_size + 7) & ~std::size_t(7);
+    }
+
+    static uint32_t hash(uint32_t hash, const uint8_t* bytes, std::size_t size) {
+        for(std::size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 16777619U;
+        }
+        return hash;
+    }
+
+    /**
+     * @return The checksum of a record, computed on its header and spacepacket bytes
+     */
+    static uint32_t getChecksum(const RecordHeader& header, const uint8_t* packet) {
+        const uint8_t* fields = reinterpret_cast<const uint8_t*>(&header) + offsetof(RecordHeader, size);
+        uint32_t checksum = hash(2166136261U, fields, offsetof(RecordHeader, checksum) - offsetof(RecordHeader, size));
+        return hash(checksum, packet, header.size);
+    }
+
+    /**
+     * @brief Check the record at an offset of a chunk
+     * 
+     * @param chunk The chunk
+     * @param offset The offset of the record in the chunk
+     * @param chunk_size The size of the chunk
+     * @return The header of the record if it is complete, nullptr otherwise
+     */
+    static const RecordHeader* checkRecord(const uint8_t* chunk, std::size_t offset, std::size_t chunk_size) {
+        if(offset + sizeof(RecordHeader) > chunk_size) {
+            return nullptr;
+        }
+
+        const RecordHeader* header = reinterpret_cast<const RecordHeader*>(chunk + offset);
+        if(header->sync != RECORD_SYNC || getRecordSize(header->size) > chunk_size - offset) {
+            return nullptr;
+        }
+        const uint8_t* packet = chunk + offset + sizeof(RecordHeader);
+        return getChecksum(*header, packet) == header->checksum ? header : nullptr;
+    }
+
+    /**
+     * @brief Walk the complete records of a chunk, and rebuild its header from them
+     * 
+     * @param chunk The chunk
+     * @param chunk_size The size of the chunk
+     * @return The header of the chunk, as found from its records
+     */
+    static ChunkHeader recoverChunk(const uint8_t* chunk, std::size_t chunk_size) {
+        ChunkHeader recovered = {};
+        recovered.magic = CHUNK_MAGIC;
+        recovered.end = sizeof(ChunkHeader);
+
+        const RecordHeader* record;
+        while((record = checkRecord(chunk, recovered.end, chunk_size)) != nullptr) {
+            if(recovered.nb_records == 0) {
+                recovered.first_time = record->timestamp;
+            }
+            recovered.last_time = record->timestamp;
+            recovered.nb_records++;
+            if(record->apid <= SpPrimaryHeader::PacketApid::IDLE_VALUE) {
+                recovered.apids[record->apid / 64] |= uint64_t(1) << (record->apid % 64);
+            }
+            recovered.end += getRecordSize(record->size);
+        }
+        return recovered;
+    }
+
+    static std::size_t getPageSize() {
+        long page_size = sysconf(_SC_PAGESIZE);
+        return page_size > 0 ? static_cast<std::size_t>(page_size) : 4096;
+    }
+};
+
+/**
+ * @brief Counters of a capture recorder
+ */
+struct SpCaptureStats {
+    /** Spacepackets recorded */
+    uint64_t nb_records = 0;
+    /** Bytes of spacepackets recorded */
+    uint64_t nb_bytes = 0;
+    /** Spacepackets not recorded, because the file could not grow */
+    uint64_t nb_dropped = 0;
+};
+
+/**
+ * @brief Layer that records every spacepacket going through it, in both directions, in a capture
+ *        file (@see{SpCaptureFormat}), and passes them on unchanged. Spacepackets can also be
+ *        recorded directly, e.g from a listener.
+ * @verbatim
+ *          -------------------------------------
+ *          |        SpTransferService          |
+ *          -------------------------------------
+ *                   |                 ^
+ *          -------------------------------------
+ *          |  SpCaptureRecorder    -> file     |
+ *          -------------------------------------
+ *                   v                 |
+ *          -------------------------------------
+ *          |              Sub-Layer            |
+ *          -------------------------------------
+ * @endverbatim
+ * @code
+ *          SpCaptureRecorder<> recorder;
+ *          recorder.open("pass.spcap");
+ *          recorder.connectUpperLayer(service);
+ *          link.connectUpperLayer(recorder);
+ * @endcode
+ * 
+ * @details Only the chunk being written is mapped; recording a spacepacket is a copy in the mapping,
+ *          without system call, except when a new chunk is started. The space of a chunk is reserved
+ *          on disk when it is started, so a full disk drops spacepackets (counted) instead of crashing.
+ *          The pages are written back by the operating system: a crash of the process loses nothing,
+ *          flush() must be called to also survive a crash of the system. The timestamps never go back,
+ *          even when appending to an existing capture. Recording is serialized between threads.
+ * 
+ * @tparam Clock The clock used to timestamp the records. @see{MonotonicClock}
+ */
+template<typename Clock = MonotonicClock>
+class SpCaptureRecorder : public ICommunicationLayer
+{
+public:
+    enum : std::size_t {
+        /** Default size of a chunk */
+        DEFAULT_CHUNK_SIZE = 4U * 1024U * 1024U,
+    };
+
+    SpCaptureRecorder() = default;
+    SpCaptureRecorder(const SpCaptureRecorder& other) = delete;
+    SpCaptureRecorder& operator=(const SpCaptureRecorder& other) = delete;
+
+    ~SpCaptureRecorder() {
+        this->close();
+    }
+
+    /**
+     * @brief Open a capture file for recording
+     * 
+     * @param path The path of the file
+     * @param append true to record after the content of an existing capture (recovering its tail if
+     *               it was not closed), false to start a new capture
+     * @param chunk_size The size of a chunk, rounded up to a multiple of the page size. Ignored when
+     *                   appending to an existing capture.
+     * @return false if the file could not be opened, or is not a valid capture, true otherwise
+     */
+    bool open(const char* path, bool append = false, std::size_t chunk_size = DEFAULT_CHUNK_SIZE) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->closeFile();
+
+        fd = ::open(path, O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+        if(fd < 0) {
+            return false;
+        }
+
+        struct stat status;
+        bool opened = (fstat(fd, &status) == 0)
+                   && ((status.st_size == 0) ? this->create(chunk_size) : this->recover());
+        if(!opened) {
+            this->closeFile();
+        }
+        return opened;
+    }
+
+    /**
+     * @brief Close the capture file, after writing back its pages
+     */
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->closeFile();
+    }
+
+    /**
+     * @return true if a capture file is open, false otherwise
+     */
+    bool isOpen() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return fd >= 0;
+    }
+
+    /**
+     * @brief Write back the recorded pages to the disk
+     * 
+     * @param wait true to wait for the writes to be done, false to only start them
+     * @return false if no file is open or the pages could not be written, true otherwise
+     */
+    bool flush(bool wait = true) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(fd < 0) {
+            return false;
+        }
+
+        int flags = wait ? MS_SYNC : MS_ASYNC;
+        bool flushed = msync(file_header, data_offset, flags) == 0;
+        if(chunk != nullptr) {
+            flushed = (msync(chunk, chunk_size, flags) == 0) && flushed;
+        }
+        return flushed;
+    }
+
+    /**
+     * @brief Record a spacepacket
+     * 
+     * @param packet The spacepacket
+     * @param direction SP_CAPTURE_RX or SP_CAPTURE_TX
+     * @return false if no file is open or the spacepacket could not be recorded, true otherwise
+     */
+    bool record(const IBuffer& packet, SpCaptureDirection direction) {
+        return this->record(packet.getStart(), packet.getSize(), direction, [&packet](uint8_t* dst) {
+            std::memcpy(dst, packet.getStart(), packet.getSize());
+        });
+    }
+
+    /**
+     * @brief Record a scattered spacepacket. @see{record}
+     */
+    bool record(const IBufferChain& packet, SpCaptureDirection direction) {
+        const uint8_t* first = packet.getNbSegments() > 0 ? packet.getSegment(0).getStart() : nullptr;
+        std::size_t first_size = packet.getNbSegments() > 0 ? packet.getSegment(0).getSize() : 0;
+        std::size_t size = packet.getSize();
+        return this->record(first_size >= SpPrimaryHeader::SIZE ? first : nullptr, size, direction,
+                            [&packet, size](uint8_t* dst) {
+            UserBuffer dst_buffer(dst, size);
+            packet.copyTo(dst_buffer);
+        });
+    }
+
+    /**
+     * @return The counters of the recorder, since it was constructed
+     */
+    SpCaptureStats getStats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+private:
+    using Format = SpCaptureFormat;
+
+    void receiveFromUpperLayer(const IBuffer& bytes) override {
+        this->record(bytes, SP_CAPTURE_TX);
+        this->pushToSubLayer(bytes);
+    }
+
+    void receiveChainFromUpperLayer(const IBufferChain& chain) override {
+        this->record(chain, SP_CAPTURE_TX);
+        this->pushToSubLayer(chain);
+    }
+
+    void receiveFromSubLayer(const IBuffer& bytes) override {
+        this->record(bytes, SP_CAPTURE_RX);
+        this->pushToUpperLayer(bytes);
+    }
+
+    void receiveChainFromSubLayer(const IBufferChain& chain) override {
+        this->record(chain, SP_CAPTURE_RX);
+        this->pushToUpperLayer(chain);
+    }
+
+    void receiveBatchFromSubLayer(Span<const UserBuffer> batch) override {
+        for(const UserBuffer& bytes : batch) {
+            this->record(bytes, SP_CAPTURE_RX);
+        }
+        this->pushBatchToUpperLayer(batch);
+    }
+
+    /**
+     * @brief Append a record to the current chunk, starting a new one if it is full
+     * 
+     * @param header The first bytes of the spacepacket, holding at least its primary header, nullptr
+     *               if it has none
+     * @param size The size of the spacepacket
+     * @param direction The direction of the spacepacket
+     * @param copy The function copying the spacepacket in the record (uint8_t*)
+     */
+    template<typename Copy>
+    bool record(const uint8_t* header, std::size_t size, SpCaptureDirection direction, Copy&& copy) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(fd < 0) {
+            return false;
+        }
+
+        std::size_t record_size = Format::getRecordSize(size);
+        if(record_size > chunk_size - sizeof(Format::ChunkHeader)) {
+            stats.nb_dropped++;
+            return false;
+        }
+
+        Format::ChunkHeader* chunk_header = reinterpret_cast<Format::ChunkHeader*>(chunk);
+        if(chunk == nullptr || chunk_header->end + record_size > chunk_size) {
+            if(!this->startChunk()) {
+                stats.nb_dropped++;
+                return false;
+            }
+            chunk_header = reinterpret_cast<Format::ChunkHeader*>(chunk);
+        }
+
+        uint64_t timestamp = Clock::now() + time_shift;
+        if(timestamp < last_time) {
+            timestamp = last_time;
+        }
+        last_time = timestamp;
+
+        std::size_t offset = chunk_header->end;
+        Format::RecordHeader* record = reinterpret_cast<Format::RecordHeader*>(chunk + offset);
+        uint8_t* packet = chunk + offset + sizeof(Format::RecordHeader);
+        copy(packet);
+
+        record->size = static_cast<uint32_t>(size);
+        record->timestamp = timestamp;
+        bool has_apid = header != nullptr && size >= SpPrimaryHeader::SIZE;
+        record->apid = has_apid ? SpPrimaryHeader::peekApid(header) : static_cast<uint16_t>(Format::NO_APID);
+        record->direction = direction;
+        record->reserved = 0;
+        record->checksum = Format::getChecksum(*record, packet);
+        // the sync word last: a record cut by a crash is never taken as complete
+        std::atomic_signal_fence(std::memory_order_release);
+        record->sync = Format::RECORD_SYNC;
+        std::atomic_signal_fence(std::memory_order_release);
+
+        if(chunk_header->nb_records == 0) {
+            chunk_header->first_time = timestamp;
+        }
+        chunk_header->last_time = timestamp;
+        if(has_apid) {
+            chunk_header->apids[record->apid / 64] |= uint64_t(1) << (record->apid % 64);
+        }
+        chunk_header->end = offset + record_size;
+        chunk_header->nb_records++;
+
+        stats.nb_records++;
+        stats.nb_bytes += size;
+        return true;
+    }
+
+    /**
+     * @brief Write the header of a new capture file
+     */
+    bool create(std::size_t requested_chunk_size) {
+        std::size_t page_size = Format::getPageSize();
+        std::size_t min_chunk_size = sizeof(Format::ChunkHeader) + Format::getRecordSize(SPACEPACKET_MAX_SIZE);
+        if(requested_chunk_size < min_chunk_size) {
+            requested_chunk_size = min_chunk_size;
+        }
+        chunk_size = (requested_chunk_size + page_size - 1) / page_size * page_size;
+        data_offset = (sizeof(Format::FileHeader) + page_size - 1) / page_size * page_size;
+
+        if(ftruncate(fd, static_cast<off_t>(data_offset)) != 0 || !this->mapFileHeader()) {
+            return false;
+        }
+
+        std::memcpy(file_header->magic, Format::MAGIC, sizeof(Format::MAGIC));
+        file_header->version = Format::VERSION;
+        file_header->endianness_mark = Format::ENDIANNESS_MARK;
+        file_header->data_offset = data_offset;
+        file_header->chunk_size = chunk_size;
+        file_header->nb_chunks = 0;
+        nb_chunks = 0;
+        time_shift = 0;
+        last_time = 0;
+        return true;
+    }
+
+    /**
+     * @brief Open an existing capture file for appending: check its header, and clean up the end of
+     *        its last chunk if the recording was cut short
+     */
+    bool recover() {
+        Format::FileHeader header;
+        if(pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))
+        || std::memcmp(header.magic, Format::MAGIC, sizeof(Format::MAGIC)) != 0
+        || header.version != Format::VERSION || header.endianness_mark != Format::ENDIANNESS_MARK
+        || header.data_offset % Format::getPageSize() != 0 || header.chunk_size % Format::getPageSize() != 0
+        || header.chunk_size < sizeof(Format::ChunkHeader) + Format::getRecordSize(SPACEPACKET_MAX_SIZE)) {
+            return false;
+        }
+
+        data_offset = header.data_offset;
+        chunk_size = header.chunk_size;
+        if(!this->mapFileHeader()) {
+            return false;
+        }
+
+        // a chunk started but not reserved yet (crash in between) is ignored
+        struct stat status;
+        if(fstat(fd, &status) != 0 || static_cast<std::size_t>(status.st_size) < data_offset) {
+            return false;
+        }
+        uint64_t nb_reserved = (static_cast<std::size_t>(status.st_size) - data_offset) / chunk_size;
+        nb_chunks = (file_header->nb_chunks < nb_reserved) ? file_header->nb_chunks : nb_reserved;
+        file_header->nb_chunks = nb_chunks;
+        last_time = 0;
+        if(nb_chunks > 0) {
+            if(!this->mapChunk(nb_chunks - 1)) {
+                return false;
+            }
+
+            Format::ChunkHeader recovered = Format::recoverChunk(chunk, chunk_size);
+            std::memset(chunk + recovered.end, 0, chunk_size - recovered.end);
+            std::memcpy(chunk, &recovered, sizeof(recovered));
+            last_time = recovered.last_time;
+        }
+
+        // continue the timeline where the capture stopped, whatever the origin of the clock
+        uint64_t now = Clock::now();
+        time_shift = (last_time > now) ? last_time - now : 0;
+        return true;
+    }
+
+    /**
+     * @brief Reserve the space of a new chunk at the end of the file, and map it
+     */
+    bool startChunk() {
+        off_t end = static_cast<off_t>(data_offset + (nb_chunks + 1) * chunk_size);
+        if(posix_fallocate(fd, 0, end) != 0) {
+            return false;
+        }
+
+        this->unmapChunk();
+        if(!this->mapChunk(nb_chunks)) {
+            return false;
+        }
+
+        Format::ChunkHeader* chunk_header = reinterpret_cast<Format::ChunkHeader*>(chunk);
+        std::memset(chunk_header, 0, sizeof(Format::ChunkHeader));
+        chunk_header->magic = Format::CHUNK_MAGIC;
+        chunk_header->end = sizeof(Format::ChunkHeader);
+        nb_chunks++;
+        file_header->nb_chunks = nb_chunks;
+        return true;
+    }
+
+    bool mapFileHeader() {
+        void* mapping = mmap(nullptr, data_offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        file_header = (mapping != MAP_FAILED) ? static_cast<Format::FileHeader*>(mapping) : nullptr;
+        return file_header != nullptr;
+    }
+
+    bool mapChunk(uint64_t index) {
+        off_t offset = static_cast<off_t>(data_offset + index * chunk_size);
+        void* mapping = mmap(nullptr, chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+        chunk = (mapping != MAP_FAILED) ? static_cast<uint8_t*>(mapping) : nullptr;
+        return chunk != nullptr;
+    }
+
+    void unmapChunk() {
+        if(chunk != nullptr) {
+            munmap(chunk, chunk_size);
+            chunk = nullptr;
+        }
+    }
+
+    void closeFile() {
+        this->unmapChunk();
+        if(file_header != nullptr) {
+            munmap(file_header, data_offset);
+            file_header = nullptr;
+        }
+        if(fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    int                     fd = -1;
+    /** The header of the file, mapped */
+    Format::FileHeader*     file_header = nullptr;
+    /** The chunk being written, mapped, nullptr before the first record */
+    uint8_t*                chunk = nullptr;
+    std::size_t             data_offset = 0;
+    std::size_t             chunk_size = 0;
+    uint64_t                nb_chunks = 0;
+    /** Added to the clock, so that an appended capture never goes back in time */
+    uint64_t                time_shift = 0;
+    /** Timestamp of the last record */
+    uint64_t                last_time = 0;
+
+    SpCaptureStats          stats;
+    mutable std::mutex      mutex;
+};
+
+/**
+ * @brief A spacepacket read from a capture file
+ */
+struct SpCaptureRecord {
+    /** Reception or transmission time, in nanoseconds */
+    uint64_t            timestamp = 0;
+    /** APID of the spacepacket, SpCaptureFormat::NO_APID if it is too short to have one */
+    uint16_t            apid = SpCaptureFormat::NO_APID;
+    SpCaptureDirection  direction = SP_CAPTURE_RX;
+    /** The spacepacket bytes, in the mapping of the reader */
+    UserBuffer          packet;
+};
+
+/**
+ * @brief Which records of a capture to read. @see{SpCaptureReader::find}
+ */
+struct SpCaptureQuery {
+    /** Records from this time (included), in nanoseconds */
+    uint64_t    from_time = 0;
+    /** Records up to this time (excluded), in nanoseconds */
+    uint64_t    to_time = UINT64_MAX;
+    /** Only the records of this APID, SpCaptureFormat::NO_APID for every record */
+    uint16_t    apid = SpCaptureFormat::NO_APID;
+    /** Only the records of these directions (SpCaptureDirection) */
+    uint8_t     directions = SP_CAPTURE_BOTH;
+};
+
+class SpCaptureReader;
+
+/**
+ * @brief Reads, in order, the records of a capture that match a query. The chunks without any
+ *        record of the APID or of the time span of the query are skipped from their header alone.
+ */
+class SpCaptureCursor
+{
+public:
+    SpCaptureCursor() = default;
+
+    /**
+     * @brief Read the next record matching the query
+     * 
+     * @param record Where to put the record
+     * @return false if there are no more records, true otherwise
+     */
+    inline bool next(SpCaptureRecord& record);
+
+private:
+    friend class SpCaptureReader;
+
+    SpCaptureCursor(const SpCaptureReader* reader, const SpCaptureQuery& query, uint64_t chunk_index)
+    : reader(reader), query(query), chunk_index(chunk_index) {}
+
+    const SpCaptureReader*  reader = nullptr;
+    SpCaptureQuery          query;
+    /** The chunk being read */
+    uint64_t                chunk_index = 0;
+    /** The offset of the next record in the chunk, 0 if the chunk was not entered yet */
+    std::size_t             offset = 0;
+};
+
+/**
+ * @brief Reader of a capture file (@see{SpCaptureFormat}), mapped as a whole. A capture that was not
+ *        closed (e.g the recorder crashed) is read up to its last complete record. The records read
+ *        stay valid until the reader is closed; changing them does not change the file.
+ * @code
+ *          SpCaptureReader reader;
+ *          reader.open("pass.spcap");
+ *          SpCaptureQuery query;
+ *          query.apid = 42;
+ *          SpCaptureCursor cursor = reader.find(query);
+ *          SpCaptureRecord record;
+ *          while(cursor.next(record)) {
+ *              ...
+ *          }
+ * @endcode
+ */
+class SpCaptureReader
+{
+public:
+    SpCaptureReader() = default;
+    SpCaptureReader(const SpCaptureReader& other) = delete;
+    SpCaptureReader& operator=(const SpCaptureReader& other) = delete;
+
+    ~SpCaptureReader() {
+        this->close();
+    }
+
+    /**
+     * @brief Open a capture file for reading
+     * 
+     * @param path The path of the file
+     * @return false if the file could not be opened, or is not a valid capture, true otherwise
+     */
+    bool open(const char* path) {
+        this->close();
+
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+
+        struct stat status;
+        bool mapped = fstat(fd, &status) == 0 && static_cast<std::size_t>(status.st_size) >= sizeof(Format::FileHeader);
+        if(mapped) {
+            mapping_size = static_cast<std::size_t>(status.st_size);
+            void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            file = (mapping != MAP_FAILED) ? static_cast<uint8_t*>(mapping) : nullptr;
+        }
+        ::close(fd);
+
+        if(file == nullptr || !this->load()) {
+            this->close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Unmap the capture file. The records read become invalid.
+     */
+    void close() {
+        if(file != nullptr) {
+            munmap(file, mapping_size);
+        }
+        file = nullptr;
+        mapping_size = 0;
+        nb_chunks = 0;
+        nb_records = 0;
+    }
+
+    /**
+     * @return true if a capture file is open, false otherwise
+     */
+    bool isOpen() const {
+        return file != nullptr;
+    }
+
+    /**
+     * @return The amount of records in the capture
+     */
+    uint64_t getNbRecords() const {
+        return nb_records;
+    }
+
+    /**
+     * @return The amount of chunks in the capture
+     */
+    uint64_t getNbChunks() const {
+        return nb_chunks;
+    }
+
+    /**
+     * @return The timestamp of the first record, 0 if there are none
+     */
+    uint64_t getStartTime() const {
+        return nb_records > 0 ? this->getChunk(0).first_time : 0;
+    }
+
+    /**
+     * @return The timestamp of the last record, 0 if there are none
+     */
+    uint64_t getEndTime() const {
+        for(uint64_t i = nb_chunks; i > 0; i--) {
+            if(this->getChunk(i - 1).nb_records > 0) {
+                return this->getChunk(i - 1).last_time;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @param index The index of a chunk, below getNbChunks()
+     * @return The header of the chunk: the time span and the APIDs of its records
+     */
+    const SpCaptureFormat::ChunkHeader& getChunk(uint64_t index) const {
+        if(index + 1 == nb_chunks) {
+            return last_chunk;
+        }
+        return *reinterpret_cast<const Format::ChunkHeader*>(this->getChunkStart(index));
+    }
+
+    /**
+     * @brief Find the records matching a query. The first chunk to read is found by a binary search
+     *        on the time of the chunks.
+     * 
+     * @param query The query
+     * @return The cursor reading the records
+     */
+    SpCaptureCursor find(const SpCaptureQuery& query = SpCaptureQuery()) const {
+        // the first chunk that ends at or after the start of the query
+        uint64_t low = 0;
+        uint64_t high = nb_chunks;
+        while(low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            const Format::ChunkHeader& chunk = this->getChunk(middle);
+            if(chunk.nb_records > 0 && chunk.last_time < query.from_time) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return SpCaptureCursor(this, query, low);
+    }
+
+private:
+    using Format = SpCaptureFormat;
+    friend class SpCaptureCursor;
+
+    /**
+     * @brief Check the header of the file, and recover the last chunk
+     */
+    bool load() {
+        const Format::FileHeader* header = reinterpret_cast<const Format::FileHeader*>(file);
+        if(std::memcmp(header->magic, Format::MAGIC, sizeof(Format::MAGIC)) != 0
+        || header->version != Format::VERSION || header->endianness_mark != Format::ENDIANNESS_MARK
+        || header->chunk_size < sizeof(Format::ChunkHeader) || header->data_offset < sizeof(Format::FileHeader)
+        || header->data_offset > mapping_size) {
+            return false;
+        }
+
+        data_offset = header->data_offset;
+        chunk_size = header->chunk_size;
+        // a chunk started but not reserved yet (crash in between) is ignored
+        uint64_t nb_mapped = (mapping_size - data_offset) / chunk_size;
+        nb_chunks = (header->nb_chunks < nb_mapped) ? header->nb_chunks : nb_mapped;
+
+        // only the last chunk may have been cut short: its header is rebuilt from its records
+        if(nb_chunks > 0) {
+            last_chunk = Format::recoverChunk(this->getChunkStart(nb_chunks - 1), chunk_size);
+        }
+
+        nb_records = 0;
+        for(uint64_t i = 0; i < nb_chunks; i++) {
+            nb_records += this->getChunk(i).nb_records;
+        }
+        return true;
+    }
+
+    uint8_t* getChunkStart(uint64_t index) const {
+        return file + data_offset + index * chunk_size;
+    }
+
+    uint8_t*            file = nullptr;
+    std::size_t         mapping_size = 0;
+    std::size_t         data_offset = 0;
+    std::size_t         chunk_size = 0;
+    uint64_t            nb_chunks = 0;
+    uint64_t            nb_records = 0;
+    /** The header of the last chunk, as recovered from its records */
+    Format::ChunkHeader last_chunk = {};
+};
+
+bool SpCaptureCursor::next(SpCaptureRecord& record) {
+    if(reader == nullptr) {
+        return false;
+    }
+
+    while(chunk_index < reader->nb_chunks) {
+        const SpCaptureFormat::ChunkHeader& chunk = reader->getChunk(chunk_index);
+        if(offset == 0) {
+            if(chunk.nb_records > 0 && chunk.first_time >= query.to_time) {
+                break;
+            }
+            bool skipped = chunk.nb_records == 0 || chunk.last_time < query.from_time
+                        || (query.apid != SpCaptureFormat::NO_APID && !chunk.hasApid(query.apid));
+            if(skipped) {
+                chunk_index++;
+                continue;
+            }
+            offset = sizeof(SpCaptureFormat::ChunkHeader);
+        }
+
+        uint8_t* start = reader->getChunkStart(chunk_index);
+        std::size_t end = (chunk.end < reader->chunk_size) ? chunk.end : reader->chunk_size;
+        while(offset + sizeof(SpCaptureFormat::RecordHeader) <= end) {
+            const SpCaptureFormat::RecordHeader* header = reinterpret_cast<const SpCaptureFormat::RecordHeader*>(start + offset);
+            std::size_t record_offset = offset;
+            if(SpCaptureFormat::getRecordSize(header->size) > end - offset) {
+                break;
+            }
+            offset += SpCaptureFormat::getRecordSize(header->size);
+
+            if(header->timestamp >= query.to_time) {
+                chunk_index = reader->nb_chunks;
+                return false;
+            }
+            bool matches = header->timestamp >= query.from_time && (header->direction & query.directions)
+                        && (query.apid == SpCaptureFormat::NO_APID || header->apid == query.apid);
+            if(matches) {
+                record.timestamp = header->timestamp;
+                record.apid = header->apid;
+                record.direction = static_cast<SpCaptureDirection>(header->direction);
+                record.packet = UserBuffer(start + record_offset + sizeof(*header), header->size);
+                return true;
+            }
+        }
+
+        chunk_index++;
+        offset = 0;
+    }
+
+    chunk_index = reader->nb_chunks;
+    return false;
+}
+
+} //namespace
+
+#endif //CCSDS_CAPTURE_HPP
@@ -0,0 +1,281 @@
+/**************************************************************************//**
+ * @file duplicate.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a class that detects the spacepackets of an APID received more than once
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_DUPLICATE_HPP
+#define CCSDS_DUPLICATE_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+namespace ccsds
+{
+
+/**
+ * @brief Statistics of a duplicate filter
+ */
+struct SpDuplicateStats {
+    /** Spacepackets dropped because their sequence count (and content) was already seen */
+    uint64_t nb_duplicates = 0;
+    /** Spacepackets kept because their sequence count was seen, but with another content */
+    uint64_t nb_collisions = 0;
+    /** Spacepackets kept because their sequence count was too old to be checked */
+    uint64_t nb_unchecked = 0;
+};
+
+/**
+ * @brief Filter of the spacepackets of an APID received more than once (e.g the same stream fed by
+ *        redundant ground stations). It remembers which of the last W sequence counts were seen, in
+ *        a bitmap that slides with the most recent count.
+ * 
+ * @details With a window of W sequence counts and a most recent count N:
+ *          - counts ahead of N (up to half of the sequence count range) are new, and slide the window
+ *            once remembered;
+ *          - counts N-W+1 to N are duplicates if their bit is set, and new otherwise;
+ *          - counts further behind are too old to be checked, and are kept.
+ *          A spacepacket that is not a duplicate is offered to the receiver, and only remembered if
+ *          the receiver takes it, so that a redundant copy of a spacepacket rejected (e.g out of
+ *          sequence) is not dropped as a duplicate. Both happen under the lock of the filter: two
+ *          copies received at once by different threads cannot both pass.
+ *          With the content hash, a seen count is only a duplicate if the spacepacket has the same
+ *          content (FNV-1a hash) as the first one received, so a source that restarted its sequence
+ *          counts is not filtered out. Each spacepacket costs a constant amount of work (plus the hash
+ *          of its bytes, if enabled), and the memory is allocated once, when the filter is created.
+ * 
+ * @tparam Allocator The allocator used for the bitmap. @see{isAllocator}
+ */
+template<typename Allocator = DefaultAllocator>
+class SpDuplicateFilter : private AllocatorHolder<Allocator>
+{
+public:
+    enum {
+        /** Minimum amount of sequence counts in a window (one word of the bitmap) */
+        MIN_WINDOW_SIZE = 64,
+        /** Maximum amount of sequence counts in a window (half of the sequence count range) */
+        MAX_WINDOW_SIZE = (1U << SpPrimaryHeader::SEQUENCE_COUNT_WIDTH) / 2,
+    };
+
+    /**
+     * @brief Construct a new SpDuplicateFilter object
+     * 
+     * @param window_size The amount of sequence counts remembered, rounded up to a power of 2,
+     *                    between MIN_WINDOW_SIZE and MAX_WINDOW_SIZE
+     * @param use_hash true to also compare the content of the spacepackets, false to only compare
+     *                 their sequence counts
+     * @param alloc The allocator to use for the bitmap
+     */
+    SpDuplicateFilter(std::size_t window_size, bool use_hash, const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc) {
+        // a power of 2 divides the sequence count range: the bitmap wraps with the sequence count
+        std::size_t rounded = MIN_WINDOW_SIZE;
+        while(rounded < window_size && rounded < MAX_WINDOW_SIZE) {
+            rounded <<= 1;
+        }
+        window_size = rounded;
+
+        std::size_t nb_bytes = (window_size / 64) * sizeof(uint64_t) + (use_hash ? window_size * sizeof(uint32_t) : 0);
+        memory = this->getAllocator().allocateBuffer(nb_bytes, ALLOC_SITE_DUPLICATES);
+        if(memory.getStart() == nullptr) {
+            return;
+        }
+
+        std::memset(memory.getStart(), 0, nb_bytes);
+        seen = reinterpret_cast<uint64_t*>(memory.getStart());
+        hashes = use_hash ? reinterpret_cast<uint32_t*>(seen + window_size / 64) : nullptr;
+        this->window_size = window_size;
+    }
+
+    SpDuplicateFilter(const SpDuplicateFilter& other) = delete;
+    SpDuplicateFilter& operator=(const SpDuplicateFilter& other) = delete;
+
+    ~SpDuplicateFilter() {
+        this->getAllocator().deallocateBuffer(memory, ALLOC_SITE_DUPLICATES);
+    }
+
+    /**
+     * @return false if the bitmap could not be allocated, true otherwise
+     */
+    bool isValid() const {
+        return window_size > 0;
+    }
+
+    /**
+     * @brief Receive a spacepacket: drop it if it is a duplicate, otherwise offer it to the receiver,
+     *        and remember it if taken
+     * 
+     * @param count The sequence count of the spacepacket
+     * @param packet The spacepacket (IBuffer or IBufferChain), only read with the content hash
+     * @param take The function offered the spacepacket (bool()), returning true if it is taken. It is
+     *             called under the lock of the filter, and must not call back the filter.
+     * @return true if the spacepacket was taken, false if it was a duplicate or not taken
+     */
+    template<typename BufferType, typename Take>
+    bool receive(uint16_t count, const BufferType& packet, Take&& take) {
+        count &= COUNT_MASK;
+        uint32_t hash = (hashes != nullptr) ? computeHash(packet) : 0;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if(this->isDuplicate(count, hash) || !take()) {
+            return false;
+        }
+        this->remember(count, hash);
+        return true;
+    }
+
+    /**
+     * @return The statistics of the filter
+     */
+    SpDuplicateStats getStats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+private:
+    enum : uint32_t {
+        /** Amount of possible sequence counts */
+        COUNT_RANGE = 1U << SpPrimaryHeader::SEQUENCE_COUNT_WIDTH,
+        COUNT_MASK  = COUNT_RANGE - 1,
+        /** Counts further ahead than this are considered behind */
+        HALF_RANGE  = COUNT_RANGE / 2,
+    };
+
+    enum : uint32_t {
+        FNV_OFFSET_BASIS = 2166136261U,
+        FNV_PRIME        = 16777619U,
+    };
+
+    static std::size_t distance(uint16_t from, uint16_t to) {
+        return (static_cast<uint32_t>(to) - from) & COUNT_MASK;
+    }
+
+    static uint32_t hashBytes(uint32_t hash, const uint8_t* bytes, std::size_t size) {
+        for(std::size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * FNV_PRIME;
+        }
+        return hash;
+    }
+
+    static uint32_t computeHash(const IBuffer& packet) {
+        return hashBytes(FNV_OFFSET_BASIS, packet.getStart(), packet.getSize());
+    }
+
+    static uint32_t computeHash(const IBufferChain& packet) {
+        uint32_t hash = FNV_OFFSET_BASIS;
+        for(std::size_t i = 0; i < packet.getNbSegments(); i++) {
+            const UserBuffer& segment = packet.getSegment(i);
+            hash = hashBytes(hash, segment.getStart(), segment.getSize());
+        }
+        return hash;
+    }
+
+    /**
+     * @brief Check if a spacepacket is a duplicate, under the lock
+     */
+    bool isDuplicate(uint16_t count, uint32_t hash) {
+        std::size_t ahead = distance(newest, count);
+        if(!started || (ahead != 0 && ahead < HALF_RANGE)) {
+            return false;
+        }
+
+        std::size_t behind = distance(count, newest);
+        if(behind >= window_size) {
+            stats.nb_unchecked++;
+            return false;
+        }
+
+        std::size_t slot = count & (window_size - 1);
+        if(!(seen[slot / 64] & (uint64_t(1) << (slot % 64)))) {
+            return false;
+        }
+
+        if(hashes != nullptr && hashes[slot] != hash) {
+            // same count, other content: the latest one is remembered if it is taken
+            stats.nb_collisions++;
+            return false;
+        }
+
+        stats.nb_duplicates++;
+        return true;
+    }
+
+    /**
+     * @brief Remember a spacepacket taken by the receiver, under the lock
+     */
+    void remember(uint16_t count, uint32_t hash) {
+        if(!started) {
+            started = true;
+            newest = count;
+            this->markSeen(count, hash);
+            return;
+        }
+
+        std::size_t ahead = distance(newest, count);
+        if(ahead != 0 && ahead < HALF_RANGE) {
+            this->slide(ahead);
+            newest = count;
+            this->markSeen(count, hash);
+        } else if(distance(count, newest) < window_size) {
+            this->markSeen(count, hash);
+        }
+    }
+
+    void markSeen(uint16_t count, uint32_t hash) {
+        std::size_t slot = count & (window_size - 1);
+        seen[slot / 64] |= uint64_t(1) << (slot % 64);
+        if(hashes != nullptr) {
+            hashes[slot] = hash;
+        }
+    }
+
+    /**
+     * @brief Slide the window ahead: forget the counts that leave it, a word at a time
+     * 
+     * @param ahead The amount of sequence counts to slide by
+     */
+    void slide(std::size_t ahead) {
+        if(ahead >= window_size) {
+            std::memset(seen, 0, window_size / 8);
+            return;
+        }
+
+        // the counts entering the window reuse the slots newest+1 to newest+ahead
+        std::size_t slot = (newest + 1) & (window_size - 1);
+        while(ahead > 0) {
+            std::size_t bit = slot % 64;
+            std::size_t nb_bits = (64 - bit < ahead) ? 64 - bit : ahead;
+            uint64_t mask = (nb_bits == 64) ? ~uint64_t(0) : ((uint64_t(1) << nb_bits) - 1) << bit;
+            seen[slot / 64] &= ~mask;
+            slot = (slot + nb_bits) & (window_size - 1);
+            ahead -= nb_bits;
+        }
+    }
+
+    /** The amount of sequence counts in the window, 0 if the bitmap could not be allocated */
+    std::size_t         window_size = 0;
+    /** The memory of the bitmap and of the hashes */
+    UserBuffer          memory;
+    /** One bit per sequence count of the window, set if it was seen */
+    uint64_t*           seen = nullptr;
+    /** The content hash of each sequence count of the window, nullptr if not compared */
+    uint32_t*           hashes = nullptr;
+    /** The most recent sequence count seen */
+    uint16_t            newest = 0;
+    /** false until the first spacepacket */
+    bool                started = false;
+
+    SpDuplicateStats    stats;
+    mutable std::mutex  mutex;
+};
+
+} //namespace
+
+#endif //CCSDS_DUPLICATE_HPP
@@ -0,0 +1,155 @@
+/**************************************************************************//**
+ * @file idlecache.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a cache of ready-made idle spacepackets
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_IDLECACHE_HPP
+#define CCSDS_IDLECACHE_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "utils/obitstream.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include "spacepacket/spacepacket.hpp"
+#include <cstdint>
+
+namespace ccsds
+{
+
+/**
+ * @brief Cache of encoded idle spacepackets, for the sizes that are needed again and again (e.g to fill
+ *        the gaps of fixed-size frames). An idle spacepacket is built once per size, and then only its
+ *        sequence count is written when it is transmitted.
+ * @code
+ *          SpIdleCache<> idle_cache;
+ *          // frame thread, when a gap of gap_size bytes is left
+ *          IBuffer* idle = idle_cache.get(gap_size);
+ *          if(idle != nullptr) {
+ *              transfer_service.transmitPrebuilt(*idle);
+ *          }
+ * @endcode
+ * 
+ * @details The cache holds up to NbSizes sizes; when full, the least recently used size is replaced.
+ *          The cache is not thread-safe, and a spacepacket it returns must not be transmitted from many
+ *          threads at once (its sequence count is written in place): each thread filling frames should
+ *          have its own cache.
+ * 
+ * @tparam PatternType The idle data pattern type. @see{SpIdleBuilder}
+ * @tparam IdleDataPattern The idle data pattern. @see{SpIdleBuilder}
+ * @tparam Allocator The allocator used for the spacepackets. @see{isAllocator}
+ * @tparam NbSizes The maximum amount of sizes cached
+ */
+template<typename PatternType = uint8_t,
+        PatternType IdleDataPattern = 0xFFU,
+        typename Allocator = DefaultAllocator,
+        std::size_t NbSizes = 8>
+class SpIdleCache : private AllocatorHolder<Allocator>
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+    static_assert(NbSizes > 0, "There must be room for at least one size");
+
+public:
+    /**
+     * @brief Construct a new, empty SpIdleCache object
+     * 
+     * @param alloc The allocator to use for the spacepackets
+     */
+    explicit SpIdleCache(const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc) {}
+
+    SpIdleCache(const SpIdleCache& other) = delete;
+    SpIdleCache& operator=(const SpIdleCache& other) = delete;
+
+    ~SpIdleCache() {
+        this->clear();
+    }
+
+    /**
+     * @brief Get an idle spacepacket of a given size, built if it is not cached yet
+     * 
+     * @param total_size The total size of the spacepacket in bytes, including the primary header
+     * @return The encoded spacepacket, valid until the size is replaced or the cache cleared. nullptr
+     *         if the size is not a valid spacepacket size, or if the allocation failed.
+     */
+    IBuffer* get(std::size_t total_size) {
+        if(total_size < SPACEPACKET_MIN_SIZE || total_size > SPACEPACKET_MAX_SIZE) {
+            return nullptr;
+        }
+
+        use_count++;
+        Entry* replaced = &entries[0];
+        for(Entry& entry : entries) {
+            if(entry.packet.getSize() == total_size) {
+                entry.last_use = use_count;
+                return &entry.packet;
+            }
+            if(entry.last_use < replaced->last_use) {
+                replaced = &entry;
+            }
+        }
+
+        this->free(*replaced);
+        UserBuffer packet = this->getAllocator().allocateBuffer(total_size, ALLOC_SITE_SP_IDLE_BUILDER);
+        if(packet.getStart() == nullptr) {
+            return nullptr;
+        }
+
+        SpPrimaryHeader primary_hdr;
+        primary_hdr.apid.setValue(SpPrimaryHeader::PacketApid::IDLE_VALUE);
+        primary_hdr.length.setLength(static_cast<uint16_t>(total_size - SpPrimaryHeader::getSize()));
+        OBitStream header(packet);
+        header << primary_hdr;
+        SpIdleBuilder<PatternType, IdleDataPattern, Allocator>::fillPattern(packet.getStart() + SpPrimaryHeader::getSize(),
+                                                                            total_size - SpPrimaryHeader::getSize());
+
+        replaced->packet = packet;
+        replaced->last_use = use_count;
+        return &replaced->packet;
+    }
+
+    /**
+     * @return The amount of sizes currently cached
+     */
+    std::size_t getNbCached() const {
+        std::size_t nb_cached = 0;
+        for(const Entry& entry : entries) {
+            nb_cached += (entry.packet.getStart() != nullptr) ? 1 : 0;
+        }
+        return nb_cached;
+    }
+
+    /**
+     * @brief Free every cached spacepacket
+     */
+    void clear() {
+        for(Entry& entry : entries) {
+            this->free(entry);
+        }
+    }
+
+private:
+    struct Entry {
+        /** The encoded idle spacepacket, empty if none */
+        UserBuffer  packet{nullptr, 0};
+        /** When the spacepacket was last returned, 0 if never */
+        uint64_t    last_use = 0;
+    };
+
+    void free(Entry& entry) {
+        if(entry.packet.getStart() != nullptr) {
+            this->getAllocator().deallocateBuffer(entry.packet, ALLOC_SITE_SP_IDLE_BUILDER);
+        }
+        entry.packet = UserBuffer(nullptr, 0);
+        entry.last_use = 0;
+    }
+
+    Entry       entries[NbSizes];
+    /** Amount of calls to get(), to find the least recently used size */
+    uint64_t    use_count = 0;
+};
+
+} //namespace
+
+#endif //CCSDS_IDLECACHE_HPP
@@ -9,6 +9,9 @@
 #define PACKETLISTENER_HPP
 
 #include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
+#include "utils/allocator.hpp"
+#include "utils/span.hpp"
 
 namespace ccsds
 {
@@ -50,6 +53,46 @@ public:
      * @note It is up to the user to interpret the spacepacket bytes. @see{SpExtractor} and @see{SpDissector}.
      */
     virtual void newSpacepacket(const IBuffer& bytes) = 0;
+
+    /**
+     * @brief Callback of new spacepackets whose bytes are scattered in many buffers (@see{IBufferChain}).
+     *        By default, the bytes are gathered in a contiguous buffer and given to newSpacepacket().
+     *        Listeners that can consume scattered memory should override this to avoid the copy, and
+     *        acceptsScattered() to be given the chain by the transfer service.
+     * 
+     * @param bytes The chain of buffers representing the spacepacket broadcasted in the layer
+     */
+    virtual void newScatteredSpacepacket(const IBufferChain& bytes) {
+        gatherChain(bytes, DefaultAllocator(), ALLOC_SITE_UNKNOWN, [this](const IBuffer& contiguous) {
+            this->newSpacepacket(contiguous);
+        });
+    }
+
+    /**
+     * @brief Tell if the listener consumes scattered spacepackets itself. The transfer service gathers
+     *        a scattered spacepacket once, with its own allocator, for all the listeners that do not,
+     *        and gives them the contiguous copy through newSpacepacket().
+     * 
+     * @return true if newScatteredSpacepacket() is overridden to avoid the copy, false otherwise
+     */
+    virtual bool acceptsScattered() const {
+        return false;
+    }
+
+    /**
+     * @brief Callback of many new spacepackets at once, when the transfer service receives a batch
+     *        from its sub-layer (@see{ICommunicationLayer::pushBatchToUpperLayer}). By default, each
+     *        spacepacket is given to newSpacepacket(). Listeners that can consume a batch at once
+     *        (e.g with a single writev() or database insert) should override this.
+     * 
+     * @param batch The spacepackets matching the listener, in reception order for each APID. The
+     *              buffers are only valid during the call.
+     */
+    virtual void newSpacepackets(Span<const UserBuffer> batch) {
+        for(const UserBuffer& bytes : batch) {
+            this->newSpacepacket(bytes);
+        }
+    }
 };
 
 } //namespace
@@ -0,0 +1,779 @@
+/**************************************************************************//**
+ * @file listenerindex.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a class that indexes the listeners of the Spacepacket layer
+ *        by APID
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_LISTENER_INDEX_HPP
+#define CCSDS_LISTENER_INDEX_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/clock.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include "spacepacket/listener.hpp"
+#include "spacepacket/apidset.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace ccsds
+{
+
+/**
+ * @brief Dispatch statistics of a listener, all its registrations combined. @see{SpListenerIndex::enableDispatchStats}
+ */
+struct SpDispatchStats {
+    /** Amount of calls of the listener */
+    uint64_t nb_calls = 0;
+    /** Amount of spacepackets given to the listener (a batch call gives many) */
+    uint64_t nb_packets = 0;
+    /** Total time (in nanoseconds) spent in the listener */
+    uint64_t total_ns = 0;
+    /** Longest call of the listener (in nanoseconds) */
+    uint64_t max_ns = 0;
+};
+
+/**
+ * @brief Index of the listeners registered to the spacepacket layer, organized so that finding the
+ *        listeners of a spacepacket only visits the listeners that match its APID.
+ * 
+ * @details Every registration is an entry taken from a fixed pool. Entries that match a single APID
+ *          are chained in the list of that APID, entries that match every APID are chained in a
+ *          separate wildcard list, and entries that match a set of APIDs (@see{ApidSet}) are chained
+ *          in a list of sets. Within a list, entries keep their registration order. The list heads
+ *          and the pool are allocated in a single block; the bitmap of a set is allocated when the
+ *          set is registered. The sets are also expanded, at every update, into the listeners of each
+ *          APID (a separate block, one pointer per APID of every set): the dispatch never tests a set,
+ *          while an update costs a pass over the APIDs of every set.
+ * 
+ *          The index is read-mostly (read-copy-update): the block is a snapshot that is never modified
+ *          once published. Dispatching reads the current snapshot without a lock, while a registration
+ *          or a removal copies it, changes the copy and publishes it in its place. An old snapshot is
+ *          freed once no dispatch started before its replacement can still be reading it: readers
+ *          count themselves in one of two counters, chosen by the parity of an epoch that updates
+ *          advance only when the other counter is empty. Updates never wait for readers; a snapshot
+ *          still in use is freed by a later update, or by reclaim(). Listeners can thus be registered
+ *          and removed from any thread, including from a listener being notified.
+ * 
+ *          Once enabled, the time spent in each registration is counted in a separate block, indexed
+ *          like the pool of entries (an entry keeps its place across snapshots), so the counters are
+ *          written with relaxed atomics and read without a lock.
+ * 
+ * @tparam Allocator The allocator used for the index memory. @see{isAllocator}
+ */
+template<typename Allocator = DefaultAllocator>
+class SpListenerIndex : private AllocatorHolder<Allocator>
+{
+public:
+    enum {
+        /** Amount of possible APIDs (including idle) */
+        NB_APIDS = SpPrimaryHeader::PacketApid::IDLE_VALUE + 1,
+    };
+
+    /**
+     * @brief Construct a new SpListenerIndex object
+     * 
+     * @param capacity The maximum amount of registrations
+     * @param alloc The allocator to use for the index memory
+     */
+    SpListenerIndex(std::size_t capacity, const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), capacity(capacity) {
+        Snapshot* snapshot = this->allocateSnapshot();
+        if(snapshot == nullptr) {
+            this->capacity = 0;
+            return;
+        }
+        this->initialize(*snapshot);
+        current.store(snapshot, std::memory_order_release);
+    }
+
+    SpListenerIndex(const SpListenerIndex& other) = delete;
+    SpListenerIndex& operator=(const SpListenerIndex& other) = delete;
+
+    /**
+     * @brief Destroy the SpListenerIndex object. No dispatch must be in progress.
+     */
+    ~SpListenerIndex() {
+        DispatchCounters* counters = dispatch_counters.load(std::memory_order_relaxed);
+        if(counters != nullptr) {
+            UserBuffer counters_buffer(counters, capacity * sizeof(DispatchCounters));
+            this->getAllocator().deallocateBuffer(counters_buffer, ALLOC_SITE_TELEMETRY);
+        }
+
+        Snapshot* snapshot = current.load(std::memory_order_relaxed);
+        if(snapshot != nullptr) {
+            snapshot->releases_all_sets = true;
+            this->freeSnapshot(snapshot);
+        }
+        while(retired != nullptr) {
+            Snapshot* next = retired->next_retired;
+            this->freeSnapshot(retired);
+            retired = next;
+        }
+    }
+
+    /**
+     * @brief Remove every registration
+     * 
+     * @return false if the new snapshot could not be allocated (the registrations are kept), true otherwise
+     */
+    bool clear() {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        Snapshot* old = current.load(std::memory_order_relaxed);
+        if(old == nullptr) {
+            return false;
+        }
+
+        Snapshot* snapshot = this->allocateSnapshot();
+        if(snapshot == nullptr) {
+            return false;
+        }
+        this->initialize(*snapshot);
+        old->releases_all_sets = true;
+        this->publish(snapshot);
+        return true;
+    }
+
+    /**
+     * @brief Register a listener for every APID
+     * 
+     * @param listener The listener
+     * @return false if the index is full, true otherwise
+     */
+    bool addWildcard(SpListener* listener) {
+        return this->add(listener, 0, WILDCARD, nullptr);
+    }
+
+    /**
+     * @brief Register a listener for a single APID
+     * 
+     * @param listener The listener
+     * @param apid The APID matched by the listener
+     * @return false if the index is full, true otherwise
+     */
+    bool addApid(SpListener* listener, SpPrimaryHeader::PacketApid apid) {
+        return this->add(listener, apid.getValue(), SINGLE, nullptr);
+    }
+
+    /**
+     * @brief Register a listener for a set of APIDs. The set is copied in the index.
+     * 
+     * @param listener The listener
+     * @param apids The APIDs matched by the listener
+     * @return false if the index is full or if the set could not be allocated, true otherwise
+     */
+    bool addSet(SpListener* listener, const ApidSet& apids) {
+        if(listener == nullptr || capacity == 0) {
+            return false;
+        }
+
+        UserBuffer set_buffer = this->getAllocator().allocateBuffer(sizeof(ApidSet), ALLOC_SITE_TRANSFER_LISTENERS);
+        if(set_buffer.getStart() == nullptr) {
+            return false;
+        }
+
+        ApidSet* set = new (set_buffer.getStart()) ApidSet(apids);
+        if(!this->add(listener, 0, SET, set)) {
+            this->getAllocator().deallocateBuffer(set_buffer, ALLOC_SITE_TRANSFER_LISTENERS);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Remove the oldest registration of a listener. A dispatch in progress on another thread
+     *        may still notify the listener: @see{synchronize} before destroying it.
+     * 
+     * @param listener The listener
+     * @return false if the listener was not registered or if the new snapshot could not be allocated,
+     *         true otherwise
+     */
+    bool remove(SpListener* listener) {
+        if(listener == nullptr) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(update_mutex);
+        Snapshot* old = current.load(std::memory_order_relaxed);
+        if(old == nullptr) {
+            return false;
+        }
+
+        // the pool index of an entry says nothing of its age: freed entries are reused
+        Entry* old_entries = this->getEntries(*old);
+        std::size_t i = capacity;
+        for(std::size_t j = 0; j < capacity; j++) {
+            if(old_entries[j].listener == listener && (i == capacity || old_entries[j].order < old_entries[i].order)) {
+                i = j;
+            }
+        }
+        if(i == capacity) {
+            return false;
+        }
+
+        Snapshot* snapshot = this->copySnapshot(*old);
+        if(snapshot == nullptr) {
+            return false;
+        }
+
+        // find the list holding the entry, and unlink it
+        Entry* entries = this->getEntries(*snapshot);
+        uint32_t* link = this->getListHead(*snapshot, entries[i]);
+        while(*link != i) {
+            link = &entries[*link].next;
+        }
+        *link = entries[i].next;
+        if(!this->indexSets(*snapshot)) {
+            this->freeSnapshot(snapshot);
+            return false;
+        }
+
+        // the set is still read through the old snapshot
+        old->released_set = (entries[i].kind == SET) ? entries[i].set : nullptr;
+        entries[i].listener = nullptr;
+        entries[i].set = nullptr;
+        entries[i].next = snapshot->table.free_head;
+        snapshot->table.free_head = static_cast<uint32_t>(i);
+
+        this->publish(snapshot);
+        return true;
+    }
+
+    /**
+     * @brief Free the old snapshots that are no longer read. Updates already do it, this is only
+     *        needed to free the snapshots that were still read during the last update.
+     */
+    void reclaim() {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        this->reclaimRetired(false);
+    }
+
+    /**
+     * @brief Wait until every dispatch started before the call is done, so that a removed listener
+     *        is no longer notified and can be destroyed. Must not be called from a listener.
+     */
+    void synchronize() {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        this->reclaimRetired(true);
+    }
+
+    /**
+     * @brief Count the calls of every registration, and the time spent in them, from now on
+     *        (@see{getDispatchStats}). The counters are allocated once, and kept until the index is
+     *        destroyed. Counting costs two clock reads per call of a listener.
+     * 
+     * @return false if the counters could not be allocated, true otherwise
+     */
+    bool enableDispatchStats() {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        if(dispatch_counters.load(std::memory_order_relaxed) != nullptr) {
+            return true;
+        }
+
+        UserBuffer counters_buffer = this->getAllocator().allocateBuffer(capacity * sizeof(DispatchCounters),
+                                                                         ALLOC_SITE_TELEMETRY);
+        if(counters_buffer.getStart() == nullptr) {
+            return false;
+        }
+
+        DispatchCounters* counters = reinterpret_cast<DispatchCounters*>(counters_buffer.getStart());
+        for(std::size_t i = 0; i < capacity; i++) {
+            new (&counters[i]) DispatchCounters();
+        }
+        dispatch_counters.store(counters, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Get the dispatch statistics of a listener, all its current registrations combined.
+     *        Can be called while spacepackets are dispatched, without a lock.
+     * 
+     * @param listener The listener
+     * @return The statistics, all 0 if they are not enabled or if the listener is not registered
+     */
+    SpDispatchStats getDispatchStats(const SpListener* listener) const {
+        SpDispatchStats stats;
+        ReadSection section(*this);
+        const DispatchCounters* counters = dispatch_counters.load(std::memory_order_acquire);
+        if(section.snapshot == nullptr || counters == nullptr || listener == nullptr) {
+            return stats;
+        }
+
+        const Entry* entries = this->getEntries(*section.snapshot);
+        for(std::size_t i = 0; i < capacity; i++) {
+            if(entries[i].listener == listener) {
+                stats.nb_calls   += counters[i].nb_calls.load(std::memory_order_relaxed);
+                stats.nb_packets += counters[i].nb_packets.load(std::memory_order_relaxed);
+                stats.total_ns   += counters[i].total_ns.load(std::memory_order_relaxed);
+                uint64_t max_ns = counters[i].max_ns.load(std::memory_order_relaxed);
+                stats.max_ns = (max_ns > stats.max_ns) ? max_ns : stats.max_ns;
+            }
+        }
+        return stats;
+    }
+
+    /**
+     * @brief Call a function for every listener matching an APID. Listeners registered for every
+     *        APID come first, then those registered for a set of APIDs, then those registered for
+     *        the APID itself.
+     * 
+     * @param apid The APID
+     * @param func The function to call, with the listener (SpListener*) as parameter
+     * @param nb_packets The amount of spacepackets each call gives, for the dispatch statistics
+     */
+    template<typename Func>
+    void forEach(SpPrimaryHeader::PacketApid apid, Func&& func, std::size_t nb_packets = 1) const {
+        ReadSection section(*this);
+        if(section.snapshot != nullptr) {
+            Visitor<Func> visitor{func, dispatch_counters.load(std::memory_order_acquire), nb_packets};
+            this->visitWildcard(*section.snapshot, visitor);
+            this->visitSpecific(*section.snapshot, apid, visitor);
+        }
+    }
+
+    /**
+     * @brief Call a function for every listener registered for every APID
+     * 
+     * @param func The function to call, with the listener (SpListener*) as parameter
+     * @param nb_packets The amount of spacepackets each call gives, for the dispatch statistics
+     */
+    template<typename Func>
+    void forEachWildcard(Func&& func, std::size_t nb_packets = 1) const {
+        ReadSection section(*this);
+        if(section.snapshot != nullptr) {
+            Visitor<Func> visitor{func, dispatch_counters.load(std::memory_order_acquire), nb_packets};
+            this->visitWildcard(*section.snapshot, visitor);
+        }
+    }
+
+    /**
+     * @brief Call a function for every listener registered for a set of APIDs or for a single
+     *        APID, that matches an APID. The listeners of a set come first.
+     * 
+     * @param apid The APID
+     * @param func The function to call, with the listener (SpListener*) as parameter
+     * @param nb_packets The amount of spacepackets each call gives, for the dispatch statistics
+     */
+    template<typename Func>
+    void forEachSpecific(SpPrimaryHeader::PacketApid apid, Func&& func, std::size_t nb_packets = 1) const {
+        ReadSection section(*this);
+        if(section.snapshot != nullptr) {
+            Visitor<Func> visitor{func, dispatch_counters.load(std::memory_order_acquire), nb_packets};
+            this->visitSpecific(*section.snapshot, apid, visitor);
+        }
+    }
+
+    /**
+     * @return The maximum amount of registrations
+     */
+    std::size_t getCapacity() const {
+        return capacity;
+    }
+
+private:
+    /** Index of the end of a list */
+    static constexpr uint32_t NO_ENTRY = 0xFFFFFFFFU;
+
+    /** What an entry matches */
+    enum EntryKind : uint8_t {
+        SINGLE,
+        WILDCARD,
+        SET,
+    };
+
+    /** A registration */
+    struct Entry {
+        /** The listener registered, nullptr if the entry is free */
+        SpListener* listener;
+        /** The APIDs matched, if kind is SET */
+        ApidSet*    set;
+        /** Rank of the registration, increasing with every registration */
+        uint64_t    order;
+        /** Next entry in the same list */
+        uint32_t    next;
+        /** The APID matched, if kind is SINGLE */
+        uint16_t    apid;
+        /** What the entry matches */
+        EntryKind   kind;
+    };
+
+    /** A listener of a set, expanded by APID (@see{indexSets}) */
+    struct SetListener {
+        SpListener* listener;
+        /** The entry of the registration */
+        uint32_t    entry;
+    };
+
+    /** The dispatch counters of a registration (@see{enableDispatchStats}) */
+    struct DispatchCounters {
+        std::atomic<uint64_t> nb_calls{0};
+        std::atomic<uint64_t> nb_packets{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+
+        void record(uint64_t elapsed_ns, std::size_t nb_packets) {
+            this->nb_calls.fetch_add(1, std::memory_order_relaxed);
+            this->nb_packets.fetch_add(nb_packets, std::memory_order_relaxed);
+            this->total_ns.fetch_add(elapsed_ns, std::memory_order_relaxed);
+            uint64_t max = this->max_ns.load(std::memory_order_relaxed);
+            while(elapsed_ns > max && !this->max_ns.compare_exchange_weak(max, elapsed_ns, std::memory_order_relaxed)) {
+            }
+        }
+
+        void reset() {
+            nb_calls.store(0, std::memory_order_relaxed);
+            nb_packets.store(0, std::memory_order_relaxed);
+            total_ns.store(0, std::memory_order_relaxed);
+            max_ns.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    /** Calls the function of a dispatch for each registration visited, and counts the calls */
+    template<typename Func>
+    struct Visitor {
+        Func&               func;
+        /** The dispatch counters, nullptr if they are not enabled */
+        DispatchCounters*   counters;
+        std::size_t         nb_packets;
+
+        void operator()(SpListener* listener, uint32_t entry) {
+            if(counters == nullptr) {
+                func(listener);
+                return;
+            }
+
+            uint64_t start = MonotonicClock::now();
+            func(listener);
+            counters[entry].record(MonotonicClock::now() - start, nb_packets);
+        }
+    };
+
+    /** Heads of the lists */
+    struct Table {
+        uint32_t wildcard_head;
+        uint32_t set_head;
+        uint32_t free_head;
+        /** Rank of the next registration */
+        uint64_t next_order;
+        uint32_t heads[NB_APIDS];
+    };
+
+    /** A version of the index, at the beginning of its memory block, followed by its pool of entries */
+    struct Snapshot {
+        /** Next snapshot waiting to be freed */
+        Snapshot*   next_retired;
+        /** The epoch when the snapshot was replaced */
+        uint64_t    retire_epoch;
+        /** The set no longer used once the snapshot is freed, if any */
+        ApidSet*    released_set;
+        /** true if none of the sets of the snapshot are used once it is freed */
+        bool        releases_all_sets;
+        /** The listeners of the sets expanded by APID (@see{indexSets}), nullptr if there are no sets */
+        uint8_t*    set_block;
+        std::size_t set_block_size;
+        /** In the set block, where the set listeners of each APID start, and where the last ones end */
+        const uint32_t*     set_starts;
+        const SetListener*  set_listeners;
+        Table       table;
+    };
+
+    /** Offset of the pool of entries in the memory block, after the list heads */
+    static constexpr std::size_t ENTRIES_OFFSET = (sizeof(Snapshot) + alignof(Entry) - 1) & ~(alignof(Entry) - 1);
+    /** Offset of the set listeners in the set block, after their start by APID */
+    static constexpr std::size_t SET_LISTENERS_OFFSET = ((NB_APIDS + 1) * sizeof(uint32_t) + alignof(SetListener) - 1)
+                                                        & ~(alignof(SetListener) - 1);
+
+    /** Registers a reader for its lifetime, and gives it the current snapshot */
+    struct ReadSection {
+        explicit ReadSection(const SpListenerIndex& index)
+        : counter(index.readers[index.epoch.load(std::memory_order_seq_cst) & 1]) {
+            // the snapshot is loaded once counted: an update that did not see the reader replaced it before
+            counter.fetch_add(1, std::memory_order_seq_cst);
+            snapshot = index.current.load(std::memory_order_seq_cst);
+        }
+        ~ReadSection() {
+            counter.fetch_sub(1, std::memory_order_release);
+        }
+        ReadSection(const ReadSection& other) = delete;
+        ReadSection& operator=(const ReadSection& other) = delete;
+
+        std::atomic<std::size_t>& counter;
+        const Snapshot* snapshot;
+    };
+
+    Entry* getEntries(Snapshot& snapshot) const {
+        return reinterpret_cast<Entry*>(reinterpret_cast<uint8_t*>(&snapshot) + ENTRIES_OFFSET);
+    }
+
+    const Entry* getEntries(const Snapshot& snapshot) const {
+        return reinterpret_cast<const Entry*>(reinterpret_cast<const uint8_t*>(&snapshot) + ENTRIES_OFFSET);
+    }
+
+    std::size_t getSnapshotSize() const {
+        return ENTRIES_OFFSET + capacity * sizeof(Entry);
+    }
+
+    template<typename Visit>
+    void visitWildcard(const Snapshot& snapshot, Visit& visit) const {
+        const Entry* entries = this->getEntries(snapshot);
+        for(uint32_t i = snapshot.table.wildcard_head; i != NO_ENTRY; i = entries[i].next) {
+            visit(entries[i].listener, i);
+        }
+    }
+
+    template<typename Visit>
+    void visitSpecific(const Snapshot& snapshot, SpPrimaryHeader::PacketApid apid, Visit& visit) const {
+        if(snapshot.set_block != nullptr) {
+            uint32_t end = snapshot.set_starts[apid.getValue() + 1];
+            for(uint32_t i = snapshot.set_starts[apid.getValue()]; i < end; i++) {
+                visit(snapshot.set_listeners[i].listener, snapshot.set_listeners[i].entry);
+            }
+        }
+        const Entry* entries = this->getEntries(snapshot);
+        for(uint32_t i = snapshot.table.heads[apid.getValue()]; i != NO_ENTRY; i = entries[i].next) {
+            visit(entries[i].listener, i);
+        }
+    }
+
+    uint32_t* getListHead(Snapshot& snapshot, const Entry& entry) {
+        switch(entry.kind) {
+            case WILDCARD:  return &snapshot.table.wildcard_head;
+            case SET:       return &snapshot.table.set_head;
+            default:        return &snapshot.table.heads[entry.apid];
+        }
+    }
+
+    Snapshot* allocateSnapshot() {
+        UserBuffer block = this->getAllocator().allocateBuffer(this->getSnapshotSize(), ALLOC_SITE_TRANSFER_LISTENERS);
+        if(block.getStart() == nullptr) {
+            return nullptr;
+        }
+
+        Snapshot* snapshot = new (block.getStart()) Snapshot;
+        snapshot->next_retired = nullptr;
+        snapshot->retire_epoch = 0;
+        snapshot->released_set = nullptr;
+        snapshot->releases_all_sets = false;
+        snapshot->set_block = nullptr;
+        snapshot->set_block_size = 0;
+        snapshot->set_starts = nullptr;
+        snapshot->set_listeners = nullptr;
+        return snapshot;
+    }
+
+    /**
+     * @brief Expand the sets of a snapshot into the listeners of each APID, in registration order
+     * 
+     * @return false if the set block could not be allocated, true otherwise
+     */
+    bool indexSets(Snapshot& snapshot) {
+        if(snapshot.table.set_head == NO_ENTRY) {
+            return true;
+        }
+
+        const Entry* entries = this->getEntries(snapshot);
+        std::size_t nb_listeners = 0;
+        for(uint32_t i = snapshot.table.set_head; i != NO_ENTRY; i = entries[i].next) {
+            nb_listeners += entries[i].set->count();
+        }
+
+        std::size_t block_size = SET_LISTENERS_OFFSET + nb_listeners * sizeof(SetListener);
+        UserBuffer block = this->getAllocator().allocateBuffer(block_size, ALLOC_SITE_TRANSFER_LISTENERS);
+        if(block.getStart() == nullptr) {
+            return false;
+        }
+
+        uint32_t* starts = reinterpret_cast<uint32_t*>(block.getStart());
+        SetListener* listeners = reinterpret_cast<SetListener*>(block.getStart() + SET_LISTENERS_OFFSET);
+        uint32_t nb_indexed = 0;
+        for(uint16_t apid_value = 0; apid_value < NB_APIDS; apid_value++) {
+            starts[apid_value] = nb_indexed;
+            SpPrimaryHeader::PacketApid apid(apid_value);
+            for(uint32_t i = snapshot.table.set_head; i != NO_ENTRY; i = entries[i].next) {
+                if(entries[i].set->contains(apid)) {
+                    listeners[nb_indexed++] = SetListener{entries[i].listener, i};
+                }
+            }
+        }
+        starts[NB_APIDS] = nb_indexed;
+
+        snapshot.set_block = block.getStart();
+        snapshot.set_block_size = block_size;
+        snapshot.set_starts = starts;
+        snapshot.set_listeners = listeners;
+        return true;
+    }
+
+    /**
+     * @brief Make an empty snapshot: no list, and every entry free
+     */
+    void initialize(Snapshot& snapshot) {
+        snapshot.table.wildcard_head = NO_ENTRY;
+        snapshot.table.set_head = NO_ENTRY;
+        snapshot.table.next_order = 0;
+        for(std::size_t i = 0; i < NB_APIDS; i++) {
+            snapshot.table.heads[i] = NO_ENTRY;
+        }
+
+        Entry* entries = this->getEntries(snapshot);
+        snapshot.table.free_head = (capacity > 0 ? 0U : NO_ENTRY);
+        for(std::size_t i = 0; i < capacity; i++) {
+            entries[i].listener = nullptr;
+            entries[i].set = nullptr;
+            entries[i].next = (i + 1 < capacity ? static_cast<uint32_t>(i + 1) : NO_ENTRY);
+        }
+    }
+
+    Snapshot* copySnapshot(const Snapshot& original) {
+        Snapshot* snapshot = this->allocateSnapshot();
+        if(snapshot != nullptr) {
+            snapshot->table = original.table;
+            std::memcpy(this->getEntries(*snapshot), this->getEntries(original), capacity * sizeof(Entry));
+        }
+        return snapshot;
+    }
+
+    void freeSnapshot(Snapshot* snapshot) {
+        Entry* entries = this->getEntries(*snapshot);
+        for(std::size_t i = 0; i < capacity && snapshot->releases_all_sets; i++) {
+            if(entries[i].listener != nullptr && entries[i].kind == SET) {
+                this->freeSet(entries[i].set);
+            }
+        }
+        this->freeSet(snapshot->released_set);
+
+        if(snapshot->set_block != nullptr) {
+            UserBuffer set_block(snapshot->set_block, snapshot->set_block_size);
+            this->getAllocator().deallocateBuffer(set_block, ALLOC_SITE_TRANSFER_LISTENERS);
+        }
+        snapshot->~Snapshot();
+        UserBuffer block(snapshot, this->getSnapshotSize());
+        this->getAllocator().deallocateBuffer(block, ALLOC_SITE_TRANSFER_LISTENERS);
+    }
+
+    void freeSet(ApidSet* set) {
+        if(set != nullptr) {
+            UserBuffer set_buffer(set, sizeof(ApidSet));
+            this->getAllocator().deallocateBuffer(set_buffer, ALLOC_SITE_TRANSFER_LISTENERS);
+        }
+    }
+
+    bool add(SpListener* listener, uint16_t apid_value, EntryKind kind, ApidSet* set) {
+        if(listener == nullptr) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(update_mutex);
+        Snapshot* old = current.load(std::memory_order_relaxed);
+        if(old == nullptr || old->table.free_head == NO_ENTRY) {
+            return false;
+        }
+
+        Snapshot* snapshot = this->copySnapshot(*old);
+        if(snapshot == nullptr) {
+            return false;
+        }
+
+        Entry* entries = this->getEntries(*snapshot);
+        uint32_t i = snapshot->table.free_head;
+        snapshot->table.free_head = entries[i].next;
+
+        entries[i].listener  = listener;
+        entries[i].order     = snapshot->table.next_order++;
+        entries[i].next      = NO_ENTRY;
+        entries[i].set       = set;
+        entries[i].apid      = apid_value;
+        entries[i].kind      = kind;
+
+        // the entry may have been used by a removed registration
+        DispatchCounters* counters = dispatch_counters.load(std::memory_order_relaxed);
+        if(counters != nullptr) {
+            counters[i].reset();
+        }
+
+        // append at the end to keep the registration order
+        uint32_t* link = this->getListHead(*snapshot, entries[i]);
+        while(*link != NO_ENTRY) {
+            link = &entries[*link].next;
+        }
+        *link = i;
+        if(!this->indexSets(*snapshot)) {
+            this->freeSnapshot(snapshot);
+            return false;
+        }
+
+        this->publish(snapshot);
+        return true;
+    }
+
+    /**
+     * @brief Replace the current snapshot, and retire the old one. Called with the update lock.
+     */
+    void publish(Snapshot* snapshot) {
+        Snapshot* old = current.exchange(snapshot, std::memory_order_seq_cst);
+        old->retire_epoch = epoch.load(std::memory_order_seq_cst);
+        old->next_retired = retired;
+        retired = old;
+        this->reclaimRetired(false);
+    }
+
+    /**
+     * @brief Advance the epoch as far as the readers allow, and free the snapshots retired at least
+     *        two epochs ago: both reader counters were empty since, so no reader can still hold them.
+     *        Called with the update lock.
+     * 
+     * @param wait true to wait for the readers, so that every retired snapshot is freed
+     */
+    void reclaimRetired(bool wait) {
+        for(int i = 0; i < 2; i++) {
+            uint64_t current_epoch = epoch.load(std::memory_order_relaxed);
+            // the readers of the previous epoch use the same counter as the next one
+            while(readers[(current_epoch + 1) & 1].load(std::memory_order_seq_cst) != 0) {
+                if(!wait) {
+                    break;
+                }
+                std::this_thread::yield();
+            }
+            if(readers[(current_epoch + 1) & 1].load(std::memory_order_seq_cst) != 0) {
+                break;
+            }
+            epoch.store(current_epoch + 1, std::memory_order_seq_cst);
+        }
+
+        uint64_t current_epoch = epoch.load(std::memory_order_relaxed);
+        Snapshot** link = &retired;
+        while(*link != nullptr) {
+            Snapshot* snapshot = *link;
+            if(snapshot->retire_epoch + 2 <= current_epoch) {
+                *link = snapshot->next_retired;
+                this->freeSnapshot(snapshot);
+            } else {
+                link = &snapshot->next_retired;
+            }
+        }
+    }
+
+    /** The maximum amount of registrations */
+    std::size_t                     capacity;
+    /** The snapshot read by the dispatch, nullptr if it could not be allocated */
+    std::atomic<Snapshot*>          current{nullptr};
+    /** Advanced by the updates, its parity chooses the counter of the readers */
+    std::atomic<uint64_t>           epoch{0};
+    /** Amount of readers in progress, by parity of the epoch when they started */
+    mutable std::atomic<std::size_t> readers[2] = {};
+    /** The replaced snapshots not freed yet */
+    Snapshot*                       retired = nullptr;
+    /** The dispatch counters of each entry, nullptr until enabled */
+    std::atomic<DispatchCounters*>  dispatch_counters{nullptr};
+    /** Serializes the updates */
+    std::mutex                      update_mutex;
+};
+
+} //namespace
+
+#endif //CCSDS_LISTENER_INDEX_HPP
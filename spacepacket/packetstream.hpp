@@ -0,0 +1,674 @@
+/**************************************************************************//**
+ * @file packetstream.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains streams of spacepackets awaited by C++20 coroutines, and
+ *        the scheduler resuming them
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_PACKET_STREAM_HPP
+#define CCSDS_PACKET_STREAM_HPP
+
+// the streams need the coroutines of C++20, the rest of the library does not
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define CCSDS_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifdef CCSDS_HAS_COROUTINES
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
+#include "utils/lockfreequeue.hpp"
+#include "spacepacket/listener.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace ccsds
+{
+
+/**
+ * @brief Coroutine started by a call, that runs until it first waits and is then resumed by whoever
+ *        it waits for (e.g @see{SpCoroutineScheduler}). Its frame is freed when it returns.
+ * @code
+ *          SpTask archive(SpPacketStream<>& stream) {
+ *              while(auto packet = co_await stream.next()) {
+ *                  store(packet.getBuffer());
+ *              }
+ *          }
+ * @endcode
+ */
+struct SpTask {
+    struct promise_type {
+        SpTask get_return_object() noexcept {
+            return SpTask();
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+    };
+};
+
+/**
+ * @brief Pool of threads that resume the coroutines whose spacepackets arrived. @see{SpPacketStream}
+ * 
+ * @details The coroutines to resume wait in a lock-free queue; the threads only take a lock to sleep
+ *          when the queue is empty. Thousands of coroutines can thus share a few threads. With no
+ *          thread, the coroutines are resumed by poll(), from a loop owned by the user.
+ */
+class SpCoroutineScheduler
+{
+public:
+    /**
+     * @brief Construct a new SpCoroutineScheduler object and start its threads
+     * 
+     * @param nb_threads The amount of threads, 0 to only resume the coroutines from poll()
+     * @param capacity The maximum amount of coroutines waiting to be resumed (at least the amount of streams)
+     */
+    SpCoroutineScheduler(std::size_t nb_threads = 1, std::size_t capacity = 4096)
+    : ready(capacity, ALLOC_SITE_ASYNC_QUEUE), nb_threads(0) {
+        if(nb_threads > MAX_THREADS) {
+            nb_threads = MAX_THREADS;
+        }
+
+        for(std::size_t i = 0; i < nb_threads; i++) {
+            threads[i] = std::thread([this]() { this->run(); });
+            this->nb_threads++;
+        }
+    }
+
+    SpCoroutineScheduler(const SpCoroutineScheduler& other) = delete;
+    SpCoroutineScheduler& operator=(const SpCoroutineScheduler& other) = delete;
+
+    /**
+     * @brief Stop the threads. The coroutines still waiting are not resumed.
+     */
+    ~SpCoroutineScheduler() {
+        this->stop();
+    }
+
+    /**
+     * @brief Stop the threads, and wait for them to finish the coroutine they are running
+     */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready_cond.notify_all();
+
+        for(std::size_t i = 0; i < nb_threads; i++) {
+            if(threads[i].joinable()) {
+                threads[i].join();
+            }
+        }
+    }
+
+    /**
+     * @brief Resume a coroutine on one of the threads (or in the next poll()). Waits for room if
+     *        the queue is full.
+     * 
+     * @param handle The suspended coroutine
+     */
+    void schedule(std::coroutine_handle<> handle) {
+        while(!ready.tryPush(handle.address())) {
+            std::this_thread::yield();
+        }
+
+        // a thread about to sleep either sees the coroutine, or is seen here
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(nb_sleeping.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready_cond.notify_one();
+        }
+    }
+
+    /**
+     * @brief Awaitable moving the coroutine on the scheduler, to leave the thread it runs on
+     * @code
+     *          SpTask consume(SpCoroutineScheduler& scheduler, SpPacketStream<>& stream) {
+     *              co_await scheduler.yield();                 // now on a thread of the scheduler
+     *              ...
+     *          }
+     * @endcode
+     */
+    auto yield() {
+        struct Awaiter {
+            SpCoroutineScheduler& scheduler;
+            bool await_ready() const noexcept {
+                return false;
+            }
+            void await_suspend(std::coroutine_handle<> handle) {
+                scheduler.schedule(handle);
+            }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{*this};
+    }
+
+    /**
+     * @brief Resume the coroutines waiting, on the calling thread
+     * 
+     * @param max_resumed The maximum amount of coroutines to resume
+     * @return The amount of coroutines resumed
+     */
+    std::size_t poll(std::size_t max_resumed = SIZE_MAX) {
+        std::size_t nb_resumed = 0;
+        void* address = nullptr;
+        while(nb_resumed < max_resumed && ready.tryPop(address)) {
+            std::coroutine_handle<>::from_address(address).resume();
+            nb_resumed++;
+        }
+        return nb_resumed;
+    }
+
+    /**
+     * @return The amount of threads of the scheduler
+     */
+    std::size_t getNbThreads() const {
+        return nb_threads;
+    }
+
+private:
+    enum {
+        /** Maximum amount of threads in a scheduler */
+        MAX_THREADS = 64,
+    };
+
+    void run() {
+        while(true) {
+            if(this->poll(1) > 0) {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            nb_sleeping.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            ready_cond.wait(lock, [this]() { return stopping || ready.getSize() > 0; });
+            nb_sleeping.fetch_sub(1, std::memory_order_relaxed);
+            if(stopping) {
+                return;
+            }
+        }
+    }
+
+    /** The coroutines to resume (their address) */
+    LockFreeQueue<void*>        ready;
+    /** Amount of threads sleeping, or about to */
+    std::atomic<std::size_t>    nb_sleeping{0};
+
+    std::mutex                  mutex;
+    std::condition_variable     ready_cond;
+    bool                        stopping = false;
+
+    std::size_t                 nb_threads;
+    std::thread                 threads[MAX_THREADS];
+};
+
+/**
+ * @brief Counters of a stream of spacepackets
+ */
+struct SpStreamStats {
+    /** Amount of spacepackets currently waiting in the stream */
+    std::size_t depth = 0;
+    /** Amount of spacepackets queued in the stream */
+    uint64_t    nb_received = 0;
+    /** Amount of spacepackets dropped because the stream was full */
+    uint64_t    nb_dropped = 0;
+    /** Amount of spacepackets dropped because they were larger than a slot */
+    uint64_t    nb_oversized = 0;
+    /** Amount of spacepackets dropped because the slots could not be allocated */
+    uint64_t    nb_no_memory = 0;
+};
+
+/**
+ * @brief Listener that queues the spacepackets it is notified of, for a coroutine to co_await them
+ *        one at a time or by batch. Registered like any listener, for an APID, a set of APIDs or
+ *        every APID. A coroutine waiting for a spacepacket takes no thread: it is resumed on the
+ *        scheduler when one arrives.
+ * @code
+ *          SpCoroutineScheduler scheduler(2);
+ *          SpPacketStream<> housekeeping(scheduler, 64, 1024);
+ *          service.registerListener(&housekeeping, HK_APID);
+ * 
+ *          SpTask consume(SpPacketStream<>& stream) {
+ *              while(true) {
+ *                  auto batch = co_await stream.nextBatch(16);
+ *                  if(batch.getSize() == 0) {
+ *                      co_return;                          // closed
+ *                  }
+ *                  for(std::size_t i = 0; i < batch.getSize(); i++) {
+ *                      process(batch.getBuffer(i));
+ *                  }
+ *              }
+ *          }
+ *          consume(housekeeping);
+ * @endcode
+ * 
+ * @details The spacepackets are copied in slots allocated once, when constructed; the indices of
+ *          the queued and free slots are held in lock-free queues, so the receiving thread never
+ *          takes a lock. A full stream drops the new spacepackets (counted). A stream has a single
+ *          consumer coroutine, that holds the slots of the spacepackets it got until it drops them.
+ * @note The stream must be unregistered from the transfer service, closed, and its spacepackets
+ *       dropped by the consumer, before being destroyed.
+ * 
+ * @tparam Allocator The allocator used for the slots. @see{isAllocator}
+ */
+template<typename Allocator = DefaultAllocator>
+class SpPacketStream : public SpListener, private AllocatorHolder<Allocator>
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+public:
+    enum {
+        /** Maximum amount of spacepackets of a batch */
+        MAX_BATCH_SIZE = 32,
+    };
+
+    /**
+     * @brief Spacepacket taken from the stream. Its slot is given back to the stream when destroyed.
+     */
+    class Packet
+    {
+    public:
+        Packet() = default;
+        Packet(Packet&& other) noexcept
+        : stream(other.stream), slot(other.slot) {
+            other.stream = nullptr;
+        }
+        Packet& operator=(Packet&& other) noexcept {
+            if(this != &other) {
+                this->release();
+                stream = other.stream;
+                slot = other.slot;
+                other.stream = nullptr;
+            }
+            return *this;
+        }
+        Packet(const Packet& other) = delete;
+        Packet& operator=(const Packet& other) = delete;
+
+        ~Packet() {
+            this->release();
+        }
+
+        /**
+         * @return false if the stream was closed (no spacepacket), true otherwise
+         */
+        explicit operator bool() const {
+            return stream != nullptr;
+        }
+
+        /**
+         * @return The spacepacket, empty if none
+         */
+        UserBuffer getBuffer() const {
+            return stream != nullptr ? stream->getSlot(slot) : UserBuffer(nullptr, 0);
+        }
+
+    private:
+        friend class SpPacketStream;
+        Packet(SpPacketStream* stream, uint32_t slot)
+        : stream(stream), slot(slot) {}
+
+        void release() {
+            if(stream != nullptr) {
+                stream->releaseSlot(slot);
+                stream = nullptr;
+            }
+        }
+
+        SpPacketStream* stream = nullptr;
+        uint32_t        slot = 0;
+    };
+
+    /**
+     * @brief Spacepackets taken from the stream at once. Their slots are given back to the stream when destroyed.
+     */
+    class Batch
+    {
+    public:
+        Batch() = default;
+        Batch(Batch&& other) noexcept
+        : stream(other.stream), nb_packets(other.nb_packets) {
+            std::memcpy(slots, other.slots, nb_packets * sizeof(uint32_t));
+            other.nb_packets = 0;
+        }
+        Batch(const Batch& other) = delete;
+        Batch& operator=(const Batch& other) = delete;
+        Batch& operator=(Batch&& other) = delete;
+
+        ~Batch() {
+            for(std::size_t i = 0; i < nb_packets; i++) {
+                stream->releaseSlot(slots[i]);
+            }
+        }
+
+        /**
+         * @return The amount of spacepackets, 0 if the stream was closed
+         */
+        std::size_t getSize() const {
+            return nb_packets;
+        }
+
+        /**
+         * @param index The index of the spacepacket, in order of arrival
+         * @return The spacepacket
+         */
+        UserBuffer getBuffer(std::size_t index) const {
+            return index < nb_packets ? stream->getSlot(slots[index]) : UserBuffer(nullptr, 0);
+        }
+
+    private:
+        friend class SpPacketStream;
+
+        SpPacketStream* stream = nullptr;
+        std::size_t     nb_packets = 0;
+        uint32_t        slots[MAX_BATCH_SIZE];
+    };
+
+    /**
+     * @brief Construct a new SpPacketStream object
+     * 
+     * @param scheduler The scheduler resuming the consumer
+     * @param queue_depth The maximum amount of spacepackets waiting in the stream, or held by the consumer
+     * @param max_packet_size The maximum size (in bytes) of a spacepacket
+     * @param alloc The allocator to use for the slots
+     */
+    SpPacketStream(SpCoroutineScheduler& scheduler, std::size_t queue_depth = 64, std::size_t max_packet_size = 4096,
+                   const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), scheduler(scheduler), slot_size(max_packet_size),
+      queued(queue_depth, ALLOC_SITE_ASYNC_QUEUE, alloc), free_slots(queue_depth, ALLOC_SITE_ASYNC_QUEUE, alloc) {
+        if(queue_depth == 0 || queued.getCapacity() == 0 || free_slots.getCapacity() == 0) {
+            return;
+        }
+
+        // the size of each slot, followed by the slots
+        memory = this->getAllocator().allocateBuffer(queue_depth * (sizeof(uint32_t) + slot_size), ALLOC_SITE_ASYNC_QUEUE);
+        if(memory.getStart() == nullptr) {
+            return;
+        }
+        sizes = reinterpret_cast<uint32_t*>(memory.getStart());
+        slots = memory.getStart() + queue_depth * sizeof(uint32_t);
+
+        for(std::size_t i = 0; i < queue_depth; i++) {
+            free_slots.tryPush(static_cast<uint32_t>(i));
+        }
+    }
+
+    SpPacketStream(const SpPacketStream& other) = delete;
+    SpPacketStream& operator=(const SpPacketStream& other) = delete;
+
+    ~SpPacketStream() {
+        if(memory.getStart() != nullptr) {
+            this->getAllocator().deallocateBuffer(memory, ALLOC_SITE_ASYNC_QUEUE);
+        }
+    }
+
+    /**
+     * @return false if the slots could not be allocated (every spacepacket is dropped), true otherwise
+     */
+    bool isValid() const {
+        return slots != nullptr;
+    }
+
+    void newSpacepacket(const IBuffer& bytes) override {
+        if(this->enqueue(bytes.getSize(), [&bytes](uint8_t* slot) {
+            std::memcpy(slot, bytes.getStart(), bytes.getSize());
+        })) {
+            this->wake();
+        }
+    }
+
+    bool acceptsScattered() const override {
+        return true;
+    }
+
+    void newScatteredSpacepacket(const IBufferChain& bytes) override {
+        if(this->enqueue(bytes.getSize(), [this, &bytes](uint8_t* slot) {
+            UserBuffer destination(slot, slot_size);
+            bytes.copyTo(destination);
+        })) {
+            this->wake();
+        }
+    }
+
+    void newSpacepackets(Span<const UserBuffer> batch) override {
+        bool queued_any = false;
+        for(const UserBuffer& bytes : batch) {
+            queued_any |= this->enqueue(bytes.getSize(), [&bytes](uint8_t* slot) {
+                std::memcpy(slot, bytes.getStart(), bytes.getSize());
+            });
+        }
+        // the consumer is resumed once for the whole batch
+        if(queued_any) {
+            this->wake();
+        }
+    }
+
+    /**
+     * @brief Awaitable of the next spacepacket
+     * 
+     * @return An awaitable whose result is the Packet, empty once the stream is closed and drained
+     */
+    auto next() {
+        struct Awaiter : AwaiterBase {
+            Packet await_resume() {
+                if(this->nb_taken == 0 && !this->stream->take(this->slot)) {
+                    return Packet();
+                }
+                return Packet(this->stream, this->slot);
+            }
+        };
+        Awaiter awaiter;
+        awaiter.stream = this;
+        return awaiter;
+    }
+
+    /**
+     * @brief Awaitable of the next spacepackets: waits for at least one, and takes those already waiting
+     * 
+     * @param max_packets The maximum amount of spacepackets, at most MAX_BATCH_SIZE
+     * @return An awaitable whose result is the Batch, empty once the stream is closed and drained
+     */
+    auto nextBatch(std::size_t max_packets = MAX_BATCH_SIZE) {
+        struct Awaiter : AwaiterBase {
+            std::size_t max_packets;
+            Batch await_resume() {
+                Batch batch;
+                batch.stream = this->stream;
+                if(this->nb_taken == 0 && !this->stream->take(this->slot)) {
+                    return batch;
+                }
+                batch.slots[0] = this->slot;
+                batch.nb_packets = 1;
+                while(batch.nb_packets < max_packets && this->stream->tryTake(batch.slots[batch.nb_packets])) {
+                    batch.nb_packets++;
+                }
+                return batch;
+            }
+        };
+        Awaiter awaiter;
+        awaiter.stream = this;
+        awaiter.max_packets = (max_packets == 0) ? 1 : (max_packets < MAX_BATCH_SIZE ? max_packets : static_cast<std::size_t>(MAX_BATCH_SIZE));
+        return awaiter;
+    }
+
+    /**
+     * @brief Close the stream: the consumer gets the spacepackets still waiting, then an empty result
+     */
+    void close() {
+        closed.store(true, std::memory_order_release);
+        this->wake();
+    }
+
+    /**
+     * @return true if the stream was closed, false otherwise
+     */
+    bool isClosed() const {
+        return closed.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @return The counters of the stream
+     */
+    SpStreamStats getStats() const {
+        SpStreamStats stats;
+        stats.depth = queued.getSize();
+        stats.nb_received = nb_received.load(std::memory_order_relaxed);
+        stats.nb_dropped = nb_dropped.load(std::memory_order_relaxed);
+        stats.nb_oversized = nb_oversized.load(std::memory_order_relaxed);
+        stats.nb_no_memory = nb_no_memory.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    /** What the awaiters of the stream share: suspending the consumer until a spacepacket arrives */
+    struct AwaiterBase {
+        SpPacketStream* stream = nullptr;
+        /** The slot taken before resuming, if nb_taken is 1 */
+        uint32_t        slot = 0;
+        std::size_t     nb_taken = 0;
+
+        bool await_ready() {
+            if(stream->tryTake(slot)) {
+                nb_taken = 1;
+                return true;
+            }
+            return stream->isClosed();
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            // once the handle is published, the coroutine (and this awaiter) may be resumed on another thread
+            SpPacketStream* current = stream;
+            current->waiter.store(handle.address(), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            // a spacepacket that arrived meanwhile may not have seen the handle: take the handle back
+            if(current->queued.getSize() > 0 || current->isClosed()) {
+                void* expected = handle.address();
+                if(current->waiter.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    /**
+     * @brief Copy a spacepacket in a free slot and queue it
+     * 
+     * @param size The size of the spacepacket
+     * @param copy The function copying the spacepacket in the slot (uint8_t*)
+     * @return true if the spacepacket was queued, false if it was dropped
+     */
+    template<typename Copy>
+    bool enqueue(std::size_t size, Copy&& copy) {
+        if(!this->isValid()) {
+            nb_no_memory.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if(size > slot_size) {
+            nb_oversized.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        uint32_t slot = 0;
+        if(!free_slots.tryPop(slot)) {
+            nb_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        copy(slots + slot * slot_size);
+        sizes[slot] = static_cast<uint32_t>(size);
+        queued.tryPush(slot);
+        nb_received.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief Resume the consumer if it is waiting
+     */
+    void wake() {
+        // the consumer about to wait either sees the spacepacket, or its handle is seen here
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiter.load(std::memory_order_relaxed) == nullptr) {
+            return;
+        }
+
+        void* handle = waiter.exchange(nullptr, std::memory_order_acq_rel);
+        if(handle != nullptr) {
+            scheduler.schedule(std::coroutine_handle<>::from_address(handle));
+        }
+    }
+
+    bool tryTake(uint32_t& slot) {
+        return queued.tryPop(slot);
+    }
+
+    /**
+     * @brief Take the next spacepacket once resumed. A producer may have claimed its position in the
+     *        queue without having written it yet: it is waited for.
+     * 
+     * @return false if the stream is closed and empty, true otherwise
+     */
+    bool take(uint32_t& slot) {
+        while(!queued.tryPop(slot)) {
+            if(queued.getSize() == 0 && this->isClosed()) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    UserBuffer getSlot(uint32_t slot) const {
+        return UserBuffer(slots + slot * slot_size, sizes[slot]);
+    }
+
+    void releaseSlot(uint32_t slot) {
+        free_slots.tryPush(slot);
+    }
+
+    SpCoroutineScheduler&               scheduler;
+    /** The size of a slot */
+    const std::size_t                   slot_size;
+    /** The slots of the spacepackets waiting, in order of arrival */
+    LockFreeQueue<uint32_t, Allocator>  queued;
+    /** The slots neither waiting nor held by the consumer */
+    LockFreeQueue<uint32_t, Allocator>  free_slots;
+
+    /** The memory of the slots: the size of each slot, then the slots */
+    UserBuffer                          memory{nullptr, 0};
+    uint32_t*                           sizes = nullptr;
+    uint8_t*                            slots = nullptr;
+
+    /** The consumer waiting for a spacepacket (its address), nullptr if none */
+    std::atomic<void*>                  waiter{nullptr};
+    std::atomic<bool>                   closed{false};
+
+    std::atomic<uint64_t>               nb_received{0};
+    std::atomic<uint64_t>               nb_dropped{0};
+    std::atomic<uint64_t>               nb_oversized{0};
+    std::atomic<uint64_t>               nb_no_memory{0};
+};
+
+} //namespace
+
+#endif //CCSDS_HAS_COROUTINES
+
+#endif //CCSDS_PACKET_STREAM_HPP
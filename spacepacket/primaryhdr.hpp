@@ -249,6 +249,58 @@ public:
         return SIZE;
     }
 
+    /**
+     * @brief Decode the fields directly from the bytes of an encoded primary header. This is
+     *        equivalent to deserialize(), without the overhead of a bitstream.
+     * 
+     * @param bytes The encoded primary header, at least SIZE bytes
+     */
+    void decode(const uint8_t* bytes) {
+        // the fields are packed in network (big endian) order (pink book, section 4.1.2)
+        uint16_t identification = static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
+        uint16_t sequence       = static_cast<uint16_t>((bytes[2] << 8) | bytes[3]);
+
+        version.setValue(identification >> 13);
+        type.setValue((identification >> 12) & 0x1);
+        sec_hdr_flag.setValue((identification >> 11) & 0x1);
+        apid.setValue(identification);
+        sequence_flags.setValue(sequence >> 14);
+        sequence_count.setValue(sequence);
+        length.setValue(static_cast<uint16_t>((bytes[4] << 8) | bytes[5]));
+    }
+
+    /**
+     * @brief Read the APID of an encoded primary header, without decoding the other fields
+     * 
+     * @param bytes The encoded primary header, at least 2 bytes
+     * @return The APID
+     */
+    static uint16_t peekApid(const uint8_t* bytes) {
+        return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]) & PacketApid::IDLE_VALUE;
+    }
+
+    /**
+     * @brief Read the length of the packet data field of an encoded primary header
+     * 
+     * @param bytes The encoded primary header, at least SIZE bytes
+     * @return The amount of bytes after the primary header
+     */
+    static uint32_t peekLength(const uint8_t* bytes) {
+        // the field contains a length count that equals one fewer than the length (in octets)
+        return static_cast<uint32_t>((bytes[4] << 8) | bytes[5]) + 1;
+    }
+
+    /**
+     * @brief Write the sequence count of an encoded primary header, without encoding the other fields
+     * 
+     * @param bytes The encoded primary header, at least SIZE bytes
+     * @param count The sequence count (the bits above SEQUENCE_COUNT_WIDTH are ignored)
+     */
+    static void patchSequenceCount(uint8_t* bytes, uint16_t count) {
+        bytes[2] = static_cast<uint8_t>((bytes[2] & 0xC0) | ((count >> 8) & 0x3F));
+        bytes[3] = static_cast<uint8_t>(count);
+    }
+
     /**
      * @brief Check if, only from the primary header, it is possible to tag
      *        the packet as invalid 
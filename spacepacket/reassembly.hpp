@@ -0,0 +1,347 @@
+/**************************************************************************//**
+ * @file reassembly.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains classes that reassemble user data split in many segmented
+ *        spacepackets
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_REASSEMBLY_HPP
+#define CCSDS_REASSEMBLY_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "utils/clock.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include "spacepacket/listener.hpp"
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace ccsds
+{
+
+/**
+ * @brief Listener of complete user data, reassembled from the segments of an APID.
+ *        @see{SpReassembler}
+ */
+class SpUserDataListener
+{
+public:
+    /**
+     * @brief Callback of new complete user data
+     * 
+     * @param header The primary header of the first segment (or of the unsegmented spacepacket)
+     * @param secondary_header The secondary header of the first segment, empty if the APID has no
+     *                         secondary header
+     * @param user_data The user data of all the segments, in order, without their secondary headers
+     * 
+     * @note The buffers are only valid during the call.
+     */
+    virtual void newUserData(const SpPrimaryHeader& header, const IBuffer& secondary_header, const IBuffer& user_data) = 0;
+};
+
+/**
+ * @brief Statistics of the reassembly of an APID
+ */
+struct SpReassemblyStats {
+    /** Complete user data delivered (segmented or not) */
+    uint64_t nb_delivered = 0;
+    /** Segments received */
+    uint64_t nb_segments = 0;
+    /** Reassemblies aborted because a segment was missing or out of place */
+    uint64_t nb_aborted_sequence = 0;
+    /** Reassemblies aborted because the user data exceeded the memory limit of the APID */
+    uint64_t nb_aborted_overflow = 0;
+    /** Reassemblies aborted because the next segment did not arrive in time */
+    uint64_t nb_aborted_timeout = 0;
+    /** Reassemblies aborted because the reassembly buffer could not be allocated */
+    uint64_t nb_aborted_memory = 0;
+    /** Spacepackets ignored because they were malformed */
+    uint64_t nb_malformed = 0;
+};
+
+/**
+ * @brief Stage of the receive path that reassembles the user data of segmented spacepackets
+ *        (@see{SpPrimaryHeader::SequenceFlags}) and gives it to a SpUserDataListener. It is a
+ *        listener of the transfer service, registered for the APIDs it reassembles.
+ * @code
+ *          SpReassembler<> reassembler(science_archiver);
+ *          reassembler.configure(0x42, 16 * 1024 * 1024, 5000000000ULL);   // 16 MiB, 5 s
+ *          service.registerListener(&reassembler, 0x42);
+ * @endcode
+ * 
+ * @details Each configured APID has a contiguous buffer of its memory limit, allocated at its first
+ *          segment and then kept: each segment is copied only once, right after the previous one, and
+ *          the user data is given to the listener in place. Unsegmented spacepackets are given as is,
+ *          without a copy. A reassembly is aborted (and counted) when a segment is missing (the sequence
+ *          counts must follow each other), when a segment comes out of place, when the memory limit
+ *          is exceeded, or when the next segment takes longer than the timeout of the APID.
+ *          Spacepackets of APIDs that were not configured are ignored.
+ * 
+ *          The listener is called without the lock of the APID: the completed buffer is detached
+ *          from the APID during the call, and a segment starting the next reassembly meanwhile gets
+ *          a buffer of its own (freed when the delivery is done). The listener can then be called
+ *          concurrently for the same APID if its spacepackets are received from many threads.
+ * 
+ * @tparam Allocator The allocator used for the reassembly buffers. @see{isAllocator}
+ * @tparam Clock The clock used for the timeouts. @see{MonotonicClock}
+ */
+template<typename Allocator = DefaultAllocator, typename Clock = MonotonicClock>
+class SpReassembler : public SpListener, private AllocatorHolder<Allocator>
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+public:
+    /**
+     * @brief Construct a new SpReassembler object
+     * 
+     * @param listener The listener of the complete user data
+     * @param alloc The allocator to use for the reassembly buffers
+     */
+    SpReassembler(SpUserDataListener& listener, const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), listener(listener) {
+
+    }
+
+    SpReassembler(const SpReassembler& other) = delete;
+    SpReassembler& operator=(const SpReassembler& other) = delete;
+
+    ~SpReassembler() {
+        for(uint16_t apid_value = 0; apid_value < NB_APIDS; apid_value++) {
+            this->configure(apid_value, 0);
+        }
+    }
+
+    /**
+     * @brief Reassemble the user data of an APID. Must be called before the traffic of the APID starts.
+     * 
+     * @param apid_value The APID
+     * @param max_size The memory limit (in bytes) of the user data of the APID, 0 to stop reassembling it
+     * @param timeout_ns The longest time (in nanoseconds) between two segments, 0 for no timeout
+     * @param sec_hdr_size The size (in bytes) of the secondary header of the APID, skipped in every segment
+     * @return false if the context of the APID could not be allocated, true otherwise
+     */
+    bool configure(uint16_t apid_value, std::size_t max_size, uint64_t timeout_ns = 0, std::size_t sec_hdr_size = 0) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        Context*& context = contexts[apid.getValue()];
+
+        if(context != nullptr) {
+            this->releaseBuffer(context->buffer);
+            context->~Context();
+            UserBuffer memory(context, sizeof(Context));
+            this->getAllocator().deallocateBuffer(memory, ALLOC_SITE_REASSEMBLY);
+            context = nullptr;
+        }
+
+        if(max_size == 0) {
+            return true;
+        }
+
+        // the reassembly buffer is only allocated at the first segment
+        UserBuffer memory = this->getAllocator().allocateBuffer(sizeof(Context), ALLOC_SITE_REASSEMBLY);
+        if(memory.getStart() == nullptr) {
+            return false;
+        }
+
+        context = new (memory.getStart()) Context();
+        context->sec_hdr_size = sec_hdr_size;
+        context->max_size     = max_size;
+        context->timeout_ns   = timeout_ns;
+        return true;
+    }
+
+    /**
+     * @brief Abort the reassemblies whose next segment is late. Reassemblies are also checked when
+     *        a segment arrives; this is only needed to release them when the traffic stopped.
+     */
+    void expire() {
+        uint64_t now = Clock::now();
+
+        for(uint16_t apid_value = 0; apid_value < NB_APIDS; apid_value++) {
+            Context* context = contexts[apid_value];
+            if(context != nullptr) {
+                std::lock_guard<std::mutex> lock(context->mutex);
+                this->checkTimeout(*context, now);
+            }
+        }
+    }
+
+    /**
+     * @param apid_value The APID
+     * @return The statistics of the reassembly of the APID, all 0 if it was not configured
+     */
+    SpReassemblyStats getStats(uint16_t apid_value) const {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        Context* context = contexts[apid.getValue()];
+        if(context == nullptr) {
+            return SpReassemblyStats();
+        }
+
+        std::lock_guard<std::mutex> lock(context->mutex);
+        return context->stats;
+    }
+
+    void newSpacepacket(const IBuffer& bytes) override {
+        if(bytes.getSize() < SpPrimaryHeader::SIZE) {
+            return;
+        }
+
+        SpPrimaryHeader header;
+        header.decode(bytes.getStart());
+
+        Context* context = contexts[header.apid.getValue()];
+        if(context == nullptr) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(context->mutex);
+
+        // the data field, without the secondary header
+        std::size_t data_size = header.length.getLength();
+        if(data_size > bytes.getSize() - SpPrimaryHeader::SIZE) {
+            context->stats.nb_malformed++;
+            return;
+        }
+
+        const uint8_t* sec_hdr = bytes.getStart() + SpPrimaryHeader::SIZE;
+        std::size_t sec_hdr_size = header.sec_hdr_flag.isSet() ? context->sec_hdr_size : 0;
+        if(sec_hdr_size > data_size) {
+            context->stats.nb_malformed++;
+            return;
+        }
+        UserBuffer user_data(const_cast<uint8_t*>(sec_hdr) + sec_hdr_size, data_size - sec_hdr_size);
+
+        uint64_t now = Clock::now();
+        this->checkTimeout(*context, now);
+        context->stats.nb_segments++;
+
+        if(header.sequence_flags.isUnsegmented()) {
+            this->abort(*context, context->stats.nb_aborted_sequence);
+            context->stats.nb_delivered++;
+            lock.unlock();
+
+            UserBuffer secondary(const_cast<uint8_t*>(sec_hdr), sec_hdr_size);
+            listener.newUserData(header, secondary, user_data);
+            return;
+        }
+
+        if(header.sequence_flags.isFirstSegment()) {
+            // a first segment while reassembling: the previous last segment is missing
+            this->abort(*context, context->stats.nb_aborted_sequence);
+
+            if(context->buffer.getStart() == nullptr) {
+                // the secondary header of the first segment, then the user data
+                context->buffer = this->getAllocator().allocateBuffer(context->sec_hdr_size + context->max_size,
+                                                                      ALLOC_SITE_REASSEMBLY);
+                if(context->buffer.getStart() == nullptr) {
+                    context->stats.nb_aborted_memory++;
+                    return;
+                }
+            }
+
+            context->in_progress  = true;
+            context->first_header = header;
+            context->first_sec_hdr_size = sec_hdr_size;
+            context->size         = 0;
+            std::memcpy(context->buffer.getStart(), sec_hdr, sec_hdr_size);
+        } else {
+            // a continuation or last segment must directly follow the previous segment
+            SpPrimaryHeader::SequenceCount expected;
+            expected.setValue(context->last_count + 1);
+            if(!context->in_progress || header.sequence_count.getValue() != expected.getValue()) {
+                this->abort(*context, context->stats.nb_aborted_sequence);
+                return;
+            }
+        }
+
+        if(user_data.getSize() > context->max_size - context->size) {
+            this->abort(*context, context->stats.nb_aborted_overflow);
+            return;
+        }
+
+        uint8_t* data = context->buffer.getStart() + context->sec_hdr_size;
+        std::memcpy(data + context->size, user_data.getStart(), user_data.getSize());
+        context->size += user_data.getSize();
+        context->last_count = header.sequence_count.getValue();
+        context->last_time = now;
+
+        if(header.sequence_flags.isLastSegment()) {
+            // detach the buffer: the next reassembly can start while the user data is delivered
+            UserBuffer buffer(context->buffer.getStart(), context->buffer.getSize());
+            context->buffer = UserBuffer(nullptr, 0);
+            SpPrimaryHeader first_header = context->first_header;
+            UserBuffer secondary(buffer.getStart(), context->first_sec_hdr_size);
+            UserBuffer complete(data, context->size);
+            context->stats.nb_delivered++;
+            context->in_progress = false;
+            lock.unlock();
+
+            listener.newUserData(first_header, secondary, complete);
+
+            // give the buffer back, unless the next reassembly already has one
+            lock.lock();
+            if(context->buffer.getStart() == nullptr) {
+                context->buffer = UserBuffer(buffer.getStart(), buffer.getSize());
+            } else {
+                lock.unlock();
+                this->releaseBuffer(buffer);
+            }
+        }
+    }
+
+private:
+    enum {
+        /** Amount of possible APIDs (including idle) */
+        NB_APIDS = SpPrimaryHeader::PacketApid::IDLE_VALUE + 1,
+    };
+
+    /** The reassembly of an APID */
+    struct Context {
+        /** The secondary header of the first segment, then the user data reassembled so far.
+            Allocated at the first segment, empty while detached for a delivery. */
+        UserBuffer          buffer;
+        std::size_t         sec_hdr_size = 0;
+        std::size_t         first_sec_hdr_size = 0;
+        std::size_t         max_size = 0;
+        std::size_t         size = 0;
+        uint64_t            timeout_ns = 0;
+
+        /** If a first segment was received, and not yet its last segment */
+        bool                in_progress = false;
+        SpPrimaryHeader     first_header;
+        uint16_t            last_count = 0;
+        uint64_t            last_time = 0;
+
+        SpReassemblyStats   stats;
+        std::mutex          mutex;
+    };
+
+    void abort(Context& context, uint64_t& counter) {
+        if(context.in_progress) {
+            context.in_progress = false;
+            counter++;
+        }
+    }
+
+    void releaseBuffer(UserBuffer& buffer) {
+        if(buffer.getStart() != nullptr) {
+            this->getAllocator().deallocateBuffer(buffer, ALLOC_SITE_REASSEMBLY);
+        }
+    }
+
+    void checkTimeout(Context& context, uint64_t now) {
+        if(context.in_progress && context.timeout_ns > 0 && now - context.last_time > context.timeout_ns) {
+            this->abort(context, context.stats.nb_aborted_timeout);
+        }
+    }
+
+    /** The listener of the complete user data */
+    SpUserDataListener& listener;
+    /** The reassembly of each APID, nullptr if not configured */
+    Context* contexts[NB_APIDS] = {};
+};
+
+} //namespace
+
+#endif //CCSDS_REASSEMBLY_HPP
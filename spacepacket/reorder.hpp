@@ -0,0 +1,424 @@
+/**************************************************************************//**
+ * @file reorder.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a class that puts back in order the spacepackets of an APID
+ *        received out of sequence
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_REORDER_HPP
+#define CCSDS_REORDER_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include <cstdint>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+
+namespace ccsds
+{
+
+/**
+ * @brief Statistics of a reorder window
+ */
+struct SpReorderStats {
+    /** Spacepackets received ahead of sequence, then delivered in order from the window */
+    uint64_t nb_reordered = 0;
+    /** Sequence counts skipped when resynchronizing (spacepackets never received), and late
+        spacepackets dropped before the window resynchronized on them */
+    uint64_t nb_lost = 0;
+    /** Spacepackets dropped because they were older than the next expected one, or duplicates */
+    uint64_t nb_late = 0;
+    /** Spacepackets dropped because they were received ahead of sequence but too large to be held */
+    uint64_t nb_oversized = 0;
+};
+
+/**
+ * @brief Window of sequence counts of an APID, that holds the spacepackets received ahead of
+ *        sequence until the missing ones arrive, then delivers them in order.
+ * 
+ * @details With a window of W spacepackets and an expected sequence count N:
+ *          - count N is delivered right away, followed by the held spacepackets that follow it;
+ *          - counts N+1 to N+W-1 are copied in the window, in the slot of their count;
+ *          - counts further ahead make the window slide: the held spacepackets that leave the window
+ *            are delivered, and the counts missing in between are declared lost;
+ *          - counts behind N (up to half of the sequence count range) are late or duplicates, and
+ *            are dropped.
+ *          A window that resynchronizes (@see{setResync}) follows a source that starts anywhere or
+ *          restarts: it takes the next count from the first spacepacket it receives, and after
+ *          LATE_RUN_RESYNC late spacepackets in a row, delivers the held spacepackets and moves to
+ *          the received count. The slots are allocated once, when the window is created.
+ * 
+ *          The spacepackets are delivered outside of the lock of the window: a call takes the
+ *          spacepackets it releases under the lock, with a ticket, then delivers them once the calls
+ *          with an earlier ticket are done, so that the deliveries stay in order across threads. A slot
+ *          being delivered is not reused until its delivery is done. The delivery function can read
+ *          the window (statistics, next count), but must not give it spacepackets.
+ * 
+ * @tparam Allocator The allocator used for the slots. @see{isAllocator}
+ */
+template<typename Allocator = DefaultAllocator>
+class SpReorderWindow : private AllocatorHolder<Allocator>
+{
+public:
+    enum {
+        /** Maximum amount of spacepackets in a window */
+        MAX_WINDOW_SIZE = 64,
+        /** Amount of late spacepackets in a row after which the window resynchronizes */
+        LATE_RUN_RESYNC = 32,
+    };
+
+    /**
+     * @brief Construct a new SpReorderWindow object
+     * 
+     * @param window_size The amount of sequence counts in the window (the next expected included),
+     *                    rounded up to a power of 2, at most MAX_WINDOW_SIZE
+     * @param max_packet_size The maximum size (in bytes) of a spacepacket held in the window
+     * @param next_count The next expected sequence count
+     * @param alloc The allocator to use for the slots
+     */
+    SpReorderWindow(std::size_t window_size, std::size_t max_packet_size, uint16_t next_count,
+                    const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), slot_size(max_packet_size), next_count(next_count & COUNT_MASK) {
+        // a power of 2 divides the sequence count range: the slots of a window never collide
+        std::size_t rounded = 2;
+        while(rounded < window_size && rounded < MAX_WINDOW_SIZE) {
+            rounded <<= 1;
+        }
+        window_size = rounded;
+
+        slots = this->getAllocator().allocateBuffer(window_size * slot_size, ALLOC_SITE_REORDER);
+        this->window_size = (slots.getStart() != nullptr) ? window_size : 0;
+    }
+
+    SpReorderWindow(const SpReorderWindow& other) = delete;
+    SpReorderWindow& operator=(const SpReorderWindow& other) = delete;
+
+    ~SpReorderWindow() {
+        this->getAllocator().deallocateBuffer(slots, ALLOC_SITE_REORDER);
+    }
+
+    /**
+     * @return false if the slots could not be allocated, true otherwise
+     */
+    bool isValid() const {
+        return window_size > 0;
+    }
+
+    /**
+     * @brief Receive a spacepacket of the APID, and deliver the spacepackets that are now in order
+     * 
+     * @param count The sequence count of the spacepacket
+     * @param packet The spacepacket (IBuffer or IBufferChain)
+     * @param deliver The function called, in order, with each spacepacket delivered (the received
+     *                one as is, or a held one as const IBuffer&)
+     */
+    template<typename BufferType, typename Deliver>
+    void receive(uint16_t count, const BufferType& packet, Deliver&& deliver) {
+        bool handled = false;
+        while(!handled) {
+            Released released;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                handled = this->collect(count, packet, released, lock);
+                this->takeTicket(released);
+            }
+            this->deliverReleased(released, packet, deliver);
+        }
+    }
+
+    /**
+     * @brief Deliver every held spacepacket in order, declaring lost the sequence counts missing
+     *        in between. Useful when no more spacepackets are expected for a while.
+     * 
+     * @param deliver The function called, in order, with each spacepacket delivered (const IBuffer&)
+     */
+    template<typename Deliver>
+    void flush(Deliver&& deliver) {
+        Released released;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while(nb_held > 0) {
+                this->releaseOrSkip(released);
+            }
+            this->takeTicket(released);
+        }
+        this->deliverReleased(released, UserBuffer(nullptr, 0), deliver);
+    }
+
+    /**
+     * @brief Resynchronize the window on the source of the APID: the next spacepacket received sets
+     *        the next expected sequence count (if the window holds none), and a run of LATE_RUN_RESYNC
+     *        late spacepackets is taken as a restart of the source, the late ones dropped being
+     *        counted as lost. Not for redundant sources, whose late copies can come in long runs.
+     * 
+     * @param resync true to resynchronize, false to drop every late spacepacket
+     */
+    void setResync(bool resync) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->resync = resync;
+        resync_pending = resync;
+        nb_late_run = 0;
+    }
+
+    /**
+     * @return The statistics of the window
+     */
+    SpReorderStats getStats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    /**
+     * @return The next expected sequence count
+     */
+    uint16_t getNextCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return next_count;
+    }
+
+private:
+    enum : uint32_t {
+        /** Amount of possible sequence counts */
+        COUNT_RANGE = 1U << SpPrimaryHeader::SEQUENCE_COUNT_WIDTH,
+        COUNT_MASK  = COUNT_RANGE - 1,
+        /** Counts further ahead than this are considered behind */
+        HALF_RANGE  = COUNT_RANGE / 2,
+    };
+
+    static std::size_t distance(uint16_t from, uint16_t to) {
+        return (static_cast<uint32_t>(to) - from) & COUNT_MASK;
+    }
+
+    static std::size_t getSize(const IBuffer& packet) {
+        return packet.getSize();
+    }
+
+    static std::size_t getSize(const IBufferChain& packet) {
+        return packet.getSize();
+    }
+
+    static std::size_t copy(const IBuffer& packet, IBuffer& dst) {
+        std::memcpy(dst.getStart(), packet.getStart(), packet.getSize());
+        return packet.getSize();
+    }
+
+    static std::size_t copy(const IBufferChain& packet, IBuffer& dst) {
+        return packet.copyTo(dst);
+    }
+
+    /** The spacepackets released by a call, to deliver outside of the lock */
+    struct Released {
+        /** The slots released, in order */
+        uint8_t     slots[MAX_WINDOW_SIZE];
+        std::size_t nb_slots = 0;
+        /** true if the received spacepacket is delivered, after the first packet_position slots */
+        bool        with_packet = false;
+        std::size_t packet_position = 0;
+        /** The turn of the call among the deliveries */
+        uint64_t    ticket = 0;
+
+        bool isEmpty() const {
+            return nb_slots == 0 && !with_packet;
+        }
+    };
+
+    /**
+     * @brief Take the received spacepacket in the window, and the spacepackets it releases. Called
+     *        with the lock.
+     * 
+     * @return true if the spacepacket was handled, false if it must be received again once the
+     *         released spacepackets are delivered (its slot is one of them)
+     */
+    template<typename BufferType>
+    bool collect(uint16_t count, const BufferType& packet, Released& released, std::unique_lock<std::mutex>& lock) {
+        if(resync_pending) {
+            resync_pending = false;
+            if(nb_held == 0) {
+                next_count = count;
+            }
+        }
+
+        while(true) {
+            std::size_t ahead = distance(next_count, count);
+            if(ahead >= HALF_RANGE) {
+                if(!resync || ++nb_late_run < LATE_RUN_RESYNC) {
+                    stats.nb_late++;
+                    return true;
+                }
+
+                // too many late ones in a row: the source restarted, follow it
+                while(nb_held > 0) {
+                    this->releaseOrSkip(released);
+                }
+                stats.nb_late -= nb_late_run - 1;
+                stats.nb_lost += nb_late_run - 1;
+                next_count = count;
+                ahead = 0;
+            }
+            nb_late_run = 0;
+
+            // too far ahead: slide the window until the spacepacket fits in
+            while(ahead >= window_size) {
+                if(nb_held == 0) {
+                    // nothing to deliver in between, jump right to the spacepacket
+                    stats.nb_lost += ahead;
+                    next_count = count;
+                    ahead = 0;
+                    break;
+                }
+
+                this->releaseOrSkip(released);
+                ahead--;
+            }
+
+            if(ahead == 0) {
+                released.with_packet = true;
+                released.packet_position = released.nb_slots;
+                next_count = (next_count + 1) & COUNT_MASK;
+                this->releaseHeld(released);
+                return true;
+            }
+
+            // ahead of sequence: hold it until the previous ones arrive
+            std::size_t slot = count % window_size;
+            uint64_t bit = uint64_t(1) << slot;
+            if(held & bit) {
+                stats.nb_late++;
+                return true;
+            }
+            if(getSize(packet) > slot_size) {
+                stats.nb_oversized++;
+                return true;
+            }
+            if(delivering & bit) {
+                if(released.nb_slots > 0) {
+                    return false;
+                }
+                // released by another call: wait for its delivery, then look again
+                delivered.wait(lock);
+                continue;
+            }
+
+            UserBuffer dst(slots.getStart() + slot * slot_size, slot_size);
+            slot_sizes[slot] = copy(packet, dst);
+            held |= bit;
+            nb_held++;
+            return true;
+        }
+    }
+
+    /**
+     * @brief Release the held spacepackets that directly follow the next expected count
+     */
+    void releaseHeld(Released& released) {
+        while(nb_held > 0 && (held & (uint64_t(1) << (next_count % window_size)))) {
+            this->releaseOrSkip(released);
+        }
+    }
+
+    /**
+     * @brief Move the window by one sequence count: release the held spacepacket of the next
+     *        expected count, or declare it lost
+     */
+    void releaseOrSkip(Released& released) {
+        std::size_t slot = next_count % window_size;
+        uint64_t bit = uint64_t(1) << slot;
+
+        if(held & bit) {
+            held &= ~bit;
+            delivering |= bit;
+            nb_held--;
+            stats.nb_reordered++;
+            released.slots[released.nb_slots++] = static_cast<uint8_t>(slot);
+        } else {
+            stats.nb_lost++;
+        }
+        next_count = (next_count + 1) & COUNT_MASK;
+    }
+
+    /**
+     * @brief Give the released spacepackets their turn among the deliveries. Called with the lock.
+     */
+    void takeTicket(Released& released) {
+        if(!released.isEmpty()) {
+            released.ticket = next_ticket++;
+        }
+    }
+
+    /**
+     * @brief Wait for the turn of the released spacepackets, deliver them without the lock, then
+     *        free their slots
+     */
+    template<typename BufferType, typename Deliver>
+    void deliverReleased(const Released& released, const BufferType& packet, Deliver& deliver) {
+        if(released.isEmpty()) {
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            delivered.wait(lock, [this, &released]() { return serving == released.ticket; });
+        }
+
+        uint64_t freed = 0;
+        for(std::size_t i = 0; i <= released.nb_slots; i++) {
+            if(released.with_packet && released.packet_position == i) {
+                deliver(packet);
+            }
+            if(i < released.nb_slots) {
+                std::size_t slot = released.slots[i];
+                // the slot is not written while it is being delivered
+                UserBuffer held_packet(slots.getStart() + slot * slot_size, slot_sizes[slot]);
+                deliver(static_cast<const IBuffer&>(held_packet));
+                freed |= uint64_t(1) << slot;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            delivering &= ~freed;
+            serving++;
+        }
+        delivered.notify_all();
+    }
+
+    /** The size of a slot */
+    const std::size_t   slot_size;
+    /** The amount of slots, 0 if they could not be allocated */
+    std::size_t         window_size = 0;
+    /** The memory of the slots */
+    UserBuffer          slots;
+    /** The size of the spacepacket held in each slot */
+    std::size_t         slot_sizes[MAX_WINDOW_SIZE] = {};
+    /** One bit per slot holding a spacepacket */
+    uint64_t            held = 0;
+    /** The amount of slots holding a spacepacket */
+    std::size_t         nb_held = 0;
+    /** One bit per slot released, whose delivery is not done */
+    uint64_t            delivering = 0;
+    /** The next expected sequence count */
+    uint16_t            next_count;
+    /** If the window follows the restarts of the source (@see{setResync}) */
+    bool                resync = false;
+    /** If the next expected count is taken from the next spacepacket received */
+    bool                resync_pending = false;
+    /** The amount of late spacepackets received in a row */
+    std::size_t         nb_late_run = 0;
+    /** The ticket of the next call that releases spacepackets */
+    uint64_t            next_ticket = 0;
+    /** The ticket of the call whose turn it is to deliver */
+    uint64_t            serving = 0;
+
+    SpReorderStats      stats;
+    mutable std::mutex  mutex;
+    /** Signaled when a delivery is done */
+    std::condition_variable delivered;
+};
+
+} //namespace
+
+#endif //CCSDS_REORDER_HPP
@@ -0,0 +1,180 @@
+/**************************************************************************//**
+ * @file replay.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a layer that feeds the spacepackets of a capture file back
+ *        to the layer above it
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_REPLAY_HPP
+#define CCSDS_REPLAY_HPP
+
+#include "utils/buffer.hpp"
+#include "utils/clock.hpp"
+#include "utils/commlayer.hpp"
+#include "utils/span.hpp"
+#include "spacepacket/capture.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace ccsds
+{
+
+/**
+ * @brief Metrics of a replay
+ */
+struct SpReplayStats {
+    /** Spacepackets given to the upper layer */
+    uint64_t nb_packets = 0;
+    /** Bytes of spacepackets given to the upper layer */
+    uint64_t nb_bytes = 0;
+    /** Time taken by the replay, in nanoseconds */
+    uint64_t duration = 0;
+    /** Largest delay of a spacepacket behind its recorded pace, in nanoseconds (0 as fast as possible) */
+    uint64_t max_lag = 0;
+};
+
+/**
+ * @brief Sub-layer that replays the spacepackets of a capture (@see{SpCaptureReader}) to the layer
+ *        above it, as if they were received: at their recorded pace (or a multiple of it), or as fast
+ *        as possible. Spacepackets transmitted by the upper layer go on to the sub-layer, if any.
+ * @verbatim
+ *          -------------------------------------
+ *          |        SpTransferService          |
+ *          -------------------------------------
+ *                             ^ receiveFromSubLayer / batches
+ *          -------------------------------------
+ *          |  SpCaptureReplay    <- file       |
+ *          -------------------------------------
+ * @endverbatim
+ * @code
+ *          SpCaptureReader reader;
+ *          reader.open("pass.spcap");
+ *          SpCaptureReplay<> replay;
+ *          replay.connectUpperLayer(service);
+ *          service.setSequenceResync(true);                  // the capture starts mid-stream
+ *          SpCaptureQuery query;
+ *          query.directions = SP_CAPTURE_RX;
+ *          replay.replay(reader.find(query), 0.0);           // a multi-hour pass in seconds
+ * @endcode
+ * 
+ * @details The spacepackets are given straight from the mapping of the reader, without copy. The
+ *          spacepackets already due are given in batches of up to BATCH_SIZE (receiveBatchFromSubLayer),
+ *          so a replay as fast as possible goes through the batched reception path of the upper layer.
+ *          At the recorded pace, the replay sleeps until a spacepacket is almost due, then yields until
+ *          it is. A replay runs in the calling thread, and can be stopped from another one.
+ *          A capture rarely starts at sequence count 0, and a query can skip spacepackets: a
+ *          SpTransferService above the replay must resynchronize its APIDs on the counts it receives
+ *          (@see{SpTransferService::setSequenceResync}), or it rejects every spacepacket of an APID
+ *          whose first count is not the next one it expects.
+ * 
+ * @tparam Clock The clock used to pace the replay. @see{MonotonicClock}
+ */
+template<typename Clock = MonotonicClock>
+class SpCaptureReplay : public ICommunicationLayer
+{
+public:
+    enum {
+        /** Maximum amount of spacepackets given to the upper layer at once */
+        BATCH_SIZE = 32,
+    };
+
+    /**
+     * @brief Replay the records read by a cursor
+     * 
+     * @param cursor The records to replay, @see{SpCaptureReader::find}
+     * @param speed The speed relative to the recorded pace (1.0: as recorded, 10.0: ten times faster),
+     *              0 for as fast as possible
+     * @return The metrics of the replay
+     */
+    SpReplayStats replay(SpCaptureCursor cursor, double speed = 1.0) {
+        SpReplayStats stats;
+        stopped.store(false, std::memory_order_relaxed);
+
+        UserBuffer batch[BATCH_SIZE];
+        SpCaptureRecord record;
+        bool has_record = cursor.next(record);
+        uint64_t first_time = record.timestamp;
+        uint64_t start = Clock::now();
+
+        while(has_record && !stopped.load(std::memory_order_relaxed)) {
+            uint64_t now = Clock::now();
+            std::size_t nb_due = 0;
+
+            // every spacepacket due by now goes in the batch
+            while(has_record && nb_due < BATCH_SIZE) {
+                uint64_t due = start + this->getOffset(record.timestamp - first_time, speed);
+                if(due > now) {
+                    break;
+                }
+                if(speed > 0 && now - due > stats.max_lag) {
+                    stats.max_lag = now - due;
+                }
+                batch[nb_due++] = record.packet;
+                stats.nb_bytes += record.packet.getSize();
+                has_record = cursor.next(record);
+            }
+
+            if(nb_due == 1) {
+                this->pushToUpperLayer(batch[0]);
+            } else if(nb_due > 1) {
+                this->pushBatchToUpperLayer(Span<const UserBuffer>(batch, nb_due));
+            } else {
+                this->waitUntil(start + this->getOffset(record.timestamp - first_time, speed));
+            }
+            stats.nb_packets += nb_due;
+        }
+
+        stats.duration = Clock::now() - start;
+        return stats;
+    }
+
+    /**
+     * @brief Stop the replay running in another thread, after its current batch
+     */
+    void stop() {
+        stopped.store(true, std::memory_order_relaxed);
+    }
+
+private:
+    enum : uint64_t {
+        /** Below this delay, the replay yields instead of sleeping (sleeps overshoot) */
+        SPIN_DELAY = 200000ULL,
+    };
+
+    static uint64_t getOffset(uint64_t elapsed, double speed) {
+        return (speed > 0) ? static_cast<uint64_t>(static_cast<double>(elapsed) / speed) : 0;
+    }
+
+    void waitUntil(uint64_t due) {
+        uint64_t now = Clock::now();
+        while(now < due && !stopped.load(std::memory_order_relaxed)) {
+            if(due - now > SPIN_DELAY) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - SPIN_DELAY));
+            } else {
+                std::this_thread::yield();
+            }
+            now = Clock::now();
+        }
+    }
+
+    void receiveFromUpperLayer(const IBuffer& bytes) override {
+        this->pushToSubLayer(bytes);
+    }
+
+    void receiveChainFromUpperLayer(const IBufferChain& chain) override {
+        this->pushToSubLayer(chain);
+    }
+
+    void receiveFromSubLayer(const IBuffer& bytes) override {
+        this->pushToUpperLayer(bytes);
+    }
+
+    std::atomic<bool> stopped{false};
+};
+
+} //namespace
+
+#endif //CCSDS_REPLAY_HPP
@@ -0,0 +1,696 @@
+/**************************************************************************//**
+ * @file scheduler.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a layer that queues the transmitted spacepackets by priority
+ *        and sends them to the sub-layer on demand
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_SCHEDULER_HPP
+#define CCSDS_SCHEDULER_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
+#include "utils/clock.hpp"
+#include "utils/commlayer.hpp"
+#include "utils/tokenbucket.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace ccsds
+{
+
+/**
+ * @brief How the transmit scheduler chooses the next channel to send from. @see{SpTxScheduler}
+ */
+enum SpSchedulingPolicy {
+    /** The lowest channel with waiting spacepackets always goes first */
+    SP_SCHEDULING_STRICT,
+    /** Channels take turns, each sending up to its weight in spacepackets per turn */
+    SP_SCHEDULING_WEIGHTED_ROUND_ROBIN,
+};
+
+/**
+ * @brief Metrics of a channel of the transmit scheduler
+ */
+struct SpChannelStats {
+    /** Amount of spacepackets currently waiting in the channel */
+    std::size_t depth = 0;
+    /** Highest amount of spacepackets that waited in the channel */
+    std::size_t high_water = 0;
+    /** Amount of spacepackets sent to the sub-layer */
+    uint64_t    nb_sent = 0;
+    /** Amount of spacepackets dropped because the channel was full */
+    uint64_t    nb_dropped = 0;
+    /** Amount of spacepackets dropped because they were larger than a slot */
+    uint64_t    nb_oversized = 0;
+};
+
+/**
+ * @brief What happens to a spacepacket over the rate limit of its APID. @see{SpTxScheduler::setRateLimit}
+ */
+enum SpRateLimitPolicy {
+    /** The spacepacket is dropped when transmitted */
+    SP_RATE_LIMIT_DROP,
+    /** The spacepacket waits at the head of its channel, holding the spacepackets behind it */
+    SP_RATE_LIMIT_DEFER,
+};
+
+/**
+ * @brief Rate limit of an APID. The limits are token buckets: the APID can go at the rate on average,
+ *        with bursts of at most the burst size.
+ */
+struct SpRateLimit {
+    /** Maximum rate, in bytes per second (headers included), 0 for no limit */
+    uint64_t            bytes_per_second = 0;
+    /** Maximum rate, in spacepackets per second, 0 for no limit */
+    uint64_t            packets_per_second = 0;
+    /** Maximum burst, in bytes, 0 for one second at the rate */
+    uint64_t            burst_bytes = 0;
+    /** Maximum burst, in spacepackets, 0 for one second at the rate */
+    uint64_t            burst_packets = 0;
+    SpRateLimitPolicy   policy = SP_RATE_LIMIT_DROP;
+};
+
+/**
+ * @brief Counters of the rate limit of an APID
+ */
+struct SpRateLimitStats {
+    /** Amount of spacepackets dropped because they were over the limit */
+    uint64_t    nb_dropped = 0;
+    /** Amount of spacepackets that had to wait because they were over the limit */
+    uint64_t    nb_deferred = 0;
+};
+
+/**
+ * @brief Counters of the link pacing. @see{SpTxScheduler::setLinkRate}
+ */
+struct SpPacingStats {
+    /** Amount of spacepackets that had to wait because the link was at its rate */
+    uint64_t    nb_deferred = 0;
+    /** Amount of bytes released to the sub-layer */
+    uint64_t    bytes_released = 0;
+};
+
+/**
+ * @brief Layer between a transfer service and its sub-layer, that queues the transmitted spacepackets
+ *        in channels (virtual channels) by APID, and sends them to the sub-layer when drained, by
+ *        priority. Received spacepackets go through without being queued.
+ * @verbatim
+ *          -------------------------------------
+ *          |        SpTransferService          |
+ *          -------------------------------------
+ *                   | transmit
+ *          -------------------------------------
+ *          | SpTxScheduler  [0] [1] ... [N-1]  |     drain() from the link thread
+ *          -------------------------------------
+ *                   | by priority
+ *          -------------------------------------
+ *          |              Sub-Layer            |
+ *          -------------------------------------
+ * @endverbatim
+ * @code
+ *          SpTxScheduler<> scheduler(2);                           // 0: events, 1: bulk (default)
+ *          scheduler.setChannel(EVENTS_APID, 0);
+ *          scheduler.connectUpperLayer(service);
+ *          link.connectUpperLayer(scheduler);
+ *          // link thread, when the link has room
+ *          scheduler.drain(16);
+ * @endcode
+ * 
+ * @details Channel 0 has the highest priority. APIDs go to the last (lowest priority) channel until
+ *          given another one. With strict priority, a spacepacket of channel 0 waits at most for the
+ *          batch being sent (DRAIN_BATCH_SIZE spacepackets), whatever the load of the other channels;
+ *          lower channels may starve. With weighted round-robin, every channel gets a share of the
+ *          link, and a spacepacket at the head of its channel waits at most for the sum of the weights
+ *          of the other channels. Each channel owns its slots, allocated once when constructed: a
+ *          flooded channel drops its own spacepackets (counted), never those of the other channels.
+ *          Producers can transmit from many threads; drain() is serialized.
+ * 
+ *          The traffic can also be shaped: an APID can be limited in bytes and spacepackets per second
+ *          (setRateLimit), and the link paced at a bit rate (setLinkRate), so that bursts do not overflow
+ *          the buffers downstream. The clock is read once per drain() (and on transmit, for the APIDs
+ *          dropping over their limit), never per spacepacket.
+ * 
+ * @tparam Allocator The allocator used for the slots. @see{isAllocator}
+ * @tparam Clock The clock used for the rate limits and the pacing. @see{MonotonicClock}
+ */
+template<typename Allocator = DefaultAllocator, typename Clock = MonotonicClock>
+class SpTxScheduler : public ICommunicationLayer, private AllocatorHolder<Allocator>
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+public:
+    enum {
+        /** Maximum amount of channels */
+        MAX_CHANNELS = 8,
+        /** Maximum amount of spacepackets sent from a channel before choosing again */
+        DRAIN_BATCH_SIZE = 16,
+    };
+
+    /**
+     * @brief Construct a new SpTxScheduler object
+     * 
+     * @param nb_channels The amount of channels, at most MAX_CHANNELS
+     * @param queue_depth The maximum amount of spacepackets waiting in each channel
+     * @param max_packet_size The maximum size (in bytes) of a spacepacket
+     * @param alloc The allocator to use for the slots
+     */
+    SpTxScheduler(std::size_t nb_channels, std::size_t queue_depth = 256, std::size_t max_packet_size = 4096,
+                  const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), slot_size(max_packet_size), queue_depth(queue_depth > 0 ? queue_depth : 1) {
+        if(nb_channels == 0) {
+            nb_channels = 1;
+        } else if(nb_channels > MAX_CHANNELS) {
+            nb_channels = MAX_CHANNELS;
+        }
+
+        // the sizes of all the slots, followed by the slots
+        std::size_t nb_slots = nb_channels * this->queue_depth;
+        memory = this->getAllocator().allocateBuffer(nb_slots * (sizeof(uint32_t) + slot_size), ALLOC_SITE_SCHEDULER);
+        if(memory.getStart() == nullptr) {
+            return;
+        }
+
+        uint32_t* sizes = reinterpret_cast<uint32_t*>(memory.getStart());
+        uint8_t* slots = memory.getStart() + nb_slots * sizeof(uint32_t);
+        for(std::size_t i = 0; i < nb_channels; i++) {
+            channels[i].sizes = sizes + i * this->queue_depth;
+            channels[i].slots = slots + i * this->queue_depth * slot_size;
+        }
+
+        this->nb_channels = nb_channels;
+        std::memset(channel_of, static_cast<int>(nb_channels - 1), sizeof(channel_of));
+    }
+
+    SpTxScheduler(const SpTxScheduler& other) = delete;
+    SpTxScheduler& operator=(const SpTxScheduler& other) = delete;
+
+    /**
+     * @brief Destroy the SpTxScheduler object. The spacepackets still queued are not sent.
+     */
+    ~SpTxScheduler() {
+        for(ApidLimit*& limit : limits) {
+            this->freeLimit(limit);
+        }
+        this->getAllocator().deallocateBuffer(memory, ALLOC_SITE_SCHEDULER);
+    }
+
+    /**
+     * @brief Send the spacepackets of an APID through a channel. Must be called before the traffic
+     *        of the APID starts.
+     * 
+     * @param apid_value The APID
+     * @param channel The channel, 0 being the highest priority
+     * @return false if the channel does not exist, true otherwise
+     */
+    bool setChannel(uint16_t apid_value, std::size_t channel) {
+        if(channel >= nb_channels) {
+            return false;
+        }
+        channel_of[SpPrimaryHeader::PacketApid(apid_value).getValue()] = static_cast<uint8_t>(channel);
+        return true;
+    }
+
+    /**
+     * @param apid_value The APID
+     * @return The channel the spacepackets of the APID are sent through
+     */
+    std::size_t getChannel(uint16_t apid_value) const {
+        return channel_of[SpPrimaryHeader::PacketApid(apid_value).getValue()];
+    }
+
+    /**
+     * @return The amount of channels, 0 if the slots could not be allocated
+     */
+    std::size_t getNbChannels() const {
+        return nb_channels;
+    }
+
+    /**
+     * @brief Set how the next channel to send from is chosen
+     * 
+     * @param policy The policy
+     */
+    void setPolicy(SpSchedulingPolicy policy) {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        this->policy = policy;
+    }
+
+    /**
+     * @brief Set the weight of a channel, for weighted round-robin
+     * 
+     * @param channel The channel
+     * @param weight The amount of spacepackets the channel sends per turn, at least 1
+     * @return false if the channel does not exist, true otherwise
+     */
+    bool setWeight(std::size_t channel, std::size_t weight) {
+        if(channel >= nb_channels) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        channels[channel].weight = (weight > 0) ? weight : 1;
+        return true;
+    }
+
+    /**
+     * @brief Limit the rate of an APID. Must be called before the traffic of the APID starts.
+     * 
+     * @details With SP_RATE_LIMIT_DROP, the spacepackets over the limit are dropped when transmitted,
+     *          and never take a slot. With SP_RATE_LIMIT_DEFER, they are queued, and the head of the
+     *          channel waits until the limit allows it: the other APIDs of the channel wait behind it,
+     *          so a deferred APID should have its own channel. A spacepacket larger than the burst
+     *          goes when the bucket is full.
+     * 
+     * @param apid_value The APID
+     * @param limit The limit, no limit if both rates are 0
+     * @return false if the limit could not be allocated, true otherwise
+     */
+    bool setRateLimit(uint16_t apid_value, const SpRateLimit& limit) {
+        ApidLimit*& current = limits[SpPrimaryHeader::PacketApid(apid_value).getValue()];
+        if(limit.bytes_per_second == 0 && limit.packets_per_second == 0) {
+            this->freeLimit(current);
+            return true;
+        }
+
+        if(current == nullptr) {
+            UserBuffer block = this->getAllocator().allocateBuffer(sizeof(ApidLimit), ALLOC_SITE_SCHEDULER);
+            if(block.getStart() == nullptr) {
+                return false;
+            }
+            current = new (block.getStart()) ApidLimit();
+        }
+
+        uint64_t now = Clock::now();
+        current->bytes.configure(limit.bytes_per_second, limit.burst_bytes, now);
+        current->packets.configure(limit.packets_per_second, limit.burst_packets, now);
+        current->policy = limit.policy;
+        return true;
+    }
+
+    /**
+     * @param apid_value The APID
+     * @return The counters of the rate limit of the APID, all 0 if it has none
+     */
+    SpRateLimitStats getRateLimitStats(uint16_t apid_value) const {
+        SpRateLimitStats stats;
+        const ApidLimit* limit = limits[SpPrimaryHeader::PacketApid(apid_value).getValue()];
+        if(limit != nullptr) {
+            stats.nb_dropped = limit->nb_dropped.load(std::memory_order_relaxed);
+            stats.nb_deferred = limit->nb_deferred.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
+    /**
+     * @brief Pace the spacepackets released to the sub-layer at a bit rate. A spacepacket that would
+     *        go over the rate waits in its channel, and ends the drain.
+     * 
+     * @param bits_per_second The rate of the link, 0 for no pacing
+     * @param burst_bytes The maximum amount of bytes released at once, 0 for a slot
+     */
+    void setLinkRate(uint64_t bits_per_second, uint64_t burst_bytes = 0) {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        link_pacer.configure(bits_per_second, 8 * ((burst_bytes > 0) ? burst_bytes : slot_size), Clock::now());
+    }
+
+    /**
+     * @return The counters of the link pacing
+     */
+    SpPacingStats getPacingStats() const {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        return pacing_stats;
+    }
+
+    /**
+     * @brief Get when the spacepackets held by the rate limits or the pacing at the last drain() can
+     *        go, so the link thread can sleep until then
+     * 
+     * @return The time, from the Clock, 0 if the last drain() was not held
+     */
+    uint64_t getNextReleaseTime() const {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        return next_release;
+    }
+
+    /**
+     * @brief Send waiting spacepackets to the sub-layer, by priority. Called by the thread that
+     *        feeds the link, whenever the link has room.
+     * 
+     * @param max_packets The maximum amount of spacepackets to send
+     * @return The amount of spacepackets sent
+     */
+    std::size_t drain(std::size_t max_packets = SIZE_MAX) {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        std::size_t nb_sent = 0;
+        uint64_t now = Clock::now();
+        // the channels whose head waits for its rate limit
+        uint32_t held = 0;
+        next_release = 0;
+
+        while(nb_sent < max_packets) {
+            std::size_t channel = 0;
+            std::size_t nb_packets = this->selectChannel(max_packets - nb_sent, held, channel);
+            if(nb_packets == 0) {
+                break;
+            }
+
+            Release release = RELEASED;
+            std::size_t nb_batch = this->sendBatch(channel, nb_packets, now, release);
+            nb_sent += nb_batch;
+            if(release == HELD_BY_LINK) {
+                // the turn of the channel goes on at the next drain
+                wrr_credit += nb_packets - nb_batch;
+                break;
+            }
+            if(release == HELD_BY_APID) {
+                held |= uint32_t(1) << channel;
+                // the channel ends its turn
+                wrr_credit = 0;
+            }
+        }
+        return nb_sent;
+    }
+
+    /**
+     * @return The amount of spacepackets waiting, all channels combined
+     */
+    std::size_t getPending() const {
+        std::size_t total = 0;
+        for(std::size_t i = 0; i < nb_channels; i++) {
+            total += channels[i].pending.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /**
+     * @param channel The channel
+     * @return The metrics of the channel, all 0 if it does not exist
+     */
+    SpChannelStats getStats(std::size_t channel) const {
+        if(channel >= nb_channels) {
+            return SpChannelStats();
+        }
+
+        const Channel& current = channels[channel];
+        std::lock_guard<std::mutex> lock(current.mutex);
+        SpChannelStats stats = current.stats;
+        stats.depth = current.tail - current.head;
+        return stats;
+    }
+
+private:
+    struct Channel {
+        /** The size of the spacepacket in each slot */
+        uint32_t*           sizes = nullptr;
+        /** The slots, in a ring */
+        uint8_t*            slots = nullptr;
+        /** Amount of spacepackets sent and queued since the beginning (the slot is the count modulo the depth) */
+        std::size_t         head = 0;
+        std::size_t         tail = 0;
+        /** Amount of spacepackets waiting, read by the drain without the lock */
+        std::atomic<std::size_t> pending{0};
+        /** Spacepackets per turn, for weighted round-robin */
+        std::size_t         weight = 1;
+        /** The spacepacket last counted as deferred (by its count), to count it once */
+        std::size_t         deferred = SIZE_MAX;
+        SpChannelStats      stats;
+        mutable std::mutex  mutex;
+    };
+
+    /** Rate limit of an APID: the buckets are used under the lock of the channel with SP_RATE_LIMIT_DROP, by the drain otherwise */
+    struct ApidLimit {
+        TokenBucket         bytes;
+        TokenBucket         packets;
+        SpRateLimitPolicy   policy = SP_RATE_LIMIT_DROP;
+        std::atomic<uint64_t> nb_dropped{0};
+        std::atomic<uint64_t> nb_deferred{0};
+    };
+
+    /** What kept a spacepacket from being sent */
+    enum Release {
+        RELEASED,
+        /** The rate limit of its APID */
+        HELD_BY_APID,
+        /** The pacing of the link */
+        HELD_BY_LINK,
+    };
+
+    void receiveFromUpperLayer(const IBuffer& bytes) override {
+        this->enqueue(bytes.getStart(), bytes.getSize(), [&bytes](uint8_t* slot) {
+            std::memcpy(slot, bytes.getStart(), bytes.getSize());
+        });
+    }
+
+    void receiveChainFromUpperLayer(const IBufferChain& chain) override {
+        const uint8_t* first = chain.getNbSegments() > 0 ? chain.getSegment(0).getStart() : nullptr;
+        this->enqueue(first, chain.getSize(), [this, &chain](uint8_t* slot) {
+            UserBuffer dst(slot, slot_size);
+            chain.copyTo(dst);
+        });
+    }
+
+    void receiveFromSubLayer(const IBuffer& bytes) override {
+        this->pushToUpperLayer(bytes);
+    }
+
+    void receiveChainFromSubLayer(const IBufferChain& chain) override {
+        this->pushToUpperLayer(chain);
+    }
+
+    void receiveBatchFromSubLayer(Span<const UserBuffer> batch) override {
+        this->pushBatchToUpperLayer(batch);
+    }
+
+    /**
+     * @brief Copy a spacepacket in the channel of its APID
+     * 
+     * @param header The first bytes of the spacepacket, holding at least its APID
+     * @param size The size of the spacepacket
+     * @param copy The function copying the spacepacket in a slot (uint8_t*)
+     */
+    template<typename Copy>
+    void enqueue(const uint8_t* header, std::size_t size, Copy&& copy) {
+        if(nb_channels == 0 || header == nullptr || size < SpPrimaryHeader::SIZE) {
+            return;
+        }
+
+        uint16_t apid = SpPrimaryHeader::peekApid(header);
+        Channel& channel = channels[channel_of[apid]];
+        ApidLimit* limit = limits[apid];
+        std::lock_guard<std::mutex> lock(channel.mutex);
+
+        if(size > slot_size) {
+            channel.stats.nb_oversized++;
+            return;
+        }
+        if(limit != nullptr && limit->policy == SP_RATE_LIMIT_DROP) {
+            uint64_t now = Clock::now();
+            if(!limit->bytes.canConsume(size, now) || !limit->packets.canConsume(1, now)) {
+                limit->nb_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            limit->bytes.consume(size);
+            limit->packets.consume(1);
+        }
+        if(channel.tail - channel.head == queue_depth) {
+            channel.stats.nb_dropped++;
+            return;
+        }
+
+        std::size_t slot = channel.tail % queue_depth;
+        copy(channel.slots + slot * slot_size);
+        channel.sizes[slot] = static_cast<uint32_t>(size);
+        channel.tail++;
+        channel.pending.fetch_add(1, std::memory_order_release);
+
+        if(channel.tail - channel.head > channel.stats.high_water) {
+            channel.stats.high_water = channel.tail - channel.head;
+        }
+    }
+
+    /**
+     * @brief Choose the channel to send from, according to the policy
+     * 
+     * @param max_packets The maximum amount of spacepackets to send
+     * @param held The channels to skip (bit #n for channel #n)
+     * @param channel The chosen channel
+     * @return The amount of spacepackets to send from the channel, 0 if no spacepacket is waiting
+     */
+    std::size_t selectChannel(std::size_t max_packets, uint32_t held, std::size_t& channel) {
+        std::size_t limit = (max_packets < DRAIN_BATCH_SIZE) ? max_packets : static_cast<std::size_t>(DRAIN_BATCH_SIZE);
+
+        if(policy == SP_SCHEDULING_STRICT) {
+            for(channel = 0; channel < nb_channels; channel++) {
+                std::size_t pending = channels[channel].pending.load(std::memory_order_acquire);
+                if(pending > 0 && (held & (uint32_t(1) << channel)) == 0) {
+                    return (pending < limit) ? pending : limit;
+                }
+            }
+            return 0;
+        }
+
+        // weighted round-robin: go around at most once looking for a channel with waiting spacepackets
+        for(std::size_t i = 0; i <= nb_channels; i++) {
+            channel = wrr_channel;
+            std::size_t pending = channels[channel].pending.load(std::memory_order_acquire);
+            if(pending > 0 && wrr_credit > 0 && (held & (uint32_t(1) << channel)) == 0) {
+                std::size_t nb_packets = (pending < limit) ? pending : limit;
+                nb_packets = (nb_packets < wrr_credit) ? nb_packets : wrr_credit;
+                wrr_credit -= nb_packets;
+                return nb_packets;
+            }
+
+            // the channel is idle or had its turn: the next one starts its turn
+            wrr_channel = (wrr_channel + 1) % nb_channels;
+            wrr_credit = channels[wrr_channel].weight;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Send the first spacepackets of a channel to the sub-layer, until one is held by a rate
+     *        limit or the pacing. Their slots are only given back to the producers once sent.
+     * 
+     * @param index The channel
+     * @param nb_packets The maximum amount of spacepackets to send
+     * @param now The current time
+     * @param release What held the last spacepacket, RELEASED if none was held
+     * @return The amount of spacepackets sent
+     */
+    std::size_t sendBatch(std::size_t index, std::size_t nb_packets, uint64_t now, Release& release) {
+        Channel& channel = channels[index];
+        std::size_t head;
+        {
+            std::lock_guard<std::mutex> lock(channel.mutex);
+            head = channel.head;
+        }
+
+        std::size_t nb_sent = 0;
+        for(; nb_sent < nb_packets; nb_sent++) {
+            std::size_t slot = (head + nb_sent) % queue_depth;
+            UserBuffer packet(channel.slots + slot * slot_size, channel.sizes[slot]);
+            release = this->checkRelease(packet, now);
+            if(release != RELEASED) {
+                this->countDeferred(channel, head + nb_sent, packet, release);
+                break;
+            }
+            this->pushToSubLayer(packet);
+        }
+        if(nb_sent == 0) {
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lock(channel.mutex);
+        channel.head += nb_sent;
+        channel.pending.fetch_sub(nb_sent, std::memory_order_relaxed);
+        channel.stats.nb_sent += nb_sent;
+        return nb_sent;
+    }
+
+    /**
+     * @brief Check the deferred rate limit of the APID of a spacepacket and the pacing of the link,
+     *        and use their tokens if both let it go
+     * 
+     * @return What held the spacepacket, RELEASED if none did
+     */
+    Release checkRelease(const UserBuffer& packet, uint64_t now) {
+        std::size_t size = packet.getSize();
+        ApidLimit* limit = limits[SpPrimaryHeader::peekApid(packet.getStart())];
+        if(limit != nullptr && limit->policy != SP_RATE_LIMIT_DEFER) {
+            limit = nullptr;
+        }
+
+        if(limit != nullptr && (!limit->bytes.canConsume(size, now) || !limit->packets.canConsume(1, now))) {
+            uint64_t delay = limit->bytes.getDelay(size, now);
+            uint64_t packets_delay = limit->packets.getDelay(1, now);
+            this->holdUntil(now + (delay > packets_delay ? delay : packets_delay));
+            return HELD_BY_APID;
+        }
+        if(!link_pacer.canConsume(8 * size, now)) {
+            this->holdUntil(now + link_pacer.getDelay(8 * size, now));
+            return HELD_BY_LINK;
+        }
+
+        if(limit != nullptr) {
+            limit->bytes.consume(size);
+            limit->packets.consume(1);
+        }
+        link_pacer.consume(8 * size);
+        pacing_stats.bytes_released += size;
+        return RELEASED;
+    }
+
+    /**
+     * @brief Count a held spacepacket as deferred, once however many drains it waits for
+     * 
+     * @param count The count of the spacepacket in its channel
+     */
+    void countDeferred(Channel& channel, std::size_t count, const UserBuffer& packet, Release release) {
+        if(channel.deferred == count) {
+            return;
+        }
+        channel.deferred = count;
+
+        if(release == HELD_BY_LINK) {
+            pacing_stats.nb_deferred++;
+        } else {
+            limits[SpPrimaryHeader::peekApid(packet.getStart())]->nb_deferred.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Keep the earliest time a held spacepacket can go. @see{getNextReleaseTime}
+     */
+    void holdUntil(uint64_t time) {
+        if(next_release == 0 || time < next_release) {
+            next_release = time;
+        }
+    }
+
+    void freeLimit(ApidLimit*& limit) {
+        if(limit == nullptr) {
+            return;
+        }
+        limit->~ApidLimit();
+        UserBuffer block(reinterpret_cast<uint8_t*>(limit), sizeof(ApidLimit));
+        this->getAllocator().deallocateBuffer(block, ALLOC_SITE_SCHEDULER);
+        limit = nullptr;
+    }
+
+    /** The size of a slot */
+    const std::size_t   slot_size;
+    /** The amount of slots of each channel */
+    const std::size_t   queue_depth;
+    /** The amount of channels, 0 if the slots could not be allocated */
+    std::size_t         nb_channels = 0;
+    /** The memory of the slots of every channel */
+    UserBuffer          memory;
+    Channel             channels[MAX_CHANNELS];
+    /** The channel of each APID */
+    uint8_t             channel_of[SpPrimaryHeader::PacketApid::IDLE_VALUE + 1] = {};
+    /** The rate limit of each APID, nullptr if none */
+    ApidLimit*          limits[SpPrimaryHeader::PacketApid::IDLE_VALUE + 1] = {};
+
+    SpSchedulingPolicy  policy = SP_SCHEDULING_STRICT;
+    /** The channel whose turn it is, for weighted round-robin */
+    std::size_t         wrr_channel = 0;
+    /** The amount of spacepackets the channel can still send in its turn */
+    std::size_t         wrr_credit = 1;
+    /** Paces the bits released to the sub-layer, unlimited by default */
+    TokenBucket         link_pacer;
+    SpPacingStats       pacing_stats;
+    /** When the spacepackets held at the last drain can go, 0 if none */
+    uint64_t            next_release = 0;
+    /** Serializes drain() and the changes of policy */
+    mutable std::mutex  drain_mutex;
+};
+
+} //namespace
+
+#endif //CCSDS_SCHEDULER_HPP
@@ -0,0 +1,271 @@
+/**************************************************************************//**
+ * @file segmenter.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains classes that split large user data in many segmented
+ *        spacepackets
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_SEGMENTER_HPP
+#define CCSDS_SEGMENTER_HPP
+
+#include "utils/buffer.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include "spacepacket/spacepacket.hpp"
+#include "spacepacket/transfer.hpp"
+#include <cstdint>
+
+namespace ccsds
+{
+
+/**
+ * @brief Source of user data read as it is segmented, without being held in memory all at once
+ *        (e.g a file, a ring buffer of an instrument). @see{SpSegmenter}
+ */
+class ISpPayloadSource
+{
+public:
+    /**
+     * @return The total size (in bytes) of the user data
+     */
+    virtual std::size_t getSize() const = 0;
+
+    /**
+     * @brief Read the next bytes of the user data
+     * 
+     * @param size The amount of bytes to read, never more than what remains
+     * @return The bytes, held by the source until the next call, or nullptr if they could not be read
+     */
+    virtual const uint8_t* read(std::size_t size) = 0;
+};
+
+/**
+ * @brief Source over user data already held in a buffer. Reading never copies the bytes.
+ */
+class SpBufferSource : public ISpPayloadSource
+{
+public:
+    /**
+     * @brief Construct a new SpBufferSource object
+     * 
+     * @param payload The user data. Must remain valid while it is read.
+     */
+    SpBufferSource(const IBuffer& payload)
+    : start(payload.getStart()), size(payload.getSize()) {
+
+    }
+
+    std::size_t getSize() const override {
+        return size;
+    }
+
+    const uint8_t* read(std::size_t nb_bytes) override {
+        const uint8_t* bytes = start + offset;
+        offset += nb_bytes;
+        return bytes;
+    }
+
+private:
+    const uint8_t*  start;
+    std::size_t     size;
+    /** The amount of bytes already read */
+    std::size_t     offset = 0;
+};
+
+/**
+ * @brief Spacepacket production class for user data larger than a spacepacket (or than the maximum
+ *        size of a spacepacket on the link). The user data is split in a first segment, continuation
+ *        segments and a last segment (@see{SpPrimaryHeader::SequenceFlags}), with consecutive sequence
+ *        counts. User data that fits in one spacepacket is transmitted unsegmented.
+ * @code
+ *          SpSegmenter<MySecHdr> segmenter(transfer_service, 1024);
+ *          segmenter.primary_hdr.apid.setValue(42);
+ *          segmenter.transmit(image);                      // 10 MiB, never copied
+ * @endcode
+ * 
+ * @details The headers of each segment are serialized in a small buffer, chained before a slice of
+ *          the user data (@see{SpChainBuilder}): the user data is never copied by the segmenter. Every
+ *          segment carries the secondary header. The sequence counts of all the segments are reserved
+ *          at once, so the segments follow each other even if other producers transmit on the APID.
+ *          The first segment is read and checked before the counts are reserved. If the source fails
+ *          after that, the counts left are still transmitted, as continuation segments without user
+ *          data, so that the sequence counts of the APID have no gap; the receiver never gets the last
+ *          segment, and drops the user data. A segmenter is used by one thread at a time.
+ * 
+ * @tparam SecHdrType The secondary header type. Must be a type derived from ISpSecondaryHeader
+ * @tparam Service The transfer service the segments are transmitted through
+ */
+template<typename SecHdrType, typename Service = SpTransferService<>>
+class SpSegmenter
+{
+public:
+    enum {
+        /** Maximum size (in bytes) of a segment. One byte below SPACEPACKET_MAX_SIZE: the length of the
+            data field is set with SpPrimaryHeader::PacketLength::setLength(uint16_t), which takes at most
+            UINT16_MAX bytes. */
+        MAX_PACKET_SIZE = SpPrimaryHeader::SIZE + UINT16_MAX,
+        /** Size (in bytes) of the headers of every segment */
+        HEADERS_SIZE = SpPrimaryHeader::SIZE + SecHdrType::getSize(),
+    };
+
+    /**
+     * @brief Construct a new SpSegmenter object
+     * 
+     * @param service The transfer service to transmit the segments through
+     * @param max_packet_size The maximum size (in bytes) of a segment, headers included.
+     *                        @see{setMaxPacketSize}
+     */
+    SpSegmenter(Service& service, std::size_t max_packet_size = MAX_PACKET_SIZE)
+    : service(service) {
+        if(!this->setMaxPacketSize(max_packet_size)) {
+            this->setMaxPacketSize(MAX_PACKET_SIZE);
+        }
+    }
+
+    /**
+     * @brief Set the maximum size of a segment
+     * 
+     * @param max_packet_size The maximum size (in bytes) of a segment, headers included. Must leave room
+     *                        for at least one byte of user data, and be at most MAX_PACKET_SIZE.
+     * @return false if the size is out of bounds (it is not changed), true otherwise
+     */
+    bool setMaxPacketSize(std::size_t max_packet_size) {
+        if(max_packet_size <= HEADERS_SIZE || max_packet_size > MAX_PACKET_SIZE) {
+            return false;
+        }
+        this->max_packet_size = max_packet_size;
+        return true;
+    }
+
+    /**
+     * @return The maximum size (in bytes) of a segment, headers included
+     */
+    std::size_t getMaxPacketSize() const {
+        return max_packet_size;
+    }
+
+    /**
+     * @return The maximum amount of user data (in bytes) in a segment
+     */
+    std::size_t getMaxSegmentDataSize() const {
+        return max_packet_size - HEADERS_SIZE;
+    }
+
+    /**
+     * @brief Transmit user data held in a buffer
+     * 
+     * @param payload The user data
+     * @return false if the user data could not be transmitted, true otherwise. @see{transmit(ISpPayloadSource&)}
+     */
+    bool transmit(const IBuffer& payload) {
+        SpBufferSource source(payload);
+        return this->transmit(source);
+    }
+
+    /**
+     * @brief Transmit user data read from a source, one segment at a time
+     * 
+     * @param source The source of the user data
+     * @return false if the user data is empty and there is no secondary header, if the segments are
+     *         invalid, or if the source failed to read a segment (@see{SpSegmenter}), true otherwise
+     */
+    bool transmit(ISpPayloadSource& source) {
+        std::size_t remaining = source.getSize();
+        if(remaining == 0 && SecHdrType::getSize() == 0) {
+            return false;
+        }
+
+        std::size_t segment_size = this->getMaxSegmentDataSize();
+        std::size_t nb_segments = (remaining > 0) ? (remaining + segment_size - 1) / segment_size : 1;
+
+        builder.primary_hdr = primary_hdr;
+        builder.secondary_hdr = secondary_hdr;
+
+        // the first segment is ready before the counts are reserved: a failure here leaves no gap
+        std::size_t size = (remaining < segment_size) ? remaining : segment_size;
+        const uint8_t* bytes = source.read(size);
+        if(bytes == nullptr) {
+            return false;
+        }
+        this->prepareSegment(getSequenceFlags(0, nb_segments), bytes, size);
+        builder.prepareHeader();
+        if(!builder.isValid()) {
+            // rejected and counted by the service, no count is used
+            return service.transmitReserved(builder);
+        }
+
+        uint16_t count = service.reserveSequenceCounts(primary_hdr.apid.getValue(), nb_segments);
+        for(std::size_t i = 0; i < nb_segments; i++) {
+            if(i > 0) {
+                size = (remaining < segment_size) ? remaining : segment_size;
+                bytes = source.read(size);
+                if(bytes == nullptr) {
+                    this->transmitFillers(count, i, nb_segments);
+                    return false;
+                }
+                this->prepareSegment(getSequenceFlags(i, nb_segments), bytes, size);
+            }
+            remaining -= size;
+
+            builder.primary_hdr.sequence_count.setValue(count + i);
+            if(!service.transmitReserved(builder)) {
+                this->transmitFillers(count, i, nb_segments);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** The primary header of every segment. The sequence flags, count and length are set when transmitting. */
+    SpPrimaryHeader primary_hdr;
+    /** The secondary header of every segment */
+    SecHdrType      secondary_hdr;
+
+private:
+    void prepareSegment(uint8_t sequence_flags, const uint8_t* bytes, std::size_t size) {
+        builder.primary_hdr.sequence_flags.setValue(sequence_flags);
+        builder.clearData();
+        if(size > 0) {
+            builder.append(const_cast<uint8_t*>(bytes), size);
+        }
+    }
+
+    /**
+     * @brief Transmit the reserved sequence counts left after a failure, as continuation segments
+     *        without user data (a single zero byte if there is no secondary header)
+     * 
+     * @param count The first sequence count reserved
+     * @param first The index of the first segment not transmitted
+     * @param nb_segments The amount of segments reserved
+     */
+    void transmitFillers(uint16_t count, std::size_t first, std::size_t nb_segments) {
+        static uint8_t filler = 0;
+        this->prepareSegment(SpPrimaryHeader::SequenceFlags::CONTINUATION_VALUE, &filler,
+                             (SecHdrType::getSize() == 0) ? 1 : 0);
+        for(std::size_t i = first; i < nb_segments; i++) {
+            builder.primary_hdr.sequence_count.setValue(count + i);
+            service.transmitReserved(builder);
+        }
+    }
+
+    static uint8_t getSequenceFlags(std::size_t index, std::size_t nb_segments) {
+        if(nb_segments == 1) {
+            return SpPrimaryHeader::SequenceFlags::UNSEGMENTED_VALUE;
+        } else if(index == 0) {
+            return SpPrimaryHeader::SequenceFlags::FIRST_SEGMENT_VALUE;
+        } else if(index == nb_segments - 1) {
+            return SpPrimaryHeader::SequenceFlags::LAST_SEGMENT_VALUE;
+        }
+        return SpPrimaryHeader::SequenceFlags::CONTINUATION_VALUE;
+    }
+
+    Service&        service;
+    /** The maximum size of a segment, headers included */
+    std::size_t     max_packet_size = MAX_PACKET_SIZE;
+    /** The segment being transmitted: its headers, followed by a slice of the user data */
+    SpChainBuilder<SecHdrType, 1> builder;
+};
+
+} //namespace
+
+#endif //CCSDS_SEGMENTER_HPP
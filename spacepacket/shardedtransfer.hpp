@@ -0,0 +1,635 @@
+/**************************************************************************//**
+ * @file shardedtransfer.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a Spacepacket communication layer that splits the APIDs
+ *        between many transfer services, each with its own thread
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_SHARDED_TRANSFER_HPP
+#define CCSDS_SHARDED_TRANSFER_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/commlayer.hpp"
+#include "utils/lockfreequeue.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include "spacepacket/transfer.hpp"
+#include "spacepacket/apidset.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace ccsds
+{
+
+/**
+ * @brief Service of spacepacket transfer whose APIDs are partitioned between shards. Each shard is a
+ *        SpTransferService (with its own APID contexts and listener index) fed by its own worker
+ *        thread, optionally pinned to a core.
+ * @verbatim
+ *          ----------------    ----------------
+ *          | Shard 0      |    | Shard N-1    |     SpTransferService + worker thread
+ *          ----------------    ----------------
+ *                 ^  lock-free queues  ^
+ *                 |                    |
+ *          -------------------------------------
+ *          |  SpShardedTransferService (route) |
+ *          -------------------------------------
+ *                            ^
+ *          -------------------------------------
+ *          |              Sub-Layer            |
+ *          -------------------------------------
+ * @endverbatim
+ * 
+ * @details Spacepackets received from the sub-layer are copied in a slot of the shard owning their
+ *          APID and handed to its worker through a lock-free queue, so the receiving thread only
+ *          decodes the APID and copies. When the shard has no free slot, the spacepacket is dropped
+ *          and counted. Spacepackets transmitted locally go through the owning shard on the caller's
+ *          thread. Everything sent to the sub-layer is serialized by a single mutex. The statistics
+ *          of a shard are sized to the APIDs it owns, so the shards don't each carry the statistics
+ *          of every APID.
+ * @note Listeners registered for every APID, or for a set of APIDs, are registered in every shard
+ *       and can be notified concurrently from many workers. Listeners can be (un)registered at any
+ *       time, while the traffic flows: @see{synchronizeListeners} before destroying a removed one.
+ * 
+ * @tparam Allocator The allocator used by the service and its shards. @see{isAllocator}
+ */
+template<typename Allocator = DefaultAllocator>
+class SpShardedTransferService : public ICommunicationLayer, private AllocatorHolder<Allocator>
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+public:
+    enum {
+        /** Maximum amount of shards */
+        MAX_SHARDS = 64,
+    };
+
+    /**
+     * @brief Construct a new SpShardedTransferService object, and start the workers. By default,
+     *        APID A is owned by shard (A % nb_shards).
+     * 
+     * @param nb_shards The amount of shards (and worker threads)
+     * @param queue_depth The maximum amount of received spacepackets waiting in a shard
+     * @param max_packet_size The maximum size (in bytes) of a received spacepacket
+     * @param pin_workers If each worker should be pinned to a core (only on Linux). Off by default: a
+     *                    pinned worker competes with whatever else the application runs on its core.
+     * @param nb_listeners_max The maximum amount of listeners of each shard
+     * @param nb_apids_max The amount of APIDs that get their own statistics in each shard, 0 for the
+     *                     amount of APIDs a shard owns by default. @see{setShard}
+     * @param alloc The allocator to use
+     */
+    SpShardedTransferService(std::size_t nb_shards, std::size_t queue_depth = 1024, std::size_t max_packet_size = 4096,
+                             bool pin_workers = false, std::size_t nb_listeners_max = 1000, std::size_t nb_apids_max = 0,
+                             const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), slot_size(max_packet_size) {
+        if(nb_shards == 0) {
+            nb_shards = 1;
+        }
+        if(nb_shards > MAX_SHARDS) {
+            nb_shards = MAX_SHARDS;
+        }
+
+        // the shards are more aligned than what an allocator guarantees
+        shards_buffer = this->getAllocator().allocateBuffer(nb_shards * sizeof(Shard) + alignof(Shard), ALLOC_SITE_SHARDS);
+        if(shards_buffer.getStart() == nullptr) {
+            return;
+        }
+        uintptr_t address = reinterpret_cast<uintptr_t>(shards_buffer.getStart());
+        address = (address + alignof(Shard) - 1) & ~static_cast<uintptr_t>(alignof(Shard) - 1);
+        shards = reinterpret_cast<Shard*>(address);
+
+        for(std::size_t apid = 0; apid < SpListenerIndex<Allocator>::NB_APIDS; apid++) {
+            shard_of[apid] = static_cast<uint8_t>(apid % nb_shards);
+        }
+
+        // a shard only keeps the statistics of the APIDs it owns (sparse storage)
+        if(nb_apids_max == 0) {
+            nb_apids_max = (SpListenerIndex<Allocator>::NB_APIDS + nb_shards - 1) / nb_shards;
+        }
+
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            new (&shards[i]) Shard(*this, queue_depth, max_packet_size, nb_listeners_max, nb_apids_max, alloc);
+            this->nb_shards++;
+        }
+
+        for(std::size_t i = 0; i < this->nb_shards; i++) {
+            shards[i].worker = std::thread([this, i]() { this->run(shards[i]); });
+            if(pin_workers) {
+                pinToCore(shards[i].worker, i);
+            }
+        }
+    }
+
+    SpShardedTransferService(const SpShardedTransferService& other) = delete;
+    SpShardedTransferService& operator=(const SpShardedTransferService& other) = delete;
+
+    /**
+     * @brief Stop the workers. The spacepackets still queued are not delivered.
+     */
+    ~SpShardedTransferService() {
+        this->stop();
+
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            shards[i].~Shard();
+        }
+        this->getAllocator().deallocateBuffer(shards_buffer, ALLOC_SITE_SHARDS);
+    }
+
+    /**
+     * @brief Stop the workers, and wait for them to finish the spacepacket they are delivering
+     */
+    void stop() {
+        stopping.store(true);
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            {
+                std::lock_guard<std::mutex> lock(shards[i].mutex);
+            }
+            shards[i].wake_cond.notify_one();
+            if(shards[i].worker.joinable()) {
+                shards[i].worker.join();
+            }
+        }
+    }
+
+    /**
+     * @brief Move an APID to another shard. Must be called before the traffic starts.
+     * 
+     * @details Each shard has statistics for nb_apids_max APIDs (@see{SpShardedTransferService}), given
+     *          in order of first use. A shard receiving more APIDs than that should be given a larger
+     *          nb_apids_max at construction: its APIDs beyond it share one set of statistics.
+     * 
+     * @param apid The APID
+     * @param shard The index of the shard that owns the APID
+     */
+    void setShard(SpPrimaryHeader::PacketApid apid, std::size_t shard) {
+        if(shard < nb_shards) {
+            shard_of[apid.getValue()] = static_cast<uint8_t>(shard);
+        }
+    }
+
+    /**
+     * @param apid The APID
+     * @return The index of the shard that owns the APID
+     */
+    std::size_t getShard(SpPrimaryHeader::PacketApid apid) const {
+        return shard_of[apid.getValue()];
+    }
+
+    /**
+     * @return The amount of shards
+     */
+    std::size_t getNbShards() const {
+        return nb_shards;
+    }
+
+    /**
+     * @return The amount of received spacepackets dropped because their shard had no free slot,
+     *         or because they were too small or too large
+     */
+    uint64_t getNbDropped() const {
+        uint64_t total = 0;
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            total += shards[i].nb_dropped.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /**
+     * @return The counters of every shard combined. @see{SpTransferService::getStats}
+     */
+    SpTransferStats getStats() const {
+        SpTransferStats total;
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            SpTransferStats stats = shards[i].service.getStats();
+            total.rx_count       += stats.rx_count;
+            total.tx_count       += stats.tx_count;
+            total.rx_error_count += stats.rx_error_count;
+            total.rx_lost_count  += stats.rx_lost_count;
+            total.tx_error_count += stats.tx_error_count;
+            total.rx_bytes       += stats.rx_bytes;
+            total.tx_bytes       += stats.tx_bytes;
+        }
+        return total;
+    }
+
+    /**
+     * @brief Get the counters of an APID, from the shard owning the APID.
+     *        @see{SpTransferService::getApidStats}
+     */
+    SpTransferStats getApidStats(uint16_t apid_value) const {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        return shards[shard_of[apid.getValue()]].service.getApidStats(apid.getValue());
+    }
+
+    /**
+     * @brief Record the histograms of an APID, in the shard owning the APID.
+     *        @see{SpTransferService::enableHistograms}
+     */
+    bool enableHistograms(uint16_t apid_value) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        return shards[shard_of[apid.getValue()]].service.enableHistograms(apid.getValue());
+    }
+
+    /**
+     * @brief Get the histograms of an APID, from the shard owning the APID.
+     *        @see{SpTransferService::getHistograms}
+     */
+    const SpApidHistograms* getHistograms(uint16_t apid_value) const {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        return shards[shard_of[apid.getValue()]].service.getHistograms(apid.getValue());
+    }
+
+    /**
+     * @brief Count the calls of the listeners of every shard. @see{SpTransferService::enableDispatchStats}
+     * 
+     * @return false if the counters of a shard could not be allocated, true otherwise
+     */
+    bool enableDispatchStats() {
+        bool enabled = true;
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            enabled = shards[i].service.enableDispatchStats() && enabled;
+        }
+        return enabled;
+    }
+
+    /**
+     * @brief Get the dispatch statistics of a listener, from every shard combined.
+     *        @see{SpTransferService::getDispatchStats}
+     */
+    SpDispatchStats getDispatchStats(const SpListener* listener) const {
+        SpDispatchStats total;
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            SpDispatchStats stats = shards[i].service.getDispatchStats(listener);
+            total.nb_calls   += stats.nb_calls;
+            total.nb_packets += stats.nb_packets;
+            total.total_ns   += stats.total_ns;
+            total.max_ns      = (stats.max_ns > total.max_ns) ? stats.max_ns : total.max_ns;
+        }
+        return total;
+    }
+
+    /**
+     * @brief Transmit a spacepacket through the shard owning its APID, on the caller's thread.
+     *        @see{SpTransferService::transmit}
+     * 
+     * @param sp The spacepacket to transmit
+     */
+    template<typename Packet>
+    void transmit(Packet& sp) {
+        shards[shard_of[sp.primary_hdr.apid.getValue()]].service.transmit(sp);
+    }
+
+    /**
+     * @brief Reserve consecutive sequence counts of an APID, in the shard owning the APID.
+     *        @see{SpTransferService::reserveSequenceCounts}
+     */
+    uint16_t reserveSequenceCounts(uint16_t apid_value, std::size_t nb_counts) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        return shards[shard_of[apid.getValue()]].service.reserveSequenceCounts(apid.getValue(), nb_counts);
+    }
+
+    /**
+     * @brief Transmit a spacepacket with a reserved sequence count through the shard owning its APID,
+     *        on the caller's thread. @see{SpTransferService::transmitReserved}
+     */
+    template<typename Packet>
+    bool transmitReserved(Packet& sp) {
+        return shards[shard_of[sp.primary_hdr.apid.getValue()]].service.transmitReserved(sp);
+    }
+
+    /**
+     * @brief Transmit an encoded spacepacket through the shard owning its APID, on the caller's thread.
+     *        @see{SpTransferService::transmitPrebuilt}
+     */
+    bool transmitPrebuilt(IBuffer& packet) {
+        if(packet.getStart() == nullptr || packet.getSize() < SpPrimaryHeader::SIZE) {
+            return false;
+        }
+        return shards[shard_of[SpPrimaryHeader::peekApid(packet.getStart())]].service.transmitPrebuilt(packet);
+    }
+
+    /**
+     * @brief Set the reorder window of an APID, in the shard owning the APID.
+     *        @see{SpTransferService::setReorderWindow}
+     */
+    bool setReorderWindow(uint16_t apid_value, std::size_t window_size, std::size_t max_packet_size = 4096) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        return shards[shard_of[apid.getValue()]].service.setReorderWindow(apid.getValue(), window_size, max_packet_size);
+    }
+
+    /**
+     * @brief Set the duplicate filter of an APID, in the shard owning the APID.
+     *        @see{SpTransferService::setDuplicateFilter}
+     */
+    bool setDuplicateFilter(uint16_t apid_value, std::size_t window_size, bool use_hash = false) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        return shards[shard_of[apid.getValue()]].service.setDuplicateFilter(apid.getValue(), window_size, use_hash);
+    }
+
+    /**
+     * @param apid_value The APID
+     * @return The statistics of the duplicate filter of the APID, in the shard owning the APID
+     */
+    SpDuplicateStats getDuplicateStats(uint16_t apid_value) const {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        return shards[shard_of[apid.getValue()]].service.getDuplicateStats(apid.getValue());
+    }
+
+    /**
+     * @brief Resynchronize an APID on the sequence counts it receives, in every shard (so that it
+     *        follows the APID if moved). @see{SpTransferService::setSequenceResync}
+     */
+    void setSequenceResync(uint16_t apid_value, bool resync) {
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            shards[i].service.setSequenceResync(apid_value, resync);
+        }
+    }
+
+    /**
+     * @brief Resynchronize every APID on the sequence counts it receives. @see{SpTransferService::setSequenceResync}
+     */
+    void setSequenceResync(bool resync) {
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            shards[i].service.setSequenceResync(resync);
+        }
+    }
+
+    /**
+     * @brief Register a listener of every spacepacket in the layer, in every shard
+     * 
+     * @param listener The listener
+     */
+    void registerListener(SpListener* listener) {
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            shards[i].service.registerListener(listener);
+        }
+    }
+
+    /**
+     * @brief Register a listener of the spacepackets of a single APID, in the shard owning the APID
+     * 
+     * @param listener The listener
+     * @param apid_value The APID of the spacepackets to listen to
+     */
+    void registerListener(SpListener* listener, uint16_t apid_value) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        shards[shard_of[apid.getValue()]].service.registerListener(listener, apid.getValue());
+    }
+
+    /**
+     * @brief Register a listener of the spacepackets of a set of APIDs, in every shard
+     * 
+     * @param listener The listener
+     * @param apids The APIDs of the spacepackets to listen to
+     */
+    void registerListener(SpListener* listener, const ApidSet& apids) {
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            shards[i].service.registerListener(listener, apids);
+        }
+    }
+
+    /**
+     * @brief Remove the oldest registration of a listener, in every shard
+     * 
+     * @param listener The listener
+     */
+    void unregisterListener(SpListener* listener) {
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            shards[i].service.unregisterListener(listener);
+        }
+    }
+
+    /**
+     * @brief Wait until the spacepackets being dispatched to the listeners are done, in every shard.
+     *        @see{SpTransferService::synchronizeListeners}
+     */
+    void synchronizeListeners() {
+        for(std::size_t i = 0; i < nb_shards; i++) {
+            shards[i].service.synchronizeListeners();
+        }
+    }
+
+    void connectUpperLayer(ICommunicationLayer& upper_layer) override {
+        (void)upper_layer;
+        //do nothing, the spacepacket layer cannot have an upper layer
+    }
+
+private:
+    /**
+     * @brief Sub-layer of a shard: feeds the shard with the spacepackets routed to it, and sends
+     *        what the shard transmits to the real sub-layer
+     */
+    class ShardLink : public ICommunicationLayer
+    {
+    public:
+        ShardLink(SpShardedTransferService& front) : front(front) {}
+
+        void deliver(const IBuffer& bytes) {
+            this->pushToUpperLayer(bytes);
+        }
+
+    private:
+        void receiveFromSubLayer(const IBuffer& bytes) override {
+            (void)bytes;
+            //unused, the link has no sub-layer
+        }
+
+        void receiveFromUpperLayer(const IBuffer& bytes) override {
+            front.sendToSubLayer(bytes);
+        }
+
+        void receiveChainFromUpperLayer(const IBufferChain& chain) override {
+            front.sendToSubLayer(chain);
+        }
+
+        SpShardedTransferService& front;
+    };
+
+    /** A received spacepacket waiting in a shard */
+    struct RxItem {
+        uint32_t slot;
+        uint32_t size;
+    };
+
+    struct Shard {
+        Shard(SpShardedTransferService& front, std::size_t queue_depth, std::size_t slot_size,
+              std::size_t nb_listeners_max, std::size_t nb_apids_max, const Allocator& alloc)
+        : service(nb_listeners_max, alloc, nb_apids_max), link(front), rx_queue(queue_depth, ALLOC_SITE_SHARDS, alloc),
+          free_slots(queue_depth, ALLOC_SITE_SHARDS, alloc), allocator(alloc) {
+
+            link.connectUpperLayer(service);
+
+            slots = allocator.allocateBuffer(queue_depth * slot_size, ALLOC_SITE_SHARDS);
+            if(slots.getStart() != nullptr) {
+                for(uint32_t i = 0; i < queue_depth; i++) {
+                    free_slots.tryPush(i);
+                }
+            }
+        }
+
+        ~Shard() {
+            allocator.deallocateBuffer(slots, ALLOC_SITE_SHARDS);
+        }
+
+        SpTransferService<Allocator>    service;
+        ShardLink                       link;
+        /** Slots holding a received spacepacket, in reception order */
+        LockFreeQueue<RxItem, Allocator>   rx_queue;
+        /** Slots free to receive a spacepacket */
+        LockFreeQueue<uint32_t, Allocator> free_slots;
+        UserBuffer                      slots;
+        Allocator                       allocator;
+
+        std::thread                     worker;
+        std::atomic<bool>               sleeping{false};
+        std::mutex                      mutex;
+        std::condition_variable         wake_cond;
+        std::atomic<uint64_t>           nb_dropped{0};
+    };
+
+    enum {
+        /** Amount of empty polls of its queue before a worker goes to sleep */
+        SPIN_LIMIT = 256,
+        /** Longest sleep of a worker (in microseconds), bounds the latency of a missed wake-up */
+        SLEEP_MAX_US = 1000,
+    };
+
+    void receiveFromSubLayer(const IBuffer& bytes) override {
+        this->route(bytes.getStart(), bytes.getSize(), [&bytes](uint8_t* slot) {
+            std::memcpy(slot, bytes.getStart(), bytes.getSize());
+        });
+    }
+
+    void receiveChainFromSubLayer(const IBufferChain& chain) override {
+        // the primary header can be split between segments
+        uint8_t header[SpPrimaryHeader::SIZE];
+        UserBuffer header_buffer(header, sizeof(header));
+        chain.copyTo(header_buffer);
+
+        this->route(header, chain.getSize(), [&chain](uint8_t* slot) {
+            UserBuffer dst(slot, chain.getSize());
+            chain.copyTo(dst);
+        });
+    }
+
+    void receiveFromUpperLayer(const IBuffer& bytes) override {
+        (void)bytes;
+        //unused, Spacepacket layer is an application layer
+    }
+
+    /**
+     * @brief Copy a received spacepacket in a slot of the shard owning its APID, and queue it
+     * 
+     * @param start The first bytes of the spacepacket (at least the primary header)
+     * @param size The size of the spacepacket
+     * @param copy Function copying the spacepacket in a slot (uint8_t*)
+     */
+    template<typename CopyFunc>
+    void route(const uint8_t* start, std::size_t size, CopyFunc&& copy) {
+        if(nb_shards == 0) {
+            return;
+        }
+
+        uint16_t apid_value = (size >= SpPrimaryHeader::SIZE) ? SpPrimaryHeader::peekApid(start) : 0;
+        Shard& shard = shards[shard_of[apid_value]];
+
+        uint32_t slot;
+        if(size < SpPrimaryHeader::SIZE || size > slot_size || !shard.free_slots.tryPop(slot)) {
+            shard.nb_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        copy(shard.slots.getStart() + slot * slot_size);
+
+        // there are as many slots as places in the queue: pushing always succeeds
+        shard.rx_queue.tryPush(RxItem{slot, static_cast<uint32_t>(size)});
+
+        if(shard.sleeping.load()) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.wake_cond.notify_one();
+        }
+    }
+
+    /**
+     * @brief Loop of the worker of a shard: deliver the received spacepackets to the shard
+     */
+    void run(Shard& shard) {
+        std::size_t nb_empty_polls = 0;
+
+        while(!stopping.load(std::memory_order_relaxed)) {
+            RxItem item;
+            if(shard.rx_queue.tryPop(item)) {
+                UserBuffer packet(shard.slots.getStart() + item.slot * slot_size, item.size);
+                shard.link.deliver(packet);
+                shard.free_slots.tryPush(item.slot);
+                nb_empty_polls = 0;
+                continue;
+            }
+
+            if(++nb_empty_polls < SPIN_LIMIT) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // nothing to do for a while: sleep until woken up by the receiving thread
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            shard.sleeping.store(true);
+            if(shard.rx_queue.getSize() == 0 && !stopping.load()) {
+                shard.wake_cond.wait_for(lock, std::chrono::microseconds(SLEEP_MAX_US));
+            }
+            shard.sleeping.store(false);
+            nb_empty_polls = 0;
+        }
+    }
+
+    template<typename BufferType>
+    void sendToSubLayer(const BufferType& buffer) {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        this->pushToSubLayer(buffer);
+    }
+
+    static void pinToCore(std::thread& thread, std::size_t index) {
+#if defined(__linux__)
+        unsigned nb_cores = std::thread::hardware_concurrency();
+        if(nb_cores == 0) {
+            return;
+        }
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % nb_cores, &cpus);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#else
+        (void)thread;
+        (void)index;
+#endif
+    }
+
+    /** The size of a slot */
+    const std::size_t slot_size;
+    /** The shards, placed in allocated memory */
+    UserBuffer shards_buffer;
+    Shard* shards = nullptr;
+    std::size_t nb_shards = 0;
+    /** The shard owning each APID */
+    uint8_t shard_of[SpListenerIndex<Allocator>::NB_APIDS] = {};
+
+    std::atomic<bool> stopping{false};
+    /** Serializes what is sent to the sub-layer */
+    std::mutex tx_mutex;
+};
+
+} //namespace
+
+#endif //CCSDS_SHARDED_TRANSFER_HPP
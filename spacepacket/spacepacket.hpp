@@ -10,12 +10,14 @@
 
 #include "utils/serializable.hpp"
 #include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
 #include "utils/allocator.hpp"
 #include "spacepacket/primaryhdr.hpp"
 #include "spacepacket/secondaryhdr.hpp"
 #include <tuple>
 #include <cstdint>
 #include <climits>
+#include <cstring>
 #include <type_traits>
 
 namespace ccsds
@@ -54,6 +56,20 @@ public:
         return SecHdrType::getSize() > 0;
     }
 
+    /**
+     * @brief Set the primary header fields that follow from the content of the spacepacket: the
+     *        secondary header flag and the packet data length. Nothing is serialized.
+     */
+    void prepareHeader() {
+        if(this->hasSecondaryHdr()) {
+            this->primary_hdr.sec_hdr_flag.set();
+        }
+
+        // [...] field shall contain a length count C that equals [...] the Packet Data Field (pink book, 4.1.2.5.1.2)
+        // Packet Data Field is comprised of the secondary header and the user data
+        this->primary_hdr.length.setLength(SecHdrType::getSize() + this->getUserDataWidth() / CHAR_BIT);
+    }
+
     /**
      * @brief Checks if the spacepacket, in its current form, is valid and can be transmitted on the network.
      * 
@@ -135,12 +151,13 @@ public:
  *          user data field. @see{SpBuilder::data()}
  * 
  * @tparam SecHdrType The secondary header type. Must be a type derived from ISpSecondaryHeader
- * @tparam Allocator The allocator used by the object. Must be a type derived from IAllocator
+ * @tparam Allocator The allocator used by the object, held by value. @see{isAllocator}
+ * @tparam Site The call site reported to the allocator when the buffer is allocated. @see{AllocationSite}
  */
-template<typename SecHdrType, typename Allocator = DefaultAllocator>
-class SpBuilder : public ISpacepacket<SecHdrType>, public Serializable
+template<typename SecHdrType, typename Allocator = DefaultAllocator, AllocationSite Site = ALLOC_SITE_SP_BUILDER>
+class SpBuilder : public ISpacepacket<SecHdrType>, public Serializable, protected AllocatorHolder<Allocator>
 {
-    static_assert(std::is_base_of<IAllocator, Allocator>::value, "The chosen allocator is not valid");
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
 
 public:
     /**
@@ -152,16 +169,16 @@ public:
      * @note Once the buffer has been allocated, no other allocation occur
      */
     SpBuilder(std::size_t total_size, const Allocator& alloc = Allocator())
-    : allocator(alloc) {
+    : AllocatorHolder<Allocator>(alloc) {
         // we allocate for the total size 
-        total_buffer = this->allocator.allocateBuffer(total_size);
+        total_buffer = this->getAllocator().allocateBuffer(total_size, Site);
         //buffer segment where user data will get serialized
         user_data_buffer = UserBuffer(total_buffer.getStart() + SpPrimaryHeader::getSize() + SecHdrType::getSize(),
                                       total_buffer.getSize() - SpPrimaryHeader::getSize() - SecHdrType::getSize());
         user_data.attach(user_data_buffer);
     }
     ~SpBuilder() {
-        this->allocator.deallocateBuffer(total_buffer);
+        this->getAllocator().deallocateBuffer(total_buffer, Site);
     }
 
     void serialize(OBitStream& o) const override {
@@ -204,12 +221,7 @@ public:
         // the beginning
         OBitStream beginning(this->getBuffer());
 
-        if(this->hasSecondaryHdr()) {
-            this->primary_hdr.sec_hdr_flag.set();
-        }
-
-        // Length is comprised of the secondary header and the user data
-        this->primary_hdr.length.setLength(SecHdrType::getSize() + user_data.getSize());
+        this->prepareHeader();
 
         //the first few bytes were skipped to keep space to write both headers
         beginning << this->primary_hdr << this->secondary_hdr;
@@ -226,9 +238,61 @@ public:
         return total_buffer;
     }
 
+    /**
+     * @brief Prepare the builder for a new spacepacket, while keeping the same buffer (no allocation).
+     *        The user data field is emptied, and the primary header fields set by finalize() and by
+     *        the transfer service (secondary header flag, sequence count and length) are cleared. The
+     *        version, type, APID and sequence flags, as well as the secondary header, are kept.
+     * @code
+     *          SpBuilder<MySecHdr> packet(256);
+     *          packet.primary_hdr.apid.setValue(42);
+     *          while(producing) {
+     *              packet.reset();
+     *              packet.data() << next_sample;
+     *              transfer_service.transmit(packet);
+     *          }
+     * @endcode
+     */
+    void reset() {
+        user_data.rewind();
+        this->primary_hdr.sec_hdr_flag.reset();
+        this->primary_hdr.sequence_count.setValue(0);
+        this->primary_hdr.length.setValue(0);
+    }
+
+    /**
+     * @brief Make sure the buffer can hold a spacepacket of a given total size. A new buffer is
+     *        allocated only if the current one is too small, in which case the user data already
+     *        serialized is kept.
+     * 
+     * @param total_size The projected, total size of the spacepacket in bytes, including primary and secondary headers
+     * @return false if the allocation of a bigger buffer failed (the current buffer is then kept), true otherwise
+     */
+    bool reserve(std::size_t total_size) {
+        if(total_size <= total_buffer.getSize()) {
+            return true;
+        }
+
+        UserBuffer new_buffer = this->getAllocator().allocateBuffer(total_size, Site);
+        if(new_buffer.getStart() == nullptr) {
+            return false;
+        }
+
+        //keep what was serialized so far (headers and user data)
+        std::size_t width = user_data.getWidth();
+        std::memcpy(new_buffer.getStart(), total_buffer.getStart(),
+                    SpPrimaryHeader::getSize() + SecHdrType::getSize() + user_data.getSize());
+        this->getAllocator().deallocateBuffer(total_buffer, Site);
+
+        total_buffer = new_buffer;
+        user_data_buffer = UserBuffer(total_buffer.getStart() + SpPrimaryHeader::getSize() + SecHdrType::getSize(),
+                                      total_buffer.getSize() - SpPrimaryHeader::getSize() - SecHdrType::getSize());
+        user_data.attach(user_data_buffer);
+        user_data.skip(width);
+        return true;
+    }
+
 protected:
-    /** Memory allocator */
-    const Allocator& allocator;
     /** Buffer of bytes allocated for the entire spacepacket */
     UserBuffer total_buffer;
     /** Section of the total buffer used for user data */
@@ -243,14 +307,14 @@ protected:
  * 
  * @tparam PatternType The idle data pattern type (uint8_t, uint16_t, etc.)
  * @tparam IdleDataPattern The idle data pattern. Every mission has a different idle data pattern.
- * @tparam Allocator The allocator used by the object. Must be a type derived from IAllocator
+ * @tparam Allocator The allocator used by the object, held by value. @see{isAllocator}
  */
 template<typename PatternType = uint8_t, 
         PatternType IdleDataPattern = 0xFFU, 
         typename Allocator = DefaultAllocator>
-class SpIdleBuilder : public SpBuilder<SpEmptySecondaryHeader, Allocator>
+class SpIdleBuilder : public SpBuilder<SpEmptySecondaryHeader, Allocator, ALLOC_SITE_SP_IDLE_BUILDER>
 {
-    static_assert(std::is_base_of<IAllocator, Allocator>::value, "The chosen allocator is not valid");
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
     static_assert(std::is_unsigned<PatternType>::value, 
                     "Only unsigned Idle packet pattern are supported.");
 
@@ -263,29 +327,166 @@ public:
      * @param alloc The allocator to use for dynamic memory management
      */
     SpIdleBuilder(const std::size_t total_size, const Allocator& alloc = Allocator())
-    : SpBuilder<SpEmptySecondaryHeader, Allocator>(total_size, alloc) {
+    : SpBuilder<SpEmptySecondaryHeader, Allocator, ALLOC_SITE_SP_IDLE_BUILDER>(total_size, alloc) {
         this->primary_hdr.apid.setValue(SpPrimaryHeader::PacketApid::IDLE_VALUE);
+        this->fillIdleData();
+    }
+
+    /**
+     * @brief Prepare the builder for a new idle spacepacket, while keeping the same buffer (no allocation).
+     *        The idle data is written again. @see{SpBuilder::reset()}
+     */
+    void reset() {
+        SpBuilder<SpEmptySecondaryHeader, Allocator, ALLOC_SITE_SP_IDLE_BUILDER>::reset();
+        this->fillIdleData();
+    }
+
+    /**
+     * @brief Fill memory with the idle pattern, repeated. The pattern is written in network (big endian)
+     *        order, and the memory ends with the beginning of the pattern if its size is not a multiple
+     *        of the pattern size.
+     * 
+     * @details The pattern is written once, then the filled part is copied after itself, doubling each
+     *          time: filling n bytes takes log2(n) memcpy calls (a single memset for a byte pattern).
+     * 
+     * @param start The start of the memory
+     * @param size The size of the memory, in bytes
+     */
+    static void fillPattern(uint8_t* start, std::size_t size) {
+        uint8_t pattern[sizeof(PatternType)];
+        bool same_bytes = true;
+        for(std::size_t i = 0; i < sizeof(PatternType); i++) {
+            pattern[i] = static_cast<uint8_t>(IdleDataPattern >> ((sizeof(PatternType) - 1 - i) * CHAR_BIT));
+            same_bytes = same_bytes && (pattern[i] == pattern[0]);
+        }
 
-        if(total_size > SpPrimaryHeader::getSize()) {
+        if(same_bytes) {
+            std::memset(start, pattern[0], size);
+            return;
+        }
+
+        std::size_t filled = (size < sizeof(PatternType)) ? size : sizeof(PatternType);
+        std::memcpy(start, pattern, filled);
+        while(filled < size) {
+            std::size_t nb_bytes = (filled < size - filled) ? filled : size - filled;
+            std::memcpy(start + filled, start, nb_bytes);
+            filled += nb_bytes;
+        }
+    }
+
+protected:
+    /**
+     * @brief Fill all the packet data field bytes with the idle pattern
+     */
+    void fillIdleData() {
+        std::size_t total_size = this->total_buffer.getSize();
+
+        if(this->total_buffer.getStart() != nullptr && total_size > SpPrimaryHeader::getSize()) {
             std::size_t packet_data_field_size = total_size - SpPrimaryHeader::getSize();
 
-            //Fill all the packet data field bytes with the given pattern
-            std::size_t nb_full_pattern = packet_data_field_size / sizeof(PatternType);
-            uint8_t nb_remainder_bytes  = packet_data_field_size % sizeof(PatternType);
-            
-            for(std::size_t i = 0; i < nb_full_pattern ; i++) {
-                this->user_data.put(IdleDataPattern, sizeof(PatternType)*CHAR_BIT);
-            }
-
-            if(nb_remainder_bytes > 0) {
-                // put the beginning of the pattern as the remainder
-                this->user_data.put((IdleDataPattern >> (sizeof(PatternType) - nb_remainder_bytes)*CHAR_BIT), 
-                                    nb_remainder_bytes*CHAR_BIT);
-            }
+            //Fill all the packet data field bytes at once, then account for them in the stream
+            fillPattern(this->user_data_buffer.getStart(), packet_data_field_size);
+            this->user_data.skip(packet_data_field_size * CHAR_BIT);
         }
     }
 };
 
+/**
+ * @brief Spacepacket production class for user data that is already held in buffers. The headers
+ *        are serialized in a small buffer held by the builder, and the user data buffers are chained
+ *        after them without being copied (@see{IBufferChain}). It covers the Packet Assembly Function
+ *        (pink book, 4.2.2).
+ * @code
+ *          SpChainBuilder<MySecHdr> packet;
+ *          packet.primary_hdr.apid.setValue(42);
+ *          packet.append(instrument_payload);              // large buffer, not copied
+ *          transfer_service.transmit(packet);
+ * @endcode
+ * 
+ * @tparam SecHdrType The secondary header type. Must be a type derived from ISpSecondaryHeader
+ * @tparam MaxSegments The maximum amount of user data buffers that can be chained
+ */
+template<typename SecHdrType, std::size_t MaxSegments = 4>
+class SpChainBuilder : public ISpacepacket<SecHdrType>
+{
+    static_assert(MaxSegments > 0, "There must be room for at least one user data buffer");
+
+public:
+    SpChainBuilder()
+    : headers_buffer(header_bytes, sizeof(header_bytes)) {
+        chain.append(headers_buffer);
+    }
+
+    // the chain refers to memory held by this instance
+    SpChainBuilder(const SpChainBuilder& other) = delete;
+    SpChainBuilder& operator=(const SpChainBuilder& other) = delete;
+
+    std::size_t getUserDataWidth() const override {
+        return (chain.getSize() - sizeof(header_bytes)) * CHAR_BIT;
+    }
+
+    /**
+     * @brief Chain a buffer at the end of the user data field. The buffer is not copied and must
+     *        remain valid until the spacepacket is transmitted.
+     * 
+     * @param user_data The buffer to chain
+     * @return false if the maximum amount of buffers is already chained, true otherwise
+     */
+    bool append(const IBuffer& user_data) {
+        return chain.append(user_data);
+    }
+
+    /**
+     * @brief Chain a memory section at the end of the user data field. The memory is not copied
+     *        and must remain valid until the spacepacket is transmitted.
+     * 
+     * @param start The start address of the memory section
+     * @param size The size of the memory section
+     * @return false if the maximum amount of buffers is already chained, true otherwise
+     */
+    bool append(void* start, std::size_t size) {
+        return chain.append(start, size);
+    }
+
+    /**
+     * @brief Remove all the user data buffers from the spacepacket
+     */
+    void clearData() {
+        chain.truncate(1);
+    }
+
+    /**
+     * @brief Finalize the current spacepacket building operation by :
+     *        1. Setting the secondary header flag (in the primary header) if necessary
+     *        2. Setting the length (in the primary header)
+     *        3. Serializing the primary and secondary header in the header buffer
+     */
+    void finalize() {
+        OBitStream beginning(headers_buffer);
+
+        this->prepareHeader();
+
+        beginning << this->primary_hdr << this->secondary_hdr;
+    }
+
+    /**
+     * @brief Get the chain of buffers that represents the whole spacepacket (headers first)
+     * 
+     * @return the chain reference
+     */
+    const IBufferChain& getChain() const {
+        return chain;
+    }
+
+private:
+    /** Memory where both headers are serialized */
+    uint8_t     header_bytes[SpPrimaryHeader::SIZE + SecHdrType::getSize()] = { 0 };
+    /** Buffer over the header memory */
+    UserBuffer  headers_buffer;
+    /** Headers, followed by every user data buffer */
+    BufferChain<MaxSegments + 1> chain;
+};
+
 /**
  * @brief Spacepacket extraction and reading class. This helper is used to read/interpret custom spacepackets
  *        dynamically. It covers the Packet Extraction Function (pink book, 4.3.2). The extractor is guaranteed
@@ -307,14 +508,25 @@ public:
      * @param buffer The buffer binded to this extractor, that will be used to deserialize the data.
      */
     SpExtractor(const IBuffer& buffer)
-    : stream(buffer), buffer(buffer) {
+    : stream(buffer), buffer(&buffer), chain(nullptr), size(buffer.getSize()) {
+        //start by deserializing the two headers
+        stream >> this->primary_hdr >> this->secondary_hdr;
+    }
+
+    /**
+     * @brief Construct a new SpExtractor object from a spacepacket scattered in many buffers
+     * 
+     * @param chain The chain of buffers binded to this extractor, that will be used to deserialize the data.
+     */
+    SpExtractor(const IBufferChain& chain)
+    : stream(chain), buffer(nullptr), chain(&chain), size(chain.getSize()) {
         //start by deserializing the two headers
         stream >> this->primary_hdr >> this->secondary_hdr;
     }
 
     std::size_t getUserDataWidth() const override {
         // spacepacket is alreadyformed, so the user data zone is simply described as the complete buffer minus both headers
-        return (buffer.getSize() - SpPrimaryHeader::getSize() - SecHdrType::getSize()) * CHAR_BIT;
+        return (size - SpPrimaryHeader::getSize() - SecHdrType::getSize()) * CHAR_BIT;
     }
 
     /**
@@ -339,14 +551,34 @@ public:
      * @brief Get the Buffer used to deserialize by this extractor instance
      * 
      * @return the buffer reference
+     * @note Only valid if the extractor was constructed from a buffer. @see{SpExtractor::isScattered()}
      */
     const IBuffer& getBuffer() {
-        return buffer;
+        return *buffer;
+    }
+
+    /**
+     * @brief Get the chain of buffers used to deserialize by this extractor instance
+     * 
+     * @return the chain reference
+     * @note Only valid if the extractor was constructed from a chain of buffers. @see{SpExtractor::isScattered()}
+     */
+    const IBufferChain& getChain() {
+        return *chain;
+    }
+
+    /**
+     * @return true if the extractor was constructed from a chain of buffers, false otherwise
+     */
+    bool isScattered() const {
+        return chain != nullptr;
     }
 
 protected:
     IBitStream stream;
-    const IBuffer& buffer;
+    const IBuffer* buffer;
+    const IBufferChain* chain;
+    std::size_t size;
 };
 
 /**
@@ -435,13 +667,7 @@ public:
      * @brief Finalize the current spacepacket building operation 
      */
     void finalize() {
-        if(this->hasSecondaryHdr()) {
-            this->primary_hdr.sec_hdr_flag.set();
-        }
-
-        // [...] field shall contain a length count C that equals [...] the Packet Data Field (pink book, 4.1.2.5.1.2)
-        // Packet Data Field is comprised of the secondary header and the user data
-        this->primary_hdr.length.setLength(SecHdrType::getSize() + this->getUserDataWidth() / CHAR_BIT);
+        this->prepareHeader();
     }
 
 private:
@@ -0,0 +1,115 @@
+/**************************************************************************//**
+ * @file telemetry.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains the statistics kept by the spacepacket transfer services
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_TELEMETRY_HPP
+#define CCSDS_TELEMETRY_HPP
+
+#include "utils/histogram.hpp"
+#include <atomic>
+#include <cstdint>
+
+namespace ccsds
+{
+
+/**
+ * @brief Snapshot of the counters of a transfer service, or of one of its APIDs.
+ *        @see{SpTransferService::getStats}
+ */
+struct SpTransferStats {
+    /** Spacepackets received from the sub-layer and accepted */
+    uint64_t rx_count = 0;
+    /** Spacepackets transmitted to the sub-layer */
+    uint64_t tx_count = 0;
+    /** Spacepackets received but rejected (too short, or out of sequence) */
+    uint64_t rx_error_count = 0;
+    /** Sequence counts skipped by the spacepackets received, on the APIDs that resynchronize
+        (@see{SpTransferService::setSequenceResync}) */
+    uint64_t rx_lost_count = 0;
+    /** Spacepackets not transmitted because they were invalid */
+    uint64_t tx_error_count = 0;
+    /** Bytes of the spacepackets received and accepted, headers included */
+    uint64_t rx_bytes = 0;
+    /** Bytes of the spacepackets transmitted, headers included */
+    uint64_t tx_bytes = 0;
+};
+
+/**
+ * @brief Histograms of the timing of the traffic in one direction of an APID
+ * 
+ * @details The packet rate is measured over windows of RATE_WINDOW_NS: a window is recorded in the
+ *          rate histogram when the first spacepacket after it arrives, along with the empty windows
+ *          in between. The window in progress is not in the histogram yet.
+ */
+class SpTrafficHistograms
+{
+public:
+    enum : uint64_t {
+        /** Duration (in nanoseconds) of the windows of the packet rate */
+        RATE_WINDOW_NS = 1000000000ULL,
+    };
+
+    /**
+     * @brief Record the arrival of spacepackets
+     * 
+     * @param now The time of arrival, in nanoseconds. @see{MonotonicClock}
+     * @param nb_packets The amount of spacepackets arrived at that time
+     */
+    void record(uint64_t now, uint64_t nb_packets = 1) {
+        uint64_t last = last_ns.exchange(now, std::memory_order_relaxed);
+        if(last != 0) {
+            inter_arrival.record(now > last ? now - last : 0);
+        }
+        if(nb_packets > 1) {
+            inter_arrival.record(0, nb_packets - 1);
+        }
+
+        uint64_t start = window_start_ns.load(std::memory_order_relaxed);
+        if(start == 0) {
+            window_start_ns.compare_exchange_strong(start, now, std::memory_order_relaxed);
+        } else if(now > start && now - start >= RATE_WINDOW_NS) {
+            // only the thread that moves the window records it
+            uint64_t nb_windows = (now - start) / RATE_WINDOW_NS;
+            if(window_start_ns.compare_exchange_strong(start, start + nb_windows * RATE_WINDOW_NS,
+                                                       std::memory_order_relaxed)) {
+                rate.record(window_count.exchange(0, std::memory_order_relaxed));
+                if(nb_windows > 1) {
+                    rate.record(0, nb_windows - 1);
+                }
+            }
+        }
+        window_count.fetch_add(nb_packets, std::memory_order_relaxed);
+    }
+
+    /** Time (in nanoseconds) between two consecutive spacepackets */
+    Log2Histogram inter_arrival;
+    /** Amount of spacepackets per window of RATE_WINDOW_NS */
+    Log2Histogram rate;
+
+private:
+    /** Time of arrival of the last spacepacket, 0 if none */
+    std::atomic<uint64_t> last_ns{0};
+    /** Start of the rate window in progress, 0 if none */
+    std::atomic<uint64_t> window_start_ns{0};
+    /** Spacepackets arrived in the rate window in progress */
+    std::atomic<uint64_t> window_count{0};
+};
+
+/**
+ * @brief Histograms of an APID. @see{SpTransferService::enableHistograms}
+ */
+struct SpApidHistograms {
+    /** Spacepackets received from the sub-layer and accepted */
+    SpTrafficHistograms rx;
+    /** Spacepackets transmitted to the sub-layer */
+    SpTrafficHistograms tx;
+    /** Time (in nanoseconds) taken by the listeners of the APID to handle a spacepacket */
+    Log2Histogram       dispatch_latency;
+};
+
+} //namespace
+
+#endif //CCSDS_TELEMETRY_HPP
@@ -0,0 +1,465 @@
+/**************************************************************************//**
+ * @file traffic.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a sub-layer generating synthetic spacepacket traffic, and a
+ *        listener measuring its latency
+ * 
+ ******************************************************************************/
+#ifndef CCSDS_TRAFFIC_HPP
+#define CCSDS_TRAFFIC_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "utils/clock.hpp"
+#include "utils/commlayer.hpp"
+#include "utils/histogram.hpp"
+#include "utils/obitstream.hpp"
+#include "utils/span.hpp"
+#include "utils/tokenbucket.hpp"
+#include "spacepacket/listener.hpp"
+#include "spacepacket/primaryhdr.hpp"
+#include "spacepacket/spacepacket.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+namespace ccsds
+{
+
+/**
+ * @brief Settings of a traffic generator. @see{SpTrafficGenerator}
+ */
+struct SpTrafficConfig {
+    /** Seed of the random generator: the same seed and settings give the same traffic */
+    uint64_t    seed = 1;
+    /** Spacepackets generated per second, 0 for as fast as possible */
+    uint64_t    packets_per_second = 0;
+    /** Probability that a spacepacket is lost (never sent, its sequence count is skipped) */
+    double      loss_rate = 0.0;
+    /** Probability that a spacepacket is sent twice in a row */
+    double      duplicate_rate = 0.0;
+    /** Probability that a spacepacket is held back, and sent after the next ones */
+    double      reorder_rate = 0.0;
+    /** Amount of spacepackets sent before a held back one */
+    std::size_t reorder_distance = 1;
+};
+
+/**
+ * @brief Metrics of a run of a traffic generator
+ */
+struct SpTrafficStats {
+    /** Spacepackets generated, lost ones included */
+    uint64_t nb_generated = 0;
+    /** Spacepackets given to the upper layer, duplicates included */
+    uint64_t nb_sent = 0;
+    /** Bytes of spacepackets given to the upper layer */
+    uint64_t nb_bytes = 0;
+    /** Spacepackets lost on purpose */
+    uint64_t nb_lost = 0;
+    /** Spacepackets sent twice on purpose */
+    uint64_t nb_duplicated = 0;
+    /** Spacepackets sent out of order on purpose */
+    uint64_t nb_reordered = 0;
+    /** Time taken by the run, in nanoseconds */
+    uint64_t duration = 0;
+};
+
+/**
+ * @brief Sub-layer that generates spacepackets as if they were received: a weighted mix of APIDs,
+ *        each with its own range of sizes, at a given rate, with losses, duplicates and reordering
+ *        injected at random. Spacepackets transmitted by the upper layer go on to the sub-layer, if any.
+ * @code
+ *          SpTrafficConfig config;
+ *          config.seed = 42;
+ *          config.loss_rate = 0.001;
+ *          SpTrafficGenerator<> generator(config);
+ *          generator.addApid(100, 9, 64, 256);                  // 90% of small housekeeping
+ *          generator.addApid(200, 1, 1024, 4096);               // 10% of science data
+ *          generator.connectUpperLayer(service);
+ *          service.setSequenceResync(true);                    // accept the losses injected
+ *          SpLatencyProbe<> probe;
+ *          service.registerListener(&probe);
+ *          SpTrafficStats stats = generator.generate(1000000);
+ * @endcode
+ * 
+ * @details Every APID has its own sequence counts, so the upper layer sees consistent streams, with
+ *          gaps where spacepackets are lost. A SpTransferService accepts them past the first gap only if
+ *          it resynchronizes (@see{SpTransferService::setSequenceResync}): the losses are then counted in
+ *          its statistics, and the late spacepackets (held back, or sent twice) are rejected, unless the
+ *          APIDs also have a reorder window. The random generator is a splitmix64 sequence seeded
+ *          from the settings, so a run can be reproduced on any platform. The spacepackets are built
+ *          in slots allocated once, whose data is filled with random bytes when constructed: only the
+ *          primary header and a timestamp (@see{SpLatencyProbe}) are written per spacepacket. They are
+ *          given to the upper layer in batches of up to BATCH_SIZE (receiveBatchFromSubLayer), and the
+ *          clock is read once per batch. A run happens in the calling thread, and can be stopped from
+ *          another one.
+ * 
+ * @tparam Allocator The allocator used for the slots. @see{isAllocator}
+ * @tparam Clock The clock used for the rate and the timestamps. @see{MonotonicClock}
+ */
+template<typename Allocator = DefaultAllocator, typename Clock = MonotonicClock>
+class SpTrafficGenerator : public ICommunicationLayer, private AllocatorHolder<Allocator>
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+public:
+    enum {
+        /** Maximum amount of APIDs in the mix */
+        MAX_APIDS = 32,
+        /** Maximum amount of spacepackets given to the upper layer at once */
+        BATCH_SIZE = 32,
+        /** Where the generation time is written in a spacepacket (right after the primary header) */
+        TIMESTAMP_OFFSET = SpPrimaryHeader::SIZE,
+        /** Smallest spacepacket holding the generation time */
+        TIMESTAMPED_SIZE = TIMESTAMP_OFFSET + sizeof(uint64_t),
+    };
+
+    /**
+     * @brief Construct a new SpTrafficGenerator object, without any APID
+     * 
+     * @param config The settings of the traffic
+     * @param max_packet_size The maximum size (in bytes) of a generated spacepacket
+     * @param alloc The allocator to use for the slots
+     */
+    explicit SpTrafficGenerator(const SpTrafficConfig& config = SpTrafficConfig(), std::size_t max_packet_size = 4096,
+                                const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), config(config), random_state(config.seed) {
+        if(max_packet_size < SPACEPACKET_MIN_SIZE) {
+            max_packet_size = SPACEPACKET_MIN_SIZE;
+        } else if(max_packet_size > SPACEPACKET_MAX_SIZE) {
+            max_packet_size = SPACEPACKET_MAX_SIZE;
+        }
+
+        // one slot per position in a batch, followed by the slot of the held back spacepacket
+        memory = this->getAllocator().allocateBuffer((BATCH_SIZE + 1) * max_packet_size, ALLOC_SITE_TRAFFIC);
+        if(memory.getStart() == nullptr) {
+            return;
+        }
+        for(std::size_t i = 0; i < memory.getSize(); i++) {
+            memory.getStart()[i] = static_cast<uint8_t>(this->nextRandom());
+        }
+
+        slot_size = max_packet_size;
+        loss_threshold = getThreshold(config.loss_rate);
+        duplicate_threshold = getThreshold(config.duplicate_rate);
+        reorder_threshold = getThreshold(config.reorder_rate);
+        if(config.packets_per_second > 0) {
+            bucket.configure(config.packets_per_second, BATCH_SIZE, Clock::now());
+        }
+    }
+
+    SpTrafficGenerator(const SpTrafficGenerator& other) = delete;
+    SpTrafficGenerator& operator=(const SpTrafficGenerator& other) = delete;
+
+    ~SpTrafficGenerator() {
+        this->getAllocator().deallocateBuffer(memory, ALLOC_SITE_TRAFFIC);
+    }
+
+    /**
+     * @return false if the slots could not be allocated, true otherwise
+     */
+    bool isValid() const {
+        return slot_size > 0;
+    }
+
+    /**
+     * @brief Add an APID to the mix
+     * 
+     * @param apid_value The APID
+     * @param weight The share of the APID in the traffic, relative to the other APIDs
+     * @param min_size The minimum total size (in bytes) of its spacepackets, primary header included
+     * @param max_size The maximum total size of its spacepackets, at most the maximum size of the generator.
+     *                 The sizes are drawn uniformly in between.
+     * @return false if the mix is full or the sizes are not valid, true otherwise
+     */
+    bool addApid(uint16_t apid_value, uint32_t weight, std::size_t min_size, std::size_t max_size) {
+        if(nb_apids >= MAX_APIDS || weight == 0 || min_size < SPACEPACKET_MIN_SIZE
+        || min_size > max_size || max_size > slot_size) {
+            return false;
+        }
+
+        ApidTraffic& traffic = apids[nb_apids++];
+        traffic.apid = SpPrimaryHeader::PacketApid(apid_value).getValue();
+        traffic.min_size = min_size;
+        traffic.max_size = max_size;
+        total_weight += weight;
+        traffic.cumulated_weight = total_weight;
+        return true;
+    }
+
+    /**
+     * @brief Generate spacepackets, and give them to the upper layer
+     * 
+     * @param nb_packets The amount of spacepackets to generate, lost ones included
+     * @return The metrics of the run
+     */
+    SpTrafficStats generate(uint64_t nb_packets) {
+        SpTrafficStats stats;
+        stopped.store(false, std::memory_order_relaxed);
+        if(!this->isValid() || nb_apids == 0) {
+            return stats;
+        }
+
+        uint64_t start = Clock::now();
+        UserBuffer batch[BATCH_SIZE];
+
+        while(stats.nb_generated < nb_packets && !stopped.load(std::memory_order_relaxed)) {
+            uint64_t now = Clock::now();
+            if(!bucket.canConsume(1, now)) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(bucket.getDelay(1, now)));
+                continue;
+            }
+
+            // a spacepacket may take up to 3 positions: itself, its duplicate and a released one
+            std::size_t nb_batched = 0;
+            while(stats.nb_generated < nb_packets && nb_batched + 3 <= BATCH_SIZE && bucket.tryConsume(1, now)) {
+                nb_batched = this->generateOne(batch, nb_batched, now, stats);
+            }
+            this->send(batch, nb_batched, stats);
+        }
+
+        // the spacepacket still held back, if any, goes last
+        if(held_size > 0) {
+            batch[0] = UserBuffer(this->getSlot(BATCH_SIZE), held_size);
+            held_size = 0;
+            this->send(batch, 1, stats);
+        }
+
+        stats.duration = Clock::now() - start;
+        return stats;
+    }
+
+    /**
+     * @brief Stop the run happening in another thread, after its current batch
+     */
+    void stop() {
+        stopped.store(true, std::memory_order_relaxed);
+    }
+
+private:
+    struct ApidTraffic {
+        uint16_t    apid = 0;
+        uint16_t    next_count = 0;
+        std::size_t min_size = 0;
+        std::size_t max_size = 0;
+        /** Sum of the weights of this APID and of the ones before it */
+        uint64_t    cumulated_weight = 0;
+    };
+
+    /**
+     * @brief Generate a spacepacket, and put it in the batch unless it is lost or held back
+     * 
+     * @return The new amount of spacepackets in the batch
+     */
+    std::size_t generateOne(UserBuffer* batch, std::size_t nb_batched, uint64_t now, SpTrafficStats& stats) {
+        stats.nb_generated++;
+        ApidTraffic& traffic = this->pickApid();
+        uint16_t count = traffic.next_count;
+        traffic.next_count = (traffic.next_count + 1) & ((1U << SpPrimaryHeader::SEQUENCE_COUNT_WIDTH) - 1);
+        std::size_t size = traffic.min_size + this->nextRandom() % (traffic.max_size - traffic.min_size + 1);
+
+        if(this->nextRandom32() < loss_threshold) {
+            stats.nb_lost++;
+            return nb_batched;
+        }
+
+        uint8_t* packet = this->getSlot(nb_batched);
+        SpPrimaryHeader primary_hdr;
+        primary_hdr.apid.setValue(traffic.apid);
+        primary_hdr.sequence_count.setValue(count);
+        primary_hdr.length.setLength(static_cast<uint16_t>(size - SpPrimaryHeader::SIZE));
+        UserBuffer header_buffer(packet, SpPrimaryHeader::SIZE);
+        OBitStream header(header_buffer);
+        header << primary_hdr;
+        if(size >= TIMESTAMPED_SIZE) {
+            std::memcpy(packet + TIMESTAMP_OFFSET, &now, sizeof(now));
+        }
+
+        bool release = held_size > 0 && --held_remaining == 0;
+        if(held_size == 0 && this->nextRandom32() < reorder_threshold) {
+            std::memcpy(this->getSlot(BATCH_SIZE), packet, size);
+            held_size = size;
+            held_remaining = (config.reorder_distance > 0) ? config.reorder_distance : 1;
+            stats.nb_reordered++;
+            return nb_batched;
+        }
+
+        batch[nb_batched++] = UserBuffer(packet, size);
+        if(this->nextRandom32() < duplicate_threshold) {
+            batch[nb_batched++] = UserBuffer(packet, size);
+            stats.nb_duplicated++;
+        }
+
+        if(release) {
+            uint8_t* released = this->getSlot(nb_batched);
+            std::memcpy(released, this->getSlot(BATCH_SIZE), held_size);
+            batch[nb_batched++] = UserBuffer(released, held_size);
+            held_size = 0;
+        }
+        return nb_batched;
+    }
+
+    void send(UserBuffer* batch, std::size_t nb_batched, SpTrafficStats& stats) {
+        if(nb_batched == 1) {
+            this->pushToUpperLayer(batch[0]);
+        } else if(nb_batched > 1) {
+            this->pushBatchToUpperLayer(Span<const UserBuffer>(batch, nb_batched));
+        }
+
+        stats.nb_sent += nb_batched;
+        for(std::size_t i = 0; i < nb_batched; i++) {
+            stats.nb_bytes += batch[i].getSize();
+        }
+    }
+
+    ApidTraffic& pickApid() {
+        uint64_t drawn = this->nextRandom() % total_weight;
+        std::size_t i = 0;
+        while(apids[i].cumulated_weight <= drawn) {
+            i++;
+        }
+        return apids[i];
+    }
+
+    uint8_t* getSlot(std::size_t index) {
+        return memory.getStart() + index * slot_size;
+    }
+
+    /**
+     * @brief Next number of the splitmix64 sequence
+     */
+    uint64_t nextRandom() {
+        uint64_t z = (random_state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t nextRandom32() {
+        return this->nextRandom() >> 32;
+    }
+
+    /**
+     * @return The threshold under which a 32 bits random number happens with a probability
+     */
+    static uint64_t getThreshold(double probability) {
+        if(probability <= 0.0) {
+            return 0;
+        }
+        if(probability >= 1.0) {
+            return uint64_t(1) << 32;
+        }
+        return static_cast<uint64_t>(probability * 4294967296.0);
+    }
+
+    void receiveFromUpperLayer(const IBuffer& bytes) override {
+        this->pushToSubLayer(bytes);
+    }
+
+    void receiveChainFromUpperLayer(const IBufferChain& chain) override {
+        this->pushToSubLayer(chain);
+    }
+
+    void receiveFromSubLayer(const IBuffer& bytes) override {
+        this->pushToUpperLayer(bytes);
+    }
+
+    const SpTrafficConfig   config;
+    ApidTraffic             apids[MAX_APIDS];
+    std::size_t             nb_apids = 0;
+    uint64_t                total_weight = 0;
+
+    /** The slots of the spacepackets, allocated once */
+    UserBuffer              memory;
+    /** The size of a slot, 0 if they could not be allocated */
+    std::size_t             slot_size = 0;
+    /** The size of the spacepacket held back, 0 if none */
+    std::size_t             held_size = 0;
+    /** Amount of spacepackets still to send before the held back one */
+    std::size_t             held_remaining = 0;
+
+    uint64_t                random_state;
+    uint64_t                loss_threshold = 0;
+    uint64_t                duplicate_threshold = 0;
+    uint64_t                reorder_threshold = 0;
+    /** Paces the generation, unlimited if no rate is set */
+    TokenBucket             bucket;
+    std::atomic<bool>       stopped{false};
+};
+
+/**
+ * @brief Listener measuring the traffic of a generator (@see{SpTrafficGenerator}) once through the
+ *        stack: the amount of spacepackets and bytes received, and the latency of each, from its
+ *        generation to its notification. The latency is read from the timestamp written by the
+ *        generator, so only spacepackets from a generator of the same process should reach the probe.
+ * 
+ * @tparam Clock The clock of the generator. @see{MonotonicClock}
+ */
+template<typename Clock = MonotonicClock>
+class SpLatencyProbe : public SpListener
+{
+public:
+    void newSpacepacket(const IBuffer& bytes) override {
+        this->measure(bytes, Clock::now());
+    }
+
+    void newSpacepackets(Span<const UserBuffer> batch) override {
+        uint64_t now = Clock::now();
+        for(const UserBuffer& bytes : batch) {
+            this->measure(bytes, now);
+        }
+    }
+
+    /**
+     * @return The amount of spacepackets received
+     */
+    uint64_t getNbPackets() const {
+        return nb_packets.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return The amount of bytes received
+     */
+    uint64_t getNbBytes() const {
+        return nb_bytes.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return The latencies of the spacepackets holding a timestamp, in nanoseconds
+     */
+    const Log2Histogram& getLatencies() const {
+        return latencies;
+    }
+
+    /**
+     * @brief Set every counter to 0
+     */
+    void reset() {
+        nb_packets.store(0, std::memory_order_relaxed);
+        nb_bytes.store(0, std::memory_order_relaxed);
+        latencies.reset();
+    }
+
+private:
+    void measure(const IBuffer& bytes, uint64_t now) {
+        nb_packets.fetch_add(1, std::memory_order_relaxed);
+        nb_bytes.fetch_add(bytes.getSize(), std::memory_order_relaxed);
+
+        using Generator = SpTrafficGenerator<>;
+        if(bytes.getSize() >= Generator::TIMESTAMPED_SIZE) {
+            uint64_t generated;
+            std::memcpy(&generated, bytes.getStart() + Generator::TIMESTAMP_OFFSET, sizeof(generated));
+            latencies.record(now >= generated ? now - generated : 0);
+        }
+    }
+
+    std::atomic<uint64_t>   nb_packets{0};
+    std::atomic<uint64_t>   nb_bytes{0};
+    Log2Histogram           latencies;
+};
+
+} //namespace
+
+#endif //CCSDS_TRAFFIC_HPP
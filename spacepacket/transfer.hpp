@@ -9,152 +9,538 @@
 #define PACKETTRANSFERSERVICE_HPP
 
 #include "utils/allocator.hpp"
+#include "utils/clock.hpp"
 #include "utils/commlayer.hpp"
 #include "spacepacket/primaryhdr.hpp"
 #include "spacepacket/spacepacket.hpp"
 #include "spacepacket/listener.hpp"
+#include "spacepacket/listenerindex.hpp"
+#include "spacepacket/apidset.hpp"
+#include "spacepacket/reorder.hpp"
+#include "spacepacket/duplicate.hpp"
+#include "spacepacket/telemetry.hpp"
+#include <atomic>
+#include <new>
 
 namespace ccsds
 {
 
 /**
  * Service of spacepacket transfer
+ * 
+ * @details transmit() and the reception from the sub-layer can be called concurrently from many
+ *          threads. The sequence counts transmitted and the ones expected from the sub-layer are kept
+ *          apart, so a service can receive its own spacepackets (e.g through a loopback). The sequence
+ *          count of each APID is reserved atomically and the telemetry
+ *          counters are relaxed atomics, so producers of different APIDs don't contend. The
+ *          listeners can be (un)registered at any time, even while spacepackets are transmitted or
+ *          received (@see{synchronizeListeners} before destroying a removed listener). The sub-layer
+ *          must accept concurrent calls if producers are concurrent.
+ *          The statistics (@see{getStats}, @see{getApidStats}, @see{getHistograms}) can be read from
+ *          a monitoring thread while the traffic flows, without taking a lock.
+ *          A spacepacket received reads the reception state of its APID (sequence count, flags, reorder
+ *          window and duplicate filter) from a single cache line, then updates the statistics of the APID;
+ *          a batch (@see{receiveBatchFromSubLayer}) updates them once per APID of the batch.
+ * 
+ * @tparam Allocator The allocator used by the service, held by value. @see{isAllocator}
  */
 template<typename Allocator = DefaultAllocator>
-class SpTransferService : public ICommunicationLayer
+class SpTransferService : public ICommunicationLayer, private AllocatorHolder<Allocator>
 {
-    static_assert(std::is_base_of<IAllocator, Allocator>::value, "The chosen allocator is not valid");
-
-    /**
-     * Predicate for matching spacepackets
-     */
-    class ListenerPredicate {
-    public:
-        ListenerPredicate() = default;
-        ListenerPredicate(SpPrimaryHeader::PacketApid apid, bool matchAll = false)
-        : apid(apid), matchAll(matchAll) {
-
-        }
-
-        bool operator()(SpPrimaryHeader::PacketApid other_apid) {
-            return matchAll || apid.getValue() == other_apid.getValue();
-        }
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
 
-        bool matchesAll() {
-            return matchAll;
-        }
-
-    private:
-        SpPrimaryHeader::PacketApid apid;
-        bool matchAll;
+    enum {
+        /** Amount of spacepackets of a batch handled at once */
+        BATCH_CHUNK_SIZE = 64,
+        /** How many spacepackets ahead the headers are prefetched */
+        BATCH_PREFETCH_DISTANCE = 4,
+        /** Amount of possible APIDs (including idle) */
+        NB_APIDS = SpPrimaryHeader::PacketApid::IDLE_VALUE + 1,
+        CACHE_LINE_SIZE = 64,
+        /** Index of an APID that has no statistics yet (sparse storage) */
+        NO_STATS = UINT16_MAX,
+        /** The APID resynchronizes on the sequence counts it receives (@see{setSequenceResync}) */
+        RX_RESYNC = 1,
+        /** A spacepacket of the APID was received */
+        RX_STARTED = 2,
+        /** Amount of possible sequence counts */
+        COUNT_RANGE = 1U << SpPrimaryHeader::SEQUENCE_COUNT_WIDTH,
+        /** Amount of sequence counts behind the sequence in a row after which an APID that
+            resynchronizes follows them (its source restarted) */
+        BEHIND_RUN_RESYNC = 32,
     };
 
-    struct ListenerEntry {
-        SpListener* listener;
-        ListenerPredicate matcher;
+    /** Statistics of an APID, alone on their cache line (@see{allocateApidStats}) */
+    struct ApidStats {
+        std::atomic<uint64_t> rx_count{0};
+        std::atomic<uint64_t> tx_count{0};
+        std::atomic<uint64_t> rx_error_count{0};
+        std::atomic<uint64_t> tx_error_count{0};
+        std::atomic<uint64_t> rx_bytes{0};
+        std::atomic<uint64_t> tx_bytes{0};
+        std::atomic<uint64_t> rx_lost_count{0};
+        /** The histograms of the APID, nullptr until enabled */
+        std::atomic<SpApidHistograms*> histograms{nullptr};
     };
+    static_assert(sizeof(ApidStats) == CACHE_LINE_SIZE, "The statistics of an APID must fill a cache line");
 
-    struct ApidContext {
-        std::size_t rx_count = 0;
-        std::size_t tx_count = 0;
-        SpPrimaryHeader::SequenceCount next_count; //count is 0 by default
+    /** What every spacepacket received reads and updates in the state of its APID, packed in half a
+        cache line so that it only touches one line besides the statistics */
+    struct alignas(CACHE_LINE_SIZE / 2) ApidRxState {
+        /** Next sequence count expected from the sub-layer, only the lowest bits are used */
+        std::atomic<uint16_t> next_count{0};
+        /** RX_RESYNC, RX_STARTED */
+        std::atomic<uint8_t>  flags{0};
+        /** Amount of sequence counts behind the sequence rejected in a row */
+        std::atomic<uint8_t>  nb_behind{0};
+        /** The reorder window of the APID, nullptr if it has none */
+        SpReorderWindow<Allocator>*   reorder_window = nullptr;
+        /** The duplicate filter of the APID, nullptr if it has none */
+        SpDuplicateFilter<Allocator>* duplicate_filter = nullptr;
     };
+    static_assert(sizeof(ApidRxState) == CACHE_LINE_SIZE / 2, "The reception state of an APID must not cross a cache line");
 
     struct Telemetry {
-        std::size_t rx_count = 0;
-        std::size_t tx_count = 0;
-        std::size_t rx_error_count = 0;
-        std::size_t tx_error_count = 0;
+        std::atomic<std::size_t> rx_count{0};
+        std::atomic<std::size_t> tx_count{0};
+        std::atomic<std::size_t> rx_error_count{0};
+        std::atomic<std::size_t> tx_error_count{0};
+        std::atomic<uint64_t> rx_lost_count{0};
+        std::atomic<uint64_t> rx_bytes{0};
+        std::atomic<uint64_t> tx_bytes{0};
     };
 
 public:
-    SpTransferService(std::size_t nb_listeners_max = 1000, const Allocator& alloc = Allocator())
-    : nb_listeners_max(nb_listeners_max), nb_listeners(0), allocator(alloc) {
-
-        listener_buffer = this->allocator.allocateBuffer(nb_listeners_max * sizeof(ListenerEntry));
-        listener_entries = reinterpret_cast<ListenerEntry*>(listener_buffer.getStart());
+    /**
+     * @brief Construct a new SpTransferService object
+     * 
+     * @param nb_listeners_max The maximum amount of listener registrations
+     * @param alloc The allocator to use
+     * @param nb_sparse_apids 0 to keep statistics for every APID (128 KiB), or the amount of APIDs that
+     *                        get their own statistics, in order of first use; the APIDs after them share
+     *                        one set of statistics. For services that carry only a few APIDs, so that
+     *                        the statistics they touch stay in cache.
+     */
+    SpTransferService(std::size_t nb_listeners_max = 1000, const Allocator& alloc = Allocator(),
+                      std::size_t nb_sparse_apids = 0)
+    : AllocatorHolder<Allocator>(alloc), listeners(nb_listeners_max, alloc) {
+        this->allocateApidStats(nb_sparse_apids);
     }
 
     ~SpTransferService() {
-        this->allocator.deallocateBuffer(listener_buffer);
-    }
+        for(uint16_t apid_value = 0; apid_value < SpListenerIndex<Allocator>::NB_APIDS; apid_value++) {
+            this->setReorderWindow(apid_value, 0);
+            this->setDuplicateFilter(apid_value, 0);
+        }
 
-    template<typename SecHdr, typename A>
-    void transmit(SpBuilder<SecHdr, A>& sp) {
-        //set the sequence count depending on the context of the sender's APID
-        uint16_t apid_value = sp.primary_hdr.apid.getValue();
-        sp.primary_hdr.sequence_count = this->contexes[apid_value].next_count;
-        sp.finalize();
+        for(std::size_t i = 0; i < nb_apid_stats; i++) {
+            this->freeHistograms(apid_stats[i]);
+            apid_stats[i].~ApidStats();
+        }
+        this->freeHistograms(shared_stats);
+        this->getAllocator().deallocateBuffer(stats_memory, ALLOC_SITE_TELEMETRY);
+    }
 
+    template<typename SecHdr, typename A, AllocationSite S>
+    void transmit(SpBuilder<SecHdr, A, S>& sp) {
         // only send valid packets
-        if(sp.isValid()) {
-            this->transmitValidBuffer(apid_value, sp.getBuffer(), false);
-            this->telemetry.tx_count++;
-        } else {
-            this->telemetry.tx_error_count++;
+        if(this->stampSequenceCount(sp)) {
+            // the buffer of the builder can be larger than the spacepacket it holds
+            UserBuffer packet(sp.getBuffer().getStart(), sp.getSize());
+            this->transmitValidBuffer(sp.primary_hdr.apid.getValue(), packet, false);
         }
     }
 
     template<typename ...T>
     void transmit(SpDissector<T...>& sp) {
-
-        //set the sequence count depending on the context of the sender's APID
-        uint16_t apid_value = sp.primary_hdr.apid.getValue();
-        sp.primary_hdr.sequence_count = this->contexes[apid_value].next_count;
-        sp.finalize();
-
         // only send valid packets
-        if(sp.isValid()) {
+        if(this->stampSequenceCount(sp)) {
             //serialize to buffer and transmit
-            UserBuffer buffer = this->allocator.allocateBuffer(sp.getSize());
+            UserBuffer buffer = this->getAllocator().allocateBuffer(sp.getSize(), ALLOC_SITE_TRANSFER_PACKET);
             sp.toBuffer(buffer);
-            this->transmitValidBuffer(apid_value, buffer, false);
+            this->transmitValidBuffer(sp.primary_hdr.apid.getValue(), buffer, false);
 
             //cleanup
-            this->allocator.deallocateBuffer(buffer);
-            this->telemetry.tx_count++;
-        } else {
-            this->telemetry.tx_error_count++;
+            this->getAllocator().deallocateBuffer(buffer, ALLOC_SITE_TRANSFER_PACKET);
         }
     }
 
-    void registerListener(SpListener* listener) {
-        if(listener == nullptr || nb_listeners >= nb_listeners_max) {
-            return;
+    /**
+     * @brief Transmit a spacepacket whose user data is scattered in many buffers. The user data
+     *        is not copied : the sub-layer receives the chain of buffers as is.
+     * 
+     * @param sp The spacepacket to transmit
+     */
+    template<typename SecHdr, std::size_t N>
+    void transmit(SpChainBuilder<SecHdr, N>& sp) {
+        // only send valid packets
+        if(this->stampSequenceCount(sp)) {
+            this->transmitValidBuffer(sp.primary_hdr.apid.getValue(), sp.getChain(), false);
         }
+    }
+
+    /**
+     * @brief Reserve consecutive sequence counts of an APID, for spacepackets that must follow each
+     *        other whatever the other producers of the APID do (e.g the segments of user data,
+     *        @see{SpSegmenter}). The spacepackets are then given to transmitReserved().
+     * 
+     * @param apid_value The APID
+     * @param nb_counts The amount of sequence counts to reserve
+     * @return The first sequence count reserved
+     */
+    uint16_t reserveSequenceCounts(uint16_t apid_value, std::size_t nb_counts) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        // the counter wraps on a multiple of the sequence count range: any amount keeps counts consecutive
+        SpPrimaryHeader::SequenceCount first;
+        first.setValue(this->next_counts[apid.getValue()].fetch_add(static_cast<uint16_t>(nb_counts),
+                                                                    std::memory_order_relaxed));
+        return first.getValue();
+    }
 
-        SpPrimaryHeader::PacketApid any;
+    /**
+     * @brief Transmit a spacepacket whose sequence count was set from reserveSequenceCounts(). The user
+     *        data is not copied : the sub-layer receives the chain of buffers as is.
+     * 
+     * @param sp The spacepacket to transmit
+     * @return false if the spacepacket is invalid (it is not transmitted), true otherwise
+     */
+    template<typename SecHdr, std::size_t N>
+    bool transmitReserved(SpChainBuilder<SecHdr, N>& sp) {
+        sp.finalize();
+        if(!sp.isValid()) {
+            this->countTxError(sp.primary_hdr.apid.getValue());
+            return false;
+        }
 
-        // add in watchers
-        listener_entries[nb_listeners].listener = listener;
-        new (&listener_entries[nb_listeners].matcher) ListenerPredicate(any, true);
-        nb_listeners++;
+        this->transmitValidBuffer(sp.primary_hdr.apid.getValue(), sp.getChain(), false);
+        return true;
     }
 
-    void registerListener(SpListener* listener, uint16_t apid_value) {
-        if(listener == nullptr || nb_listeners >= nb_listeners_max) {
-            return;
+    /**
+     * @brief Transmit a spacepacket already encoded in a buffer (e.g an idle packet from @see{SpIdleCache}).
+     *        Only its sequence count is written, in place: the same buffer can be transmitted again
+     *        and again without being rebuilt, but not from many threads at once.
+     * 
+     * @param packet The encoded spacepacket, whose length field matches its size
+     * @return false if the spacepacket is invalid (it is not transmitted), true otherwise
+     */
+    bool transmitPrebuilt(IBuffer& packet) {
+        if(packet.getStart() == nullptr || packet.getSize() < SpPrimaryHeader::SIZE) {
+            return false;
+        }
+
+        uint8_t* bytes = packet.getStart();
+        uint16_t apid_value = SpPrimaryHeader::peekApid(bytes);
+        if(packet.getSize() != SpPrimaryHeader::SIZE + SpPrimaryHeader::peekLength(bytes)) {
+            this->countTxError(apid_value);
+            return false;
         }
 
-        SpPrimaryHeader::PacketApid match(apid_value);
+        SpPrimaryHeader::patchSequenceCount(bytes, this->next_counts[apid_value].fetch_add(1, std::memory_order_relaxed));
+        this->transmitValidBuffer(apid_value, packet, false);
+        return true;
+    }
+
+    /**
+     * @brief Register a listener of every spacepacket in the layer
+     * 
+     * @param listener The listener
+     */
+    void registerListener(SpListener* listener) {
+        this->listeners.addWildcard(listener);
+    }
+
+    /**
+     * @brief Register a listener of the spacepackets of a single APID
+     * 
+     * @param listener The listener
+     * @param apid_value The APID of the spacepackets to listen to
+     */
+    void registerListener(SpListener* listener, uint16_t apid_value) {
+        this->listeners.addApid(listener, SpPrimaryHeader::PacketApid(apid_value));
+    }
 
-        // add in watchers
-        listener_entries[nb_listeners].listener = listener;
-        new (&listener_entries[nb_listeners].matcher) ListenerPredicate(match);
-        nb_listeners++;
+    /**
+     * @brief Register a listener of the spacepackets of a set of APIDs (e.g ranges or masks of APIDs)
+     * 
+     * @param listener The listener
+     * @param apids The APIDs of the spacepackets to listen to
+     */
+    void registerListener(SpListener* listener, const ApidSet& apids) {
+        this->listeners.addSet(listener, apids);
     }
 
+    /**
+     * @brief Remove the oldest registration of a listener. Listeners can be registered and removed
+     *        at any time, from any thread (even from a listener), without pausing the reception.
+     *        A spacepacket being dispatched on another thread may still reach the removed listener:
+     *        @see{synchronizeListeners} before destroying it.
+     * 
+     * @param listener The listener
+     */
     void unregisterListener(SpListener* listener) {
-        for(uint32_t i = 0; i < nb_listeners; i++) {
-            if(listener_entries[i].listener == listener) {
-                //switch to the listener at the end
-                listener_entries[i] = listener_entries[nb_listeners - 1];
-                nb_listeners--;
-                break;
+        this->listeners.remove(listener);
+    }
+
+    /**
+     * @brief Wait until the spacepackets being dispatched to the listeners are done, so that the
+     *        listeners removed before the call are no longer notified. Must not be called from a listener.
+     */
+    void synchronizeListeners() {
+        this->listeners.synchronize();
+    }
+    
+    /**
+     * @brief Accept the spacepackets of an APID received out of sequence, within a window of
+     *        sequence counts, and deliver them in order (@see{SpReorderWindow}). Without a window,
+     *        a received spacepacket is only accepted if it has exactly the next sequence count of
+     *        its APID. Must be called before the traffic of the APID starts. The window of an APID
+     *        that resynchronizes (@see{setSequenceResync}) follows its source. @see{SpReorderWindow::setResync}
+     * 
+     * @param apid_value The APID
+     * @param window_size The amount of sequence counts in the window, 0 to remove the window
+     * @param max_packet_size The maximum size (in bytes) of a spacepacket held in the window
+     * @return false if the window could not be allocated, true otherwise
+     */
+    bool setReorderWindow(uint16_t apid_value, std::size_t window_size, std::size_t max_packet_size = 4096) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        SpReorderWindow<Allocator>*& window = this->rx_states[apid.getValue()].reorder_window;
+
+        if(window != nullptr) {
+            window->~SpReorderWindow<Allocator>();
+            UserBuffer window_buffer(window, sizeof(SpReorderWindow<Allocator>));
+            this->getAllocator().deallocateBuffer(window_buffer, ALLOC_SITE_REORDER);
+            window = nullptr;
+        }
+
+        if(window_size == 0) {
+            return true;
+        }
+
+        UserBuffer window_buffer = this->getAllocator().allocateBuffer(sizeof(SpReorderWindow<Allocator>), ALLOC_SITE_REORDER);
+        if(window_buffer.getStart() == nullptr) {
+            return false;
+        }
+
+        uint16_t next_count = this->rx_states[apid.getValue()].next_count.load(std::memory_order_relaxed);
+        window = new (window_buffer.getStart()) SpReorderWindow<Allocator>(window_size, max_packet_size, next_count,
+                                                                            this->getAllocator());
+        if(!window->isValid()) {
+            this->setReorderWindow(apid_value, 0);
+            return false;
+        }
+
+        if(this->rx_states[apid.getValue()].flags.load(std::memory_order_relaxed) & RX_RESYNC) {
+            window->setResync(true);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Deliver the spacepackets held in every reorder window, declaring lost the ones still
+     *        missing. @see{SpReorderWindow::flush}
+     */
+    void flushReorderWindows() {
+        for(uint16_t apid_value = 0; apid_value < SpListenerIndex<Allocator>::NB_APIDS; apid_value++) {
+            if(this->rx_states[apid_value].reorder_window != nullptr) {
+                this->rx_states[apid_value].reorder_window->flush([this, apid_value](const IBuffer& packet) {
+                    this->transmitValidBuffer(apid_value, packet, true);
+                });
             }
         }
     }
-    
+
+    /**
+     * @param apid_value The APID
+     * @return The statistics of the reorder window of the APID, all 0 if it has none
+     */
+    SpReorderStats getReorderStats(uint16_t apid_value) const {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        const SpReorderWindow<Allocator>* window = this->rx_states[apid.getValue()].reorder_window;
+        return window != nullptr ? window->getStats() : SpReorderStats();
+    }
+
+    /**
+     * @brief Drop the spacepackets of an APID received more than once (e.g from redundant ground
+     *        stations), before they are dispatched. @see{SpDuplicateFilter}. A duplicate is only counted
+     *        in the statistics of the filter, not as a reception error. A spacepacket is only remembered
+     *        once accepted (or given to the reorder window of the APID): a redundant copy of a spacepacket
+     *        rejected out of sequence is still received. Must be called before the traffic of the APID starts.
+     * 
+     * @param apid_value The APID
+     * @param window_size The amount of recent sequence counts remembered, 0 to remove the filter
+     * @param use_hash true to only drop a spacepacket if its content also matches the one already
+     *                 received with that sequence count, false to only compare the sequence counts
+     * @return false if the filter could not be allocated, true otherwise
+     */
+    bool setDuplicateFilter(uint16_t apid_value, std::size_t window_size, bool use_hash = false) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        SpDuplicateFilter<Allocator>*& filter = this->rx_states[apid.getValue()].duplicate_filter;
+
+        if(filter != nullptr) {
+            filter->~SpDuplicateFilter<Allocator>();
+            UserBuffer filter_buffer(filter, sizeof(SpDuplicateFilter<Allocator>));
+            this->getAllocator().deallocateBuffer(filter_buffer, ALLOC_SITE_DUPLICATES);
+            filter = nullptr;
+        }
+
+        if(window_size == 0) {
+            return true;
+        }
+
+        UserBuffer filter_buffer = this->getAllocator().allocateBuffer(sizeof(SpDuplicateFilter<Allocator>), ALLOC_SITE_DUPLICATES);
+        if(filter_buffer.getStart() == nullptr) {
+            return false;
+        }
+
+        filter = new (filter_buffer.getStart()) SpDuplicateFilter<Allocator>(window_size, use_hash, this->getAllocator());
+        if(!filter->isValid()) {
+            this->setDuplicateFilter(apid_value, 0);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @param apid_value The APID
+     * @return The statistics of the duplicate filter of the APID, all 0 if it has none
+     */
+    SpDuplicateStats getDuplicateStats(uint16_t apid_value) const {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        const SpDuplicateFilter<Allocator>* filter = this->rx_states[apid.getValue()].duplicate_filter;
+        return filter != nullptr ? filter->getStats() : SpDuplicateStats();
+    }
+
+    /**
+     * @brief Resynchronize an APID on the sequence counts it receives, instead of rejecting the ones
+     *        that are not exactly the next one: the first spacepacket received after the call sets the sequence count,
+     *        and a spacepacket ahead of sequence is accepted, the counts skipped being counted as lost
+     *        (SpTransferStats::rx_lost_count). Spacepackets behind the sequence (late, or duplicates)
+     *        are still rejected, until BEHIND_RUN_RESYNC of them in a row: the source restarted its
+     *        sequence counts, and the APID follows them. Calling it again also resynchronizes the APID
+     *        on the next spacepacket. For streams that start anywhere or have gaps, e.g a capture replayed
+     *        (@see{SpCaptureReplay}) or generated traffic (@see{SpTrafficGenerator}).
+     * 
+     * @param apid_value The APID
+     * @param resync true to resynchronize, false to only accept the next sequence count
+     */
+    void setSequenceResync(uint16_t apid_value, bool resync) {
+        SpPrimaryHeader::PacketApid apid(apid_value);
+        this->rx_states[apid.getValue()].flags.store(resync ? RX_RESYNC : 0, std::memory_order_relaxed);
+        this->rx_states[apid.getValue()].nb_behind.store(0, std::memory_order_relaxed);
+
+        SpReorderWindow<Allocator>* window = this->rx_states[apid.getValue()].reorder_window;
+        if(window != nullptr) {
+            window->setResync(resync);
+        }
+    }
+
+    /**
+     * @brief Resynchronize every APID on the sequence counts it receives. @see{setSequenceResync(uint16_t, bool)}
+     * 
+     * @param resync true to resynchronize, false to only accept the next sequence count
+     */
+    void setSequenceResync(bool resync) {
+        for(uint16_t apid_value = 0; apid_value < NB_APIDS; apid_value++) {
+            this->setSequenceResync(apid_value, resync);
+        }
+    }
+
+    /**
+     * @return The counters of the service, all APIDs combined
+     */
+    SpTransferStats getStats() const {
+        SpTransferStats stats;
+        stats.rx_count       = telemetry.rx_count.load(std::memory_order_relaxed);
+        stats.tx_count       = telemetry.tx_count.load(std::memory_order_relaxed);
+        stats.rx_error_count = telemetry.rx_error_count.load(std::memory_order_relaxed);
+        stats.tx_error_count = telemetry.tx_error_count.load(std::memory_order_relaxed);
+        stats.rx_lost_count  = telemetry.rx_lost_count.load(std::memory_order_relaxed);
+        stats.rx_bytes       = telemetry.rx_bytes.load(std::memory_order_relaxed);
+        stats.tx_bytes       = telemetry.tx_bytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * @param apid_value The APID
+     * @return The counters of the APID. Received spacepackets too short to have an APID are only
+     *         counted in getStats().
+     */
+    SpTransferStats getApidStats(uint16_t apid_value) const {
+        SpTransferStats stats;
+        const ApidStats* apid = this->findApidStats(SpPrimaryHeader::PacketApid(apid_value).getValue());
+        if(apid == nullptr) {
+            return stats;
+        }
+
+        stats.rx_count       = apid->rx_count.load(std::memory_order_relaxed);
+        stats.tx_count       = apid->tx_count.load(std::memory_order_relaxed);
+        stats.rx_error_count = apid->rx_error_count.load(std::memory_order_relaxed);
+        stats.tx_error_count = apid->tx_error_count.load(std::memory_order_relaxed);
+        stats.rx_lost_count  = apid->rx_lost_count.load(std::memory_order_relaxed);
+        stats.rx_bytes       = apid->rx_bytes.load(std::memory_order_relaxed);
+        stats.tx_bytes       = apid->tx_bytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * @brief Record the histograms of an APID (@see{SpApidHistograms}) from now on. Their memory is
+     *        allocated once, and kept until the service is destroyed. Recording them costs two
+     *        clock reads per spacepacket (or per batch of spacepackets) of the APID. With sparse
+     *        storage, the APIDs sharing their statistics also share their histograms.
+     * 
+     * @param apid_value The APID
+     * @return false if the histograms could not be allocated, true otherwise
+     */
+    bool enableHistograms(uint16_t apid_value) {
+        std::atomic<SpApidHistograms*>& histograms = this->useApidStats(SpPrimaryHeader::PacketApid(apid_value).getValue()).histograms;
+        if(histograms.load(std::memory_order_acquire) != nullptr) {
+            return true;
+        }
+
+        UserBuffer memory = this->getAllocator().allocateBuffer(sizeof(SpApidHistograms), ALLOC_SITE_TELEMETRY);
+        if(memory.getStart() == nullptr) {
+            return false;
+        }
+
+        SpApidHistograms* created = new (memory.getStart()) SpApidHistograms();
+        SpApidHistograms* expected = nullptr;
+        if(!histograms.compare_exchange_strong(expected, created, std::memory_order_acq_rel)) {
+            // enabled by another thread in the meantime
+            this->freeHistograms(created);
+        }
+        return true;
+    }
+
+    /**
+     * @param apid_value The APID
+     * @return The histograms of the APID, nullptr if they are not enabled. @see{enableHistograms}
+     */
+    const SpApidHistograms* getHistograms(uint16_t apid_value) const {
+        const ApidStats* apid = this->findApidStats(SpPrimaryHeader::PacketApid(apid_value).getValue());
+        return apid != nullptr ? apid->histograms.load(std::memory_order_acquire) : nullptr;
+    }
+
+    /**
+     * @brief Count the calls of each listener registration and the time spent in them, from now on,
+     *        whatever the path (single spacepackets, batches, listeners of every APID). Costs two clock
+     *        reads per call of a listener. @see{SpListenerIndex::enableDispatchStats}
+     * 
+     * @return false if the counters could not be allocated, true otherwise
+     */
+    bool enableDispatchStats() {
+        return this->listeners.enableDispatchStats();
+    }
+
+    /**
+     * @param listener The listener
+     * @return The dispatch statistics of the listener, all its registrations combined, all 0 if they
+     *         are not enabled. Can be read while the traffic flows, without a lock.
+     */
+    SpDispatchStats getDispatchStats(const SpListener* listener) const {
+        return this->listeners.getDispatchStats(listener);
+    }
+
     void connectUpperLayer(ICommunicationLayer& upper_layer) override {
         (void)upper_layer;
         //do nothing, the spacepacket layer cannot have an upper layer
@@ -162,30 +548,223 @@ public:
 
 private:
     void receiveFromSubLayer(const IBuffer& buffer) override {
+        this->receive(buffer);
+    }
+
+    void receiveChainFromSubLayer(const IBufferChain& chain) override {
+        this->receive(chain);
+    }
+
+    /**
+     * @brief Receive many spacepackets from the sub-layer at once. The batch is handled in chunks:
+     *        all the headers of a chunk are decoded first (prefetching the next packets), then the
+     *        sequence counts are validated in reception order, and the valid spacepackets are
+     *        dispatched with SpListener::newSpacepackets(). Listeners of every APID receive all the
+     *        valid spacepackets of a chunk in reception order; the other listeners receive them
+     *        grouped by APID, in reception order within an APID.
+     * 
+     * @param batch The spacepackets, in reception order
+     */
+    void receiveBatchFromSubLayer(Span<const UserBuffer> batch) override {
+        for(std::size_t offset = 0; offset < batch.getSize(); offset += BATCH_CHUNK_SIZE) {
+            this->receiveChunk(batch.subspan(offset, BATCH_CHUNK_SIZE));
+        }
+    }
+
+    /**
+     * @brief Receive a spacepacket from the sub-layer
+     * 
+     * @tparam BufferType IBuffer or IBufferChain
+     * @param buffer The spacepacket bytes
+     */
+    template<typename BufferType>
+    void receive(const BufferType& buffer) {
         // TODO: validate RX spacepacket
         // for now just assume SP is valid
         IBitStream in(buffer);
         SpPrimaryHeader pri_hdr;
         in >> pri_hdr;
 
-        uint16_t apid_value = pri_hdr.apid.getValue();
+        if(this->receiveReordered(pri_hdr, buffer)) {
+            return;
+        }
+
+        if(this->takeReceived(pri_hdr, buffer, [this, &pri_hdr]() { return this->acceptReceived(pri_hdr); })) {
+            this->transmitValidBuffer(pri_hdr.apid.getValue(), buffer, true);
+        }
+    }
+
+    /**
+     * @brief Receive at most BATCH_CHUNK_SIZE spacepackets. @see{receiveBatchFromSubLayer}
+     */
+    void receiveChunk(Span<const UserBuffer> chunk) {
+        SpPrimaryHeader headers[BATCH_CHUNK_SIZE];
+        bool accepted[BATCH_CHUNK_SIZE];
+
+        // decode all the headers
+        for(std::size_t i = 0; i < chunk.getSize(); i++) {
+            if(i + BATCH_PREFETCH_DISTANCE < chunk.getSize()) {
+                prefetch(chunk[i + BATCH_PREFETCH_DISTANCE].getStart());
+            }
+
+            accepted[i] = chunk[i].getSize() >= SpPrimaryHeader::SIZE;
+            if(accepted[i]) {
+                headers[i].decode(chunk[i].getStart());
+            }
+        }
+
+        // validate the sequence counts, in reception order
+        uint16_t order[BATCH_CHUNK_SIZE];
+        std::size_t nb_accepted = 0;
+        for(std::size_t i = 0; i < chunk.getSize(); i++) {
+            const SpPrimaryHeader& pri_hdr = headers[i];
+            if(!accepted[i]) {
+                this->telemetry.rx_error_count.fetch_add(1, std::memory_order_relaxed);
+            } else if(this->receiveReordered(pri_hdr, chunk[i])) {
+                // delivered (or held) by the reorder window of the APID, outside of the batch
+            } else if(this->takeReceived(pri_hdr, chunk[i], [this, &pri_hdr]() { return this->acceptReceived(pri_hdr); })) {
+                order[nb_accepted++] = static_cast<uint16_t>(i);
+            }
+        }
+
+        // listeners of every APID receive all the valid spacepackets at once
+        UserBuffer packets[BATCH_CHUNK_SIZE];
+        for(std::size_t i = 0; i < nb_accepted; i++) {
+            packets[i] = UserBuffer(chunk[order[i]].getStart(), chunk[order[i]].getSize());
+        }
+        Span<const UserBuffer> accepted_packets(packets, nb_accepted);
+        if(nb_accepted > 0) {
+            this->listeners.forEachWildcard([&accepted_packets](SpListener* listener) {
+                listener->newSpacepackets(accepted_packets);
+            }, nb_accepted);
+        }
 
-        if(!pri_hdr.apid.isIdle()) {
-            //validate that the count is sequential
-            auto next_count = this->contexes[apid_value].next_count;
+        // group by APID, keeping the reception order within an APID (insertion sort: a chunk is
+        // small and usually made of a few long runs of the same APID)
+        for(std::size_t i = 1; i < nb_accepted; i++) {
+            uint16_t current = order[i];
+            uint16_t apid_value = headers[current].apid.getValue();
+            std::size_t j = i;
+            while(j > 0 && headers[order[j - 1]].apid.getValue() > apid_value) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = current;
+        }
+
+        // the other listeners receive the spacepackets of their APIDs, one group at a time
+        for(std::size_t i = 0; i < nb_accepted; i++) {
+            packets[i] = UserBuffer(chunk[order[i]].getStart(), chunk[order[i]].getSize());
+        }
+
+        std::size_t group_start = 0;
+        while(group_start < nb_accepted) {
+            uint16_t apid_value = headers[order[group_start]].apid.getValue();
+            std::size_t group_end = group_start + 1;
+            while(group_end < nb_accepted && headers[order[group_end]].apid.getValue() == apid_value) {
+                group_end++;
+            }
+
+            Span<const UserBuffer> group = accepted_packets.subspan(group_start, group_end - group_start);
+            ApidStats& stats = this->useApidStats(apid_value);
+            SpApidHistograms* histograms = stats.histograms.load(std::memory_order_acquire);
+            uint64_t start = (histograms != nullptr) ? MonotonicClock::now() : 0;
+
+            this->listeners.forEachSpecific(SpPrimaryHeader::PacketApid(apid_value), [&group](SpListener* listener) {
+                listener->newSpacepackets(group);
+            }, group.getSize());
+
+            if(histograms != nullptr) {
+                histograms->dispatch_latency.record((MonotonicClock::now() - start) / group.getSize(), group.getSize());
+                histograms->rx.record(start, group.getSize());
+            }
 
-            if(next_count.getValue() == pri_hdr.sequence_count.getValue()) {
-                this->transmitValidBuffer(apid_value, buffer, true);
-                this->telemetry.rx_count++;
-            } else {
-                this->telemetry.rx_error_count++;
+            uint64_t nb_bytes = 0;
+            for(const UserBuffer& packet : group) {
+                nb_bytes += packet.getSize();
             }
+            stats.rx_count.fetch_add(group.getSize(), std::memory_order_relaxed);
+            stats.rx_bytes.fetch_add(nb_bytes, std::memory_order_relaxed);
+            telemetry.rx_count.fetch_add(group.getSize(), std::memory_order_relaxed);
+            telemetry.rx_bytes.fetch_add(nb_bytes, std::memory_order_relaxed);
+            group_start = group_end;
+        }
+    }
+
+    /**
+     * @brief Offer a received spacepacket to take(), unless the duplicate filter of its APID (if it
+     *        has one) drops it as a duplicate. The filter remembers it only if taken, in the same step.
+     * 
+     * @param pri_hdr The primary header of the spacepacket
+     * @param buffer The spacepacket (IBuffer or IBufferChain)
+     * @param take The function offered the spacepacket (bool()), returning true if it is taken
+     * @return true if the spacepacket was taken, false otherwise
+     */
+    template<typename BufferType, typename Take>
+    bool takeReceived(const SpPrimaryHeader& pri_hdr, const BufferType& buffer, Take&& take) {
+        SpDuplicateFilter<Allocator>* filter = this->rx_states[pri_hdr.apid.getValue()].duplicate_filter;
+        if(filter == nullptr || pri_hdr.apid.isIdle()) {
+            return take();
+        }
+        return filter->receive(pri_hdr.sequence_count.getValue(), buffer, take);
+    }
+
+    /**
+     * @brief Give a received spacepacket to the reorder window of its APID, if it has one (and it
+     *        is not a duplicate)
+     * 
+     * @param pri_hdr The primary header of the spacepacket
+     * @param buffer The spacepacket (IBuffer or IBufferChain)
+     * @return false if the APID has no reorder window, true otherwise
+     */
+    template<typename BufferType>
+    bool receiveReordered(const SpPrimaryHeader& pri_hdr, const BufferType& buffer) {
+        uint16_t apid_value = pri_hdr.apid.getValue();
+        SpReorderWindow<Allocator>* window = this->rx_states[apid_value].reorder_window;
+        if(window == nullptr || pri_hdr.apid.isIdle()) {
+            return false;
+        }
+
+        // the window takes every spacepacket that is not a duplicate
+        if(this->takeReceived(pri_hdr, buffer, []() { return true; })) {
+            window->receive(pri_hdr.sequence_count.getValue(), buffer, [this, apid_value](const auto& packet) {
+                this->transmitValidBuffer(apid_value, packet, true);
+            });
+        }
+        return true;
+    }
+
+    /**
+     * @brief Check if a spacepacket received from the sub-layer is accepted, and if so advance the
+     *        sequence count of its APID
+     * 
+     * @param pri_hdr The primary header of the spacepacket
+     * @return true if accepted, false otherwise
+     */
+    bool acceptReceived(const SpPrimaryHeader& pri_hdr) {
+        uint16_t apid_value = pri_hdr.apid.getValue();
+
+        if(pri_hdr.apid.isIdle()) {
+            // idle spacepackets are always accepted
+            this->rx_states[apid_value].next_count.fetch_add(1, std::memory_order_relaxed);
+            return true;
         }
-        else
-        {
-            this->transmitValidBuffer(apid_value, buffer, true);
-            this->telemetry.rx_count++;
+
+        if(this->acceptSequenceCount(apid_value, pri_hdr.sequence_count.getValue())) {
+            return true;
         }
+
+        this->useApidStats(apid_value).rx_error_count.fetch_add(1, std::memory_order_relaxed);
+        this->telemetry.rx_error_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    static void prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#else
+        (void)address;
+#endif
     }
 
     void receiveFromUpperLayer(const IBuffer& bytes) override {
@@ -193,37 +772,268 @@ private:
         //unused, Spacepacket layer is an application layer
     }
 
-    void transmitValidBuffer(uint16_t apid_value, const IBuffer& buffer, bool isSubLayerBuffer) {
+    template<typename BufferType>
+    void transmitValidBuffer(uint16_t apid_value, const BufferType& buffer, bool isSubLayerBuffer) {
+        ApidStats& stats = this->useApidStats(apid_value);
+        SpApidHistograms* histograms = stats.histograms.load(std::memory_order_acquire);
+        uint64_t start = (histograms != nullptr) ? MonotonicClock::now() : 0;
+
         //listeners have to be notified of this new spacepacket
         this->notifyListeners(SpPrimaryHeader::PacketApid(apid_value), buffer);
 
+        if(histograms != nullptr) {
+            histograms->dispatch_latency.record(MonotonicClock::now() - start);
+            (isSubLayerBuffer ? histograms->rx : histograms->tx).record(start);
+        }
+
         // only transmit to sub-layer if the buffer doesn't already come from that layer
         if(!isSubLayerBuffer) {
             this->pushToSubLayer(buffer);
         }
 
         //update current context of the APID
-        isSubLayerBuffer ? ++contexes[apid_value].rx_count : 
-                           ++contexes[apid_value].tx_count;
-        ++contexes[apid_value].next_count;
+        if(isSubLayerBuffer) {
+            stats.rx_count.fetch_add(1, std::memory_order_relaxed);
+            stats.rx_bytes.fetch_add(buffer.getSize(), std::memory_order_relaxed);
+            telemetry.rx_count.fetch_add(1, std::memory_order_relaxed);
+            telemetry.rx_bytes.fetch_add(buffer.getSize(), std::memory_order_relaxed);
+        } else {
+            stats.tx_count.fetch_add(1, std::memory_order_relaxed);
+            stats.tx_bytes.fetch_add(buffer.getSize(), std::memory_order_relaxed);
+            telemetry.tx_count.fetch_add(1, std::memory_order_relaxed);
+            telemetry.tx_bytes.fetch_add(buffer.getSize(), std::memory_order_relaxed);
+        }
+    }
+
+    void countTxError(uint16_t apid_value) {
+        this->useApidStats(SpPrimaryHeader::PacketApid(apid_value).getValue()).tx_error_count.fetch_add(1, std::memory_order_relaxed);
+        this->telemetry.tx_error_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void freeHistograms(SpApidHistograms* histograms) {
+        histograms->~SpApidHistograms();
+        UserBuffer memory(histograms, sizeof(SpApidHistograms));
+        this->getAllocator().deallocateBuffer(memory, ALLOC_SITE_TELEMETRY);
+    }
+
+    /**
+     * @brief Allocate the statistics of the APIDs, in a single block: with sparse storage, the index
+     *        of each APID's statistics (4 KiB), then the statistics themselves, aligned on cache lines.
+     *        If the block cannot be allocated, every APID shares the same statistics.
+     * 
+     * @param nb_sparse_apids @see{SpTransferService::SpTransferService}
+     */
+    void allocateApidStats(std::size_t nb_sparse_apids) {
+        bool sparse = nb_sparse_apids > 0 && nb_sparse_apids < NB_APIDS;
+        std::size_t nb_stats = sparse ? nb_sparse_apids : static_cast<std::size_t>(NB_APIDS);
+        std::size_t index_size = sparse ? NB_APIDS * sizeof(std::atomic<uint16_t>) : 0;
+
+        // one more cache line to align the statistics
+        stats_memory = this->getAllocator().allocateBuffer(index_size + (nb_stats + 1) * sizeof(ApidStats),
+                                                           ALLOC_SITE_TELEMETRY);
+        if(stats_memory.getStart() == nullptr) {
+            return;
+        }
+
+        if(sparse) {
+            stats_index = reinterpret_cast<std::atomic<uint16_t>*>(stats_memory.getStart());
+            for(std::size_t i = 0; i < NB_APIDS; i++) {
+                new (&stats_index[i]) std::atomic<uint16_t>(NO_STATS);
+            }
+        }
+
+        uintptr_t address = reinterpret_cast<uintptr_t>(stats_memory.getStart() + index_size);
+        address = (address + CACHE_LINE_SIZE - 1) & ~static_cast<uintptr_t>(CACHE_LINE_SIZE - 1);
+        apid_stats = reinterpret_cast<ApidStats*>(address);
+        for(std::size_t i = 0; i < nb_stats; i++) {
+            new (&apid_stats[i]) ApidStats();
+        }
+        nb_apid_stats = nb_stats;
+    }
+
+    void freeHistograms(ApidStats& stats) {
+        SpApidHistograms* histograms = stats.histograms.load(std::memory_order_relaxed);
+        if(histograms != nullptr) {
+            this->freeHistograms(histograms);
+        }
+    }
+
+    /**
+     * @brief Get the statistics of an APID. With sparse storage, the first use of an APID gives it
+     *        its own statistics, if there are some left.
+     */
+    ApidStats& useApidStats(uint16_t apid_value) {
+        if(stats_index == nullptr) {
+            return (nb_apid_stats > 0) ? apid_stats[apid_value] : shared_stats;
+        }
+
+        uint16_t index = stats_index[apid_value].load(std::memory_order_acquire);
+        if(index == NO_STATS) {
+            std::size_t claimed = nb_claimed.fetch_add(1, std::memory_order_relaxed);
+            uint16_t wanted = (claimed < nb_apid_stats) ? static_cast<uint16_t>(claimed) : static_cast<uint16_t>(nb_apid_stats);
+            // on a race for the same APID, the statistics claimed by the loser stay unused
+            if(stats_index[apid_value].compare_exchange_strong(index, wanted, std::memory_order_acq_rel)) {
+                index = wanted;
+            }
+        }
+        return (index < nb_apid_stats) ? apid_stats[index] : shared_stats;
     }
 
+    /**
+     * @brief Get the statistics of an APID, without giving it its own if it has none yet
+     * 
+     * @return The statistics, nullptr if the APID was not used yet
+     */
+    const ApidStats* findApidStats(uint16_t apid_value) const {
+        if(stats_index == nullptr) {
+            return (nb_apid_stats > 0) ? &apid_stats[apid_value] : &shared_stats;
+        }
+
+        uint16_t index = stats_index[apid_value].load(std::memory_order_acquire);
+        if(index == NO_STATS) {
+            return nullptr;
+        }
+        return (index < nb_apid_stats) ? &apid_stats[index] : &shared_stats;
+    }
+
+    /**
+     * @brief Finalize a spacepacket to transmit and, if it is valid, give it the next sequence count
+     *        of its APID. Invalid spacepackets don't consume a sequence count.
+     * 
+     * @param sp The spacepacket
+     * @return true if the spacepacket is valid, false otherwise
+     */
+    template<typename Packet>
+    bool stampSequenceCount(Packet& sp) {
+        // validate without serializing: the headers are written once, with their sequence count
+        sp.prepareHeader();
+        if(!sp.isValid()) {
+            this->countTxError(sp.primary_hdr.apid.getValue());
+            return false;
+        }
+
+        //set the sequence count depending on the context of the sender's APID
+        uint16_t apid_value = sp.primary_hdr.apid.getValue();
+        sp.primary_hdr.sequence_count.setValue(this->next_counts[apid_value].fetch_add(1, std::memory_order_relaxed));
+        sp.finalize();
+        return true;
+    }
+
+    /**
+     * @brief Check that a received sequence count is the next one of its APID, and if so advance it.
+     *        An APID that resynchronizes also accepts the first count it receives, and the counts ahead
+     *        of sequence (up to half of the sequence count range), counting the ones skipped. A run of
+     *        counts behind the sequence moves it back to them.
+     * 
+     * @param apid_value The APID
+     * @param count The sequence count received
+     * @return true if the sequence count was accepted, false otherwise
+     */
+    bool acceptSequenceCount(uint16_t apid_value, uint16_t count) {
+        ApidRxState& state = this->rx_states[apid_value];
+        std::atomic<uint16_t>& next_count = state.next_count;
+        uint16_t expected = next_count.load(std::memory_order_relaxed);
+        uint8_t flags = state.flags.load(std::memory_order_relaxed);
+        std::size_t nb_lost;
+        bool restarted = false;
+
+        do {
+            SpPrimaryHeader::SequenceCount next;
+            next.setValue(expected);
+            // counts skipped to reach the received one
+            nb_lost = (static_cast<uint32_t>(count) - next.getValue()) & (COUNT_RANGE - 1);
+            if(nb_lost == 0) {
+                continue;
+            }
+
+            if(!(flags & RX_RESYNC)) {
+                return false;
+            }
+            if(!(flags & RX_STARTED)) {
+                // the first spacepacket sets the sequence count
+                nb_lost = 0;
+            } else if(nb_lost >= COUNT_RANGE / 2) {
+                // behind the sequence: late, or a duplicate, unless the run is long enough for a restart
+                if(!restarted && state.nb_behind.fetch_add(1, std::memory_order_relaxed) + 1 < BEHIND_RUN_RESYNC) {
+                    return false;
+                }
+                restarted = true;
+                nb_lost = 0;
+            }
+        } while(!next_count.compare_exchange_weak(expected, static_cast<uint16_t>(count + 1), std::memory_order_relaxed));
+
+        if(!(flags & RX_STARTED) && (flags & RX_RESYNC)) {
+            state.flags.fetch_or(RX_STARTED, std::memory_order_relaxed);
+        }
+        if(state.nb_behind.load(std::memory_order_relaxed) != 0) {
+            state.nb_behind.store(0, std::memory_order_relaxed);
+        }
+        if(nb_lost > 0) {
+            this->useApidStats(apid_value).rx_lost_count.fetch_add(nb_lost, std::memory_order_relaxed);
+            this->telemetry.rx_lost_count.fetch_add(nb_lost, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Notify the listeners matching an APID. Only the listeners of that APID and those of
+     *        every APID are visited, whatever the amount of listeners registered.
+     */
     void notifyListeners(SpPrimaryHeader::PacketApid apid, const IBuffer& buffer) {
-        for(uint32_t i = 0; i < nb_listeners; i++) {
-            if(listener_entries[i].matcher(apid)) {
-                listener_entries[i].listener->newSpacepacket(buffer);
+        this->listeners.forEach(apid, [&buffer](SpListener* listener) { listener->newSpacepacket(buffer); });
+    }
+
+    /**
+     * @brief Notify the listeners matching an APID of a scattered spacepacket. It is gathered at most
+     *        once, for all the listeners that do not accept scattered spacepackets.
+     */
+    void notifyListeners(SpPrimaryHeader::PacketApid apid, const IBufferChain& chain) {
+        bool gathered = chain.getNbSegments() == 1;
+        UserBuffer contiguous = gathered ? UserBuffer(chain.getSegment(0).getStart(), chain.getSegment(0).getSize())
+                                         : UserBuffer(nullptr, 0);
+
+        this->listeners.forEach(apid, [this, &chain, &contiguous, &gathered](SpListener* listener) {
+            if(listener->acceptsScattered()) {
+                listener->newScatteredSpacepacket(chain);
+                return;
+            }
+
+            if(!gathered) {
+                gathered = true;
+                contiguous = this->getAllocator().allocateBuffer(chain.getSize(), ALLOC_SITE_TRANSFER_PACKET);
+                if(contiguous.getStart() != nullptr) {
+                    chain.copyTo(contiguous);
+                }
+            }
+            if(contiguous.getStart() != nullptr) {
+                listener->newSpacepacket(contiguous);
             }
+        });
+
+        if(chain.getNbSegments() != 1 && contiguous.getStart() != nullptr) {
+            this->getAllocator().deallocateBuffer(contiguous, ALLOC_SITE_TRANSFER_PACKET);
         }
     }
 
-    const Allocator& allocator;
-    std::size_t nb_listeners;
-    const std::size_t nb_listeners_max;
-    ListenerEntry* listener_entries;
-    UserBuffer listener_buffer;
+    SpListenerIndex<Allocator> listeners;
 
-    ApidContext contexes[SpPrimaryHeader::PacketApid::IDLE_VALUE + 1];
+    /** Next sequence count of each APID, only the lowest bits are used (wraps with the sequence count).
+        Touched by every spacepacket transmitted, so kept dense (4 KiB) and apart from the statistics. */
+    std::atomic<uint16_t> next_counts[NB_APIDS] = {};
+    /** State of the reception of each APID (64 KiB) */
+    ApidRxState rx_states[NB_APIDS];
     Telemetry telemetry;
+
+    /** Statistics of the APIDs: one per APID, or one per APID in order of first use (sparse storage) */
+    ApidStats* apid_stats = nullptr;
+    std::size_t nb_apid_stats = 0;
+    /** With sparse storage, the index of each APID's statistics, NO_STATS if not used yet */
+    std::atomic<uint16_t>* stats_index = nullptr;
+    /** With sparse storage, the amount of statistics given to APIDs */
+    std::atomic<std::size_t> nb_claimed{0};
+    /** Statistics shared by the APIDs that could not get their own */
+    ApidStats shared_stats;
+    UserBuffer stats_memory;
 };
 
 } //namespace
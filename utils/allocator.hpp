@@ -11,6 +11,32 @@
 #include "utils/buffer.hpp"
 #include <cstdint>
 #include <cstdlib>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @brief Identifies who requested an allocation. Allocators that keep statistics use it
+ *        to break them down by call site (@see{InstrumentedAllocator}), the others ignore it.
+ *        Values from ALLOC_SITE_USER up to ALLOC_SITE_MAX (excluded) are free for the user.
+ */
+enum AllocationSite : uint8_t {
+    ALLOC_SITE_UNKNOWN = 0,
+    ALLOC_SITE_SP_BUILDER,
+    ALLOC_SITE_SP_IDLE_BUILDER,
+    ALLOC_SITE_TRANSFER_LISTENERS,
+    ALLOC_SITE_TRANSFER_PACKET,
+    ALLOC_SITE_ASYNC_QUEUE,
+    ALLOC_SITE_SHARDS,
+    ALLOC_SITE_REORDER,
+    ALLOC_SITE_REASSEMBLY,
+    ALLOC_SITE_TELEMETRY,
+    ALLOC_SITE_SCHEDULER,
+    ALLOC_SITE_DUPLICATES,
+    ALLOC_SITE_TRAFFIC,
+
+    ALLOC_SITE_USER = 16,
+    ALLOC_SITE_MAX  = 32
+};
 
 /**
  * @brief Base interface for allocator objects
@@ -18,6 +44,9 @@
  * @details Similar to the STL, allocators are used to give the user more granular control
  *          over memory used by an instance of a given class. For example, one can specify an
  *          allocator type to std::vector to retain control of dynamic memory de/allocation.
+ *          This interface is used when the allocator has to be chosen at runtime. Classes that
+ *          take an allocator as template parameter hold it by value and call it directly,
+ *          @see{AllocatorBase} and @see{AllocatorRef}.
  * WARNING: To avoid memory leaks, every allocate() function should be paired with an
  *          equivalent deallocate() function.
  */
@@ -28,7 +57,7 @@ public:
     typedef uint8_t*        pointer;
     typedef const uint8_t*  const_pointer;
     typedef std::size_t     size_type;
-    
+
     /**
      * @brief Request allocation of a contiguous amount of bytes
      * 
@@ -44,41 +73,290 @@ public:
      * @param nb_bytes The amount of bytes that were allocated
      */
     virtual void    deallocate(pointer bytes, size_type nb_bytes) const noexcept = 0;
-    
+
+    /**
+     * @brief Request allocation of a contiguous amount of bytes, on behalf of a given call site
+     * 
+     * @param nb_bytes The amount of bytes to allocate
+     * @param site The call site requesting the allocation
+     * @return A pointer to the first byte of the memory that was allocated
+     */
+    virtual pointer allocateTagged(size_type nb_bytes, AllocationSite site) const {
+        (void)site;
+        return this->allocate(nb_bytes);
+    }
+
+    /**
+     * @brief Request deallocation of memory previously allocated with allocateTagged()
+     * 
+     * @param bytes The pointer to the first byte of the previously allocated memory
+     * @param nb_bytes The amount of bytes that were allocated
+     * @param site The call site given at allocation
+     */
+    virtual void    deallocateTagged(pointer bytes, size_type nb_bytes, AllocationSite site) const noexcept {
+        (void)site;
+        this->deallocate(bytes, nb_bytes);
+    }
+
+    /**
+     * @brief Utility to request allocation of a buffer (memory abstraction)
+     * 
+     * @param nb_bytes The amount of bytes that were allocated
+     * @param site The call site requesting the allocation
+     * @return The buffer object created
+     */
+    inline UserBuffer allocateBuffer(size_type nb_bytes, AllocationSite site = ALLOC_SITE_UNKNOWN) const {
+        return UserBuffer(this->allocateTagged(nb_bytes, site), nb_bytes);
+    }
+
+    /**
+     * @brief Utility to request deallocation of a buffer
+     * 
+     * @param buffer The buffer object previously allocated
+     * @param site The call site given at allocation
+     */
+    inline void deallocateBuffer(UserBuffer& buffer, AllocationSite site = ALLOC_SITE_UNKNOWN) const {
+        this->deallocateTagged(buffer.getStart(), buffer.getSize(), site);
+    }
+};
+
+/**
+ * @brief Base class of allocators that are known at compilation.
+ * 
+ * @details Unlike IAllocator, there is no virtual function : the derived allocator only has to
+ *          provide allocate() and deallocate() and the calls are resolved (and usually inlined) at
+ *          compilation. Stateless allocators deriving from this class are empty, so the classes
+ *          holding them by value do not grow (empty-base optimization, @see{AllocatorHolder}).
+ * 
+ * @tparam Derived The allocator class deriving from this base (CRTP)
+ */
+template<typename Derived>
+class AllocatorBase
+{
+public:
+    typedef uint8_t         value_type;
+    typedef uint8_t*        pointer;
+    typedef const uint8_t*  const_pointer;
+    typedef std::size_t     size_type;
+
+    /**
+     * @brief Request allocation on behalf of a given call site. By default, the site is ignored.
+     *        The derived allocator can hide this function to make use of it.
+     * 
+     * @param nb_bytes The amount of bytes to allocate
+     * @param site The call site requesting the allocation
+     * @return A pointer to the first byte of the memory that was allocated
+     */
+    inline pointer allocateTagged(size_type nb_bytes, AllocationSite site) const {
+        (void)site;
+        return static_cast<const Derived*>(this)->allocate(nb_bytes);
+    }
+
+    /**
+     * @brief Request deallocation on behalf of a given call site. By default, the site is ignored.
+     *        The derived allocator can hide this function to make use of it.
+     * 
+     * @param bytes The pointer to the first byte of the previously allocated memory
+     * @param nb_bytes The amount of bytes that were allocated
+     * @param site The call site given at allocation
+     */
+    inline void deallocateTagged(pointer bytes, size_type nb_bytes, AllocationSite site) const noexcept {
+        (void)site;
+        static_cast<const Derived*>(this)->deallocate(bytes, nb_bytes);
+    }
+
     /**
      * @brief Utility to request allocation of a buffer (memory abstraction)
      * 
      * @param nb_bytes The amount of bytes that were allocated
+     * @param site The call site requesting the allocation
      * @return The buffer object created
      */
-    inline UserBuffer allocateBuffer(size_type nb_bytes) const {
-        return UserBuffer(this->allocate(nb_bytes), nb_bytes);
+    inline UserBuffer allocateBuffer(size_type nb_bytes, AllocationSite site = ALLOC_SITE_UNKNOWN) const {
+        return UserBuffer(static_cast<const Derived*>(this)->allocateTagged(nb_bytes, site), nb_bytes);
     }
 
     /**
      * @brief Utility to request deallocation of a buffer
      * 
      * @param buffer The buffer object previously allocated
+     * @param site The call site given at allocation
      */
-    inline void deallocateBuffer(UserBuffer& buffer) const {
-        this->deallocate(buffer.getStart(), buffer.getSize());
+    inline void deallocateBuffer(UserBuffer& buffer, AllocationSite site = ALLOC_SITE_UNKNOWN) const {
+        static_cast<const Derived*>(this)->deallocateTagged(buffer.getStart(), buffer.getSize(), site);
     }
 };
 
 /**
  * @brief Default allocator that uses malloc() and free() functions.
  */
-class DefaultAllocator : public IAllocator
+class DefaultAllocator : public AllocatorBase<DefaultAllocator>
 {
-    pointer allocate(size_type nb_bytes) const override {
+public:
+    pointer allocate(size_type nb_bytes) const {
         pointer ret = static_cast<pointer>(std::malloc(nb_bytes));
         return ret;
     }
 
-    void deallocate(pointer bytes, size_type nb_bytes) const noexcept override {
+    void deallocate(pointer bytes, size_type nb_bytes) const noexcept {
         (void)nb_bytes;
         std::free(bytes);
     }
 };
 
-#endif // ALLOCATOR_HPP
\ No newline at end of file
+/**
+ * @brief Runtime-polymorphic wrapper of an allocator known at compilation. This is used
+ *        to pass such an allocator where an IAllocator is expected.
+ * 
+ * @tparam Allocator The wrapped allocator
+ */
+template<typename Allocator>
+class AllocatorAdapter final : public IAllocator
+{
+public:
+    AllocatorAdapter(const Allocator& alloc = Allocator())
+    : allocator(alloc) {
+
+    }
+
+    pointer allocate(size_type nb_bytes) const override {
+        return allocator.allocate(nb_bytes);
+    }
+
+    void deallocate(pointer bytes, size_type nb_bytes) const noexcept override {
+        allocator.deallocate(bytes, nb_bytes);
+    }
+
+    pointer allocateTagged(size_type nb_bytes, AllocationSite site) const override {
+        return allocator.allocateTagged(nb_bytes, site);
+    }
+
+    void deallocateTagged(pointer bytes, size_type nb_bytes, AllocationSite site) const noexcept override {
+        allocator.deallocateTagged(bytes, nb_bytes, site);
+    }
+
+private:
+    /** The wrapped allocator */
+    Allocator allocator;
+};
+
+/**
+ * @brief Non-owning handle to an IAllocator. This is the allocator type to give as template
+ *        parameter when the allocator is only known at runtime. The referred allocator must
+ *        outlive every object using the handle.
+ * @code
+ *          MyRuntimeAllocator pool;
+ *          SpBuilder<MySecHdr, AllocatorRef> packet(256, AllocatorRef(pool));
+ * @endcode
+ * @note A default-constructed handle refers to a malloc-based allocator.
+ */
+class AllocatorRef : public AllocatorBase<AllocatorRef>
+{
+public:
+    AllocatorRef()
+    : allocator(&getDefault()) {
+
+    }
+
+    AllocatorRef(const IAllocator& alloc)
+    : allocator(&alloc) {
+
+    }
+
+    pointer allocate(size_type nb_bytes) const {
+        return allocator->allocate(nb_bytes);
+    }
+
+    void deallocate(pointer bytes, size_type nb_bytes) const noexcept {
+        allocator->deallocate(bytes, nb_bytes);
+    }
+
+    pointer allocateTagged(size_type nb_bytes, AllocationSite site) const {
+        return allocator->allocateTagged(nb_bytes, site);
+    }
+
+    void deallocateTagged(pointer bytes, size_type nb_bytes, AllocationSite site) const noexcept {
+        allocator->deallocateTagged(bytes, nb_bytes, site);
+    }
+
+    /**
+     * @return The allocator referred to by this handle
+     */
+    const IAllocator& get() const {
+        return *allocator;
+    }
+
+private:
+    static const IAllocator& getDefault() {
+        static const AllocatorAdapter<DefaultAllocator> default_allocator;
+        return default_allocator;
+    }
+
+    /** The allocator referred to */
+    const IAllocator* allocator;
+};
+
+/**
+ * @brief Checks, at compilation, if a type can be used as an allocator (i.e if it provides
+ *        allocate() and deallocate() functions with the right signature).
+ * 
+ * @tparam T The type to check
+ */
+template<typename T, typename = void>
+struct isAllocator : std::false_type {};
+
+template<typename T>
+struct isAllocator<T, std::void_t<
+    decltype(static_cast<uint8_t*>(std::declval<const T&>().allocate(std::size_t(0)))),
+    decltype(std::declval<const T&>().deallocate(std::declval<uint8_t*>(), std::size_t(0)))>>
+    : std::bool_constant<!std::is_abstract<T>::value> {};
+
+/**
+ * @brief Holds an allocator by value. When the allocator is an empty class (stateless allocator),
+ *        it is stored as a base class so that it does not occupy any space in the holder (empty-base
+ *        optimization). Classes using an allocator should derive from this holder.
+ * 
+ * @tparam Allocator The held allocator
+ */
+template<typename Allocator,
+         bool IsEmpty = std::is_empty<Allocator>::value && !std::is_final<Allocator>::value>
+class AllocatorHolder : private Allocator
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+public:
+    AllocatorHolder(const Allocator& alloc)
+    : Allocator(alloc) {
+
+    }
+
+    /**
+     * @return The allocator held
+     */
+    const Allocator& getAllocator() const {
+        return *this;
+    }
+};
+
+template<typename Allocator>
+class AllocatorHolder<Allocator, false>
+{
+    static_assert(isAllocator<Allocator>::value, "The chosen allocator is not valid");
+public:
+    AllocatorHolder(const Allocator& alloc)
+    : allocator(alloc) {
+
+    }
+
+    /**
+     * @return The allocator held
+     */
+    const Allocator& getAllocator() const {
+        return allocator;
+    }
+
+private:
+    /** The allocator held */
+    Allocator allocator;
+};
+
+#endif // ALLOCATOR_HPP
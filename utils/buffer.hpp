@@ -110,9 +110,9 @@ public:
 
 private:
     /** The size of the memory section  */
-    std::size_t max_size;
+    std::size_t max_size = 0;
     /** The start address of the memory section */
-    uint8_t*    buf_start;
+    uint8_t*    buf_start = nullptr;
 };
 
 
@@ -0,0 +1,220 @@
+/**************************************************************************//**
+ * @file bufferchain.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains utilities for handling memory that is scattered in many
+ *        sections (scatter-gather buffers)
+ * 
+ ******************************************************************************/
+#ifndef BUFFERCHAIN_HPP
+#define BUFFERCHAIN_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/buffer.hpp"
+#include "utils/printable.hpp"
+#include <cstdint>
+#include <cstring>
+
+#if __has_include(<sys/uio.h>)
+#include <sys/uio.h>
+#define BUFFERCHAIN_HAS_IOVEC
+#endif
+
+/**
+ * @brief Interface that abstracts an ordered chain of memory sections (segments), seen as one
+ *        single sequence of bytes. Like IBuffers, chains never own the memory they refer to.
+ * 
+ * @details Chains are used to assemble data coming from different places without copying it
+ *          (e.g a header held by the caller, followed by a large payload owned by someone else).
+ *          The segments map directly to the iovec structures of writev()/sendmsg().
+ */
+class IBufferChain : public Printable
+{
+public:
+    /**
+     * @return The amount of segments in the chain
+     */
+    virtual std::size_t getNbSegments() const = 0;
+
+    /**
+     * @brief Get a segment of the chain
+     * 
+     * @param index The index of the segment, lower than getNbSegments()
+     * @return The segment
+     */
+    virtual const UserBuffer& getSegment(std::size_t index) const = 0;
+
+    /**
+     * @return The total size (in bytes) of the chain, all segments combined
+     */
+    virtual std::size_t getSize() const = 0;
+
+    /**
+     * @brief Gather the chain's bytes in a contiguous buffer.
+     * 
+     * @param dst The buffer to copy the bytes to
+     * @return The amount of bytes copied. Less than getSize() if @p dst is too small.
+     */
+    std::size_t copyTo(IBuffer& dst) const {
+        std::size_t copied = 0;
+
+        for(std::size_t i = 0; i < this->getNbSegments() && copied < dst.getSize(); i++) {
+            const UserBuffer& segment = this->getSegment(i);
+            std::size_t nb_bytes = segment.getSize();
+
+            if(nb_bytes > dst.getSize() - copied) {
+                nb_bytes = dst.getSize() - copied;
+            }
+            std::memcpy(dst.getStart() + copied, segment.getStart(), nb_bytes);
+            copied += nb_bytes;
+        }
+        return copied;
+    }
+
+#if defined(BUFFERCHAIN_HAS_IOVEC)
+    /**
+     * @brief Describe the chain as an array of iovec, ready to be given to writev() or sendmsg().
+     * 
+     * @param iov The array to fill
+     * @param max_iov The amount of elements in @p iov
+     * @return The amount of elements filled. Less than getNbSegments() if @p iov is too small.
+     */
+    std::size_t toIoVec(struct iovec* iov, std::size_t max_iov) const {
+        std::size_t nb_iov = 0;
+
+        for(std::size_t i = 0; i < this->getNbSegments() && nb_iov < max_iov; i++) {
+            const UserBuffer& segment = this->getSegment(i);
+            iov[nb_iov].iov_base = segment.getStart();
+            iov[nb_iov].iov_len  = segment.getSize();
+            nb_iov++;
+        }
+        return nb_iov;
+    }
+#endif
+
+    void print() const override {
+        for(std::size_t i = 0; i < this->getNbSegments(); i++) {
+            const UserBuffer& segment = this->getSegment(i);
+            for(std::size_t j = 0; j < segment.getSize(); j++) {
+                printf("%02X ", *(segment.getStart() + j));
+            }
+        }
+        printf("\n");
+    }
+};
+
+/**
+ * @brief Chain of a maximum amount of segments. The segment descriptors are held inside the
+ *        instance, the memory they refer to is not.
+ * @code
+ *          BufferChain<2> chain;
+ *          chain.append(header);       // 6 bytes held by the caller
+ *          chain.append(payload);      // large payload, not copied
+ * @endcode
+ * 
+ * @tparam MaxSegments The maximum amount of segments in the chain
+ */
+template<std::size_t MaxSegments>
+class BufferChain : public IBufferChain
+{
+    static_assert(MaxSegments > 0, "Buffer chain must hold at least one segment");
+public:
+    BufferChain() = default;
+
+    std::size_t getNbSegments() const override {
+        return nb_segments;
+    }
+
+    const UserBuffer& getSegment(std::size_t index) const override {
+        return segments[index];
+    }
+
+    std::size_t getSize() const override {
+        return total_size;
+    }
+
+    /**
+     * @brief Add a segment at the end of the chain
+     * 
+     * @param buffer The memory section to refer to
+     * @return false if the chain is already full, true otherwise
+     */
+    bool append(const IBuffer& buffer) {
+        return this->append(buffer.getStart(), buffer.getSize());
+    }
+
+    /**
+     * @brief Add a segment at the end of the chain
+     * 
+     * @param start The start address of the memory section to refer to
+     * @param size The size of the memory section to refer to
+     * @return false if the chain is already full, true otherwise
+     */
+    bool append(void* start, std::size_t size) {
+        if(nb_segments >= MaxSegments) {
+            return false;
+        }
+
+        segments[nb_segments] = UserBuffer(start, size);
+        nb_segments++;
+        total_size += size;
+        return true;
+    }
+
+    /**
+     * @brief Remove the segments at the end of the chain
+     * 
+     * @param nb_kept The amount of segments to keep at the beginning of the chain
+     */
+    void truncate(std::size_t nb_kept) {
+        while(nb_segments > nb_kept) {
+            nb_segments--;
+            total_size -= segments[nb_segments].getSize();
+        }
+    }
+
+    /**
+     * @brief Remove all the segments of the chain
+     */
+    void clear() {
+        this->truncate(0);
+    }
+
+private:
+    /** The segments of the chain, in order */
+    UserBuffer  segments[MaxSegments];
+    /** The amount of segments currently in the chain */
+    std::size_t nb_segments = 0;
+    /** The size of all the segments combined */
+    std::size_t total_size = 0;
+};
+
+/**
+ * @brief Gather a chain of buffers in one contiguous buffer and hand it to a function.
+ *        No copy is made if the chain has a single segment.
+ * 
+ * @param chain The chain to gather
+ * @param allocator The allocator of the contiguous buffer
+ * @param site The call site of the allocation
+ * @param func The function to call with the contiguous buffer (const IBuffer&)
+ * @return false if the contiguous buffer could not be allocated (@p func is not called), true otherwise
+ */
+template<typename Allocator, typename Func>
+bool gatherChain(const IBufferChain& chain, const Allocator& allocator, AllocationSite site, Func&& func) {
+    if(chain.getNbSegments() == 1) {
+        func(static_cast<const IBuffer&>(chain.getSegment(0)));
+        return true;
+    }
+
+    UserBuffer contiguous = allocator.allocateBuffer(chain.getSize(), site);
+    if(contiguous.getStart() == nullptr) {
+        return false;
+    }
+
+    chain.copyTo(contiguous);
+    func(static_cast<const IBuffer&>(contiguous));
+    allocator.deallocateBuffer(contiguous, site);
+    return true;
+}
+
+#endif //BUFFERCHAIN_HPP
@@ -0,0 +1,29 @@
+/**************************************************************************//**
+ * @file clock.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains clocks used to timestamp events
+ * 
+ ******************************************************************************/
+#ifndef CLOCK_HPP
+#define CLOCK_HPP
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief Clock that never goes back, unaffected by changes of the system time. Classes that need
+ *        the time take the clock as template parameter, so it can be replaced (e.g by a simulated
+ *        clock); a clock only needs a static now() function.
+ */
+struct MonotonicClock {
+    /**
+     * @return The current time, in nanoseconds since an unspecified point in the past
+     */
+    static uint64_t now() {
+        auto elapsed = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+#endif //CLOCK_HPP
@@ -9,6 +9,9 @@
 #define COMMUNICATIONLAYER_HPP
 
 #include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
+#include "utils/allocator.hpp"
+#include "utils/span.hpp"
 
 /**
  * @brief 
@@ -34,10 +37,75 @@ protected:
         }
     }
 
+    /**
+     * @brief Push many buffers to the upper layer at once (e.g all the packets read by a single
+     *        system call, or extracted from a single frame)
+     * 
+     * @param batch The buffers, in reception order
+     */
+    void pushBatchToUpperLayer(Span<const UserBuffer> batch) {
+        if(upper != nullptr) {
+            upper->receiveBatchFromSubLayer(batch);
+        }
+    }
+
+    void pushToUpperLayer(const IBufferChain& chain) {
+        if(upper != nullptr) {
+            upper->receiveChainFromSubLayer(chain);
+        }
+    }
+
+    void pushToSubLayer(const IBufferChain& chain) {
+        if(lower != nullptr) {
+            lower->receiveChainFromUpperLayer(chain);
+        }
+    }
+
+    /**
+     * @brief Gather a chain of buffers in one contiguous buffer and hand it to a function.
+     *        @see{gatherChain}
+     * 
+     * @param chain The chain to gather
+     * @param func The function to call with the contiguous buffer (const IBuffer&)
+     */
+    template<typename Func>
+    static void withContiguous(const IBufferChain& chain, Func&& func) {
+        gatherChain(chain, DefaultAllocator(), ALLOC_SITE_UNKNOWN, std::forward<Func>(func));
+    }
+
 private:
     virtual void receiveFromSubLayer(const IBuffer& bytes) = 0;
     virtual void receiveFromUpperLayer(const IBuffer& bytes) = 0;
 
+    /**
+     * @brief Receive a chain of buffers from the sub-layer. By default, the chain is gathered
+     *        in a contiguous buffer and given to receiveFromSubLayer().
+     */
+    virtual void receiveChainFromSubLayer(const IBufferChain& chain) {
+        withContiguous(chain, [this](const IBuffer& bytes) { this->receiveFromSubLayer(bytes); });
+    }
+
+    /**
+     * @brief Receive many buffers from the sub-layer at once. By default, the buffers are given one
+     *        by one to receiveFromSubLayer(). Layers that can amortize work over many buffers should
+     *        override this.
+     */
+    virtual void receiveBatchFromSubLayer(Span<const UserBuffer> batch) {
+        for(const UserBuffer& bytes : batch) {
+            this->receiveFromSubLayer(bytes);
+        }
+    }
+
+    /**
+     * @brief Receive a chain of buffers from the upper layer. By default, the chain is gathered
+     *        in a contiguous buffer and given to receiveFromUpperLayer(). Sub-layers that can
+     *        send scattered memory (e.g with writev(), @see{IBufferChain::toIoVec}) should
+     *        override this to avoid the copy.
+     */
+    virtual void receiveChainFromUpperLayer(const IBufferChain& chain) {
+        withContiguous(chain, [this](const IBuffer& bytes) { this->receiveFromUpperLayer(bytes); });
+    }
+
     ICommunicationLayer* upper = nullptr;
     ICommunicationLayer* lower = nullptr;
 };
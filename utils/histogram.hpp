@@ -0,0 +1,135 @@
+/**************************************************************************//**
+ * @file histogram.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a histogram with power of 2 buckets, that can be updated
+ *        and read from many threads
+ * 
+ ******************************************************************************/
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Histogram of values (durations, sizes, rates...) whose bucket #n counts the values in
+ *        [2^(n-1), 2^n[, bucket #0 counting the zeros. Values too large for the last bucket are
+ *        counted in it.
+ * 
+ * @details Every bucket is a relaxed atomic: recording a value is a single fetch_add, and a
+ *          monitoring thread can read the buckets while values are recorded. The buckets read
+ *          are then each exact, but not necessarily all from the same instant.
+ */
+class Log2Histogram
+{
+public:
+    enum {
+        /** Amount of buckets, enough for durations up to ~2^47 ns (about 39 hours) */
+        NB_BUCKETS = 48
+    };
+
+    Log2Histogram() = default;
+    Log2Histogram(const Log2Histogram& other) = delete;
+    Log2Histogram& operator=(const Log2Histogram& other) = delete;
+
+    /**
+     * @brief Record a value
+     * 
+     * @param value The value
+     * @param nb_times The amount of times the value is recorded
+     */
+    void record(uint64_t value, uint64_t nb_times = 1) {
+        buckets[getBucket(value)].fetch_add(nb_times, std::memory_order_relaxed);
+    }
+
+    /**
+     * @param bucket The bucket index, lower than NB_BUCKETS
+     * @return The amount of values recorded in the bucket
+     */
+    uint64_t getCount(std::size_t bucket) const {
+        if(bucket >= NB_BUCKETS) {
+            return 0;
+        }
+        return buckets[bucket].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return The amount of values recorded, all buckets combined
+     */
+    uint64_t getTotal() const {
+        uint64_t total = 0;
+        for(std::size_t i = 0; i < NB_BUCKETS; i++) {
+            total += buckets[i].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /**
+     * @brief Get an upper bound of a quantile of the values (e.g 0.5 for the median, 0.99 for
+     *        the 99th percentile)
+     * 
+     * @param quantile The quantile, in [0, 1]
+     * @return The upper bound of the bucket holding the quantile, 0 if no value was recorded
+     */
+    uint64_t getQuantile(double quantile) const {
+        uint64_t total = this->getTotal();
+        if(total == 0) {
+            return 0;
+        }
+
+        uint64_t rank = static_cast<uint64_t>(quantile * static_cast<double>(total));
+        uint64_t seen = 0;
+        for(std::size_t i = 0; i < NB_BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if(seen > rank) {
+                return getUpperBound(i);
+            }
+        }
+        return getUpperBound(NB_BUCKETS - 1);
+    }
+
+    /**
+     * @param bucket The bucket index, lower than NB_BUCKETS
+     * @return The smallest value counted in the bucket
+     */
+    static uint64_t getLowerBound(std::size_t bucket) {
+        return bucket == 0 ? 0 : uint64_t(1) << (bucket - 1);
+    }
+
+    /**
+     * @param bucket The bucket index, lower than NB_BUCKETS
+     * @return The largest value counted in the bucket (values of the last bucket may be larger)
+     */
+    static uint64_t getUpperBound(std::size_t bucket) {
+        return bucket == 0 ? 0 : (uint64_t(1) << bucket) - 1;
+    }
+
+    /**
+     * @brief Set every bucket to 0. Values recorded at the same time may be lost.
+     */
+    void reset() {
+        for(std::size_t i = 0; i < NB_BUCKETS; i++) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static std::size_t getBucket(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        std::size_t bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+#else
+        std::size_t bucket = 0;
+        while(value != 0) {
+            value >>= 1;
+            bucket++;
+        }
+#endif
+        return bucket < NB_BUCKETS ? bucket : NB_BUCKETS - 1;
+    }
+
+    std::atomic<uint64_t> buckets[NB_BUCKETS] = {};
+};
+
+#endif //HISTOGRAM_HPP
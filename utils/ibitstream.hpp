@@ -10,6 +10,7 @@
 
 #include "utils/bitmask.hpp"
 #include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
 #include <cstdint>
 #include <climits>
 #include <iostream>
@@ -23,7 +24,8 @@
  *          can cause the stream's badbit to be raised, in which case the stream is not usable anymore and 
  *          cannot be recovered, unless the user attaches a new buffer. Illegal operations do no throw
  *          exceptions, it is the responsibility of the user to make sure that the stream functions
- *          correctly.
+ *          correctly. The underlying memory can also be a chain of buffers (@see{IBufferChain}), in
+ *          which case the segments are read one after the other as if they were contiguous.
  */
 class IBitStream
 {
@@ -33,7 +35,7 @@ public:
      *        is not usable by default (bad bit is set).
      */
     IBitStream()
-    : cur_buffer(nullptr), cur_bit_offset(0), bad_bit(true) {
+    : cur_buffer(nullptr), cur_chain(nullptr), cur_bit_offset(0), bad_bit(true) {
 
     }
 
@@ -43,7 +45,17 @@ public:
      * @param buf The buffer from which this stream should decode information
      */
     IBitStream(const IBuffer& buf)
-    : cur_buffer(&buf), cur_bit_offset(0), bad_bit(false) {
+    : cur_buffer(&buf), cur_chain(nullptr), cur_bit_offset(0), bad_bit(false) {
+
+    }
+
+    /**
+     * @brief Construct an InputBitStream with an underlying chain of buffers.
+     * 
+     * @param chain The chain from which this stream should decode information
+     */
+    IBitStream(const IBufferChain& chain)
+    : cur_buffer(nullptr), cur_chain(&chain), cur_bit_offset(0), bad_bit(false) {
 
     }
 
@@ -55,6 +67,22 @@ public:
      */
     void attach(const IBuffer& buf) {
         cur_buffer = &buf; 
+        cur_chain = nullptr;
+        cur_bit_offset = 0;
+        bad_bit = false;
+    }
+
+    /**
+     * @brief Change the underlying memory of this InputBitStream for a chain of buffers. 
+     * @note: This operation resets the stream to bit offset 0
+     * 
+     * @param chain The new chain from which this stream should decode information
+     */
+    void attach(const IBufferChain& chain) {
+        cur_buffer = nullptr;
+        cur_chain = &chain;
+        chain_seg = 0;
+        chain_seg_start = 0;
         cur_bit_offset = 0;
         bad_bit = false;
     }
@@ -80,17 +108,13 @@ public:
             return;
         }
 
-        if(cur_buffer == nullptr) {
+        if(cur_buffer == nullptr && cur_chain == nullptr) {
             bad_bit = true;
             return;
         }
-        
-        const IBuffer& buffer = *cur_buffer;
-        std::size_t current_byte_i = this->cur_bit_offset / CHAR_BIT;
-        uint8_t* current_byte = buffer.getStart() + current_byte_i;
 
         if(width > sizeof(T)*CHAR_BIT ||
-           width > buffer.getSize()*CHAR_BIT - cur_bit_offset) {
+           width > this->getMaxSize()*CHAR_BIT - cur_bit_offset) {
             //invalid operation, can't get more bits than the amount given
             bad_bit = true;
             return;
@@ -100,6 +124,8 @@ public:
         t = 0;
         
         while(width > 0) {
+            const uint8_t* current_byte = this->getByte(cur_bit_offset / CHAR_BIT);
+
             // index in the current byte we should be reading from
             uint8_t bit_index = CHAR_BIT - (cur_bit_offset % CHAR_BIT);
 
@@ -111,7 +137,6 @@ public:
             t <<= nbBitsToGet; 
             t |= value;
 
-            current_byte++;
             width          -= nbBitsToGet;
             cur_bit_offset += nbBitsToGet;
         }
@@ -136,10 +161,12 @@ public:
      * @return The maximum amount of bytes that can be read from the underlying buffer
      */ 
     std::size_t getMaxSize() const {
-        if(cur_buffer == nullptr) {
-            return 0;
-        } else {
+        if(cur_buffer != nullptr) {
             return cur_buffer->getSize();
+        } else if(cur_chain != nullptr) {
+            return cur_chain->getSize();
+        } else {
+            return 0;
         }
     }
 
@@ -169,8 +196,37 @@ public:
 
 private:
 
+    /**
+     * @brief Get the address of a byte of the underlying memory
+     * 
+     * @param byte_i The index of the byte, lower than getMaxSize()
+     * @return The address of the byte
+     */
+    const uint8_t* getByte(std::size_t byte_i) {
+        if(cur_buffer != nullptr) {
+            return cur_buffer->getStart() + byte_i;
+        }
+
+        // reads go forward, so the search starts from the segment of the last byte read
+        if(byte_i < chain_seg_start) {
+            chain_seg = 0;
+            chain_seg_start = 0;
+        }
+        while(byte_i >= chain_seg_start + cur_chain->getSegment(chain_seg).getSize()) {
+            chain_seg_start += cur_chain->getSegment(chain_seg).getSize();
+            chain_seg++;
+        }
+        return cur_chain->getSegment(chain_seg).getStart() + (byte_i - chain_seg_start);
+    }
+
     /** The underlying buffer this stream is currently attached to */
     const IBuffer* cur_buffer;
+    /** The underlying chain of buffers this stream is currently attached to (if no buffer) */
+    const IBufferChain* cur_chain;
+    /** Index of the chain segment that contains the last byte read */
+    std::size_t chain_seg = 0;
+    /** Byte offset of the beginning of that segment, in the chain */
+    std::size_t chain_seg_start = 0;
     /** The current bit offset (where we are in the buffer) */
     std::size_t cur_bit_offset;
     /** The state bit of the stream */
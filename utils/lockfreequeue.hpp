@@ -0,0 +1,172 @@
+/**************************************************************************//**
+ * @file lockfreequeue.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a bounded lock-free queue, for handing items between threads
+ * 
+ ******************************************************************************/
+#ifndef LOCKFREEQUEUE_HPP
+#define LOCKFREEQUEUE_HPP
+
+#include "utils/allocator.hpp"
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+/**
+ * @brief Bounded queue with many producers and many consumers, that never takes a lock.
+ * 
+ * @details Every cell of the ring has a sequence number telling if it is ready to be written
+ *          (sequence == position) or read (sequence == position + 1). Producers and consumers
+ *          claim a position with a compare-and-swap on their own index, then only touch their
+ *          cell, so a producer and a consumer contend only when the queue is empty or full.
+ *          The memory of the queue is allocated once, when constructed.
+ * 
+ * @tparam T The type of the items. Must be trivially copyable.
+ * @tparam Allocator The allocator used for the queue memory. @see{isAllocator}
+ */
+template<typename T, typename Allocator = DefaultAllocator>
+class LockFreeQueue : private AllocatorHolder<Allocator>
+{
+    static_assert(std::is_trivially_copyable<T>::value, "Items of the queue must be trivially copyable");
+public:
+    /**
+     * @brief Construct a new LockFreeQueue object
+     * 
+     * @param capacity The minimum amount of items in the queue, rounded up to a power of 2
+     * @param site The call site reported to the allocator
+     * @param alloc The allocator to use for the queue memory
+     */
+    LockFreeQueue(std::size_t capacity, AllocationSite site = ALLOC_SITE_UNKNOWN, const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), site(site) {
+        std::size_t rounded = 1;
+        while(rounded < capacity) {
+            rounded <<= 1;
+        }
+
+        memory = this->getAllocator().allocateBuffer(rounded * sizeof(Cell), site);
+        cells = reinterpret_cast<Cell*>(memory.getStart());
+        if(cells == nullptr) {
+            return;
+        }
+
+        mask = rounded - 1;
+        for(std::size_t i = 0; i < rounded; i++) {
+            new (&cells[i].sequence) std::atomic<std::size_t>(i);
+        }
+    }
+
+    LockFreeQueue(const LockFreeQueue& other) = delete;
+    LockFreeQueue& operator=(const LockFreeQueue& other) = delete;
+
+    ~LockFreeQueue() {
+        this->getAllocator().deallocateBuffer(memory, site);
+    }
+
+    /**
+     * @brief Add an item at the end of the queue
+     * 
+     * @param item The item
+     * @return false if the queue is full, true otherwise
+     */
+    bool tryPush(const T& item) {
+        if(cells == nullptr) {
+            return false;
+        }
+
+        std::size_t pos = tail.load(std::memory_order_relaxed);
+        while(true) {
+            Cell& cell = cells[pos & mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+            if(diff == 0) {
+                // the cell is free, try to claim the position
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.item = item;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                // the cell still holds an item from the previous lap
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @brief Remove the item at the beginning of the queue
+     * 
+     * @param item The item removed
+     * @return false if the queue is empty, true otherwise
+     */
+    bool tryPop(T& item) {
+        if(cells == nullptr) {
+            return false;
+        }
+
+        std::size_t pos = head.load(std::memory_order_relaxed);
+        while(true) {
+            Cell& cell = cells[pos & mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+
+            if(diff == 0) {
+                // the cell holds an item, try to claim the position
+                if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = cell.item;
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                // the cell was not written yet
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @return The maximum amount of items in the queue
+     */
+    std::size_t getCapacity() const {
+        return cells != nullptr ? mask + 1 : 0;
+    }
+
+    /**
+     * @return An approximation of the amount of items in the queue, exact if no other thread
+     *         is using the queue
+     */
+    std::size_t getSize() const {
+        std::size_t pushed = tail.load(std::memory_order_relaxed);
+        std::size_t popped = head.load(std::memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T item;
+    };
+
+    /** The call site reported to the allocator */
+    const AllocationSite site;
+    /** The memory of the ring */
+    UserBuffer memory;
+    Cell* cells = nullptr;
+    /** Capacity - 1, to wrap the positions */
+    std::size_t mask = 0;
+
+    /** Next position to read */
+    std::atomic<std::size_t> head{0};
+    /** Keeps the producers and consumers indexes on different cache lines */
+    uint8_t padding[64 - sizeof(std::atomic<std::size_t>)];
+    /** Next position to write */
+    std::atomic<std::size_t> tail{0};
+};
+
+#endif //LOCKFREEQUEUE_HPP
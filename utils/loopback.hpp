@@ -0,0 +1,87 @@
+/**************************************************************************//**
+ * @file loopback.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a sub-layer that sends back up what it is given to transmit
+ * 
+ ******************************************************************************/
+#ifndef LOOPBACK_HPP
+#define LOOPBACK_HPP
+
+#include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
+#include "utils/commlayer.hpp"
+
+/**
+ * @brief Sub-layer that pushes whatever its upper layer transmits straight back up, in the same
+ *        thread: to its own upper layer, or to the upper layer of a peer loopback. Meant to run a
+ *        stack end to end on one machine (benchmarks, tests), without a link.
+ * @code
+ *          // a service receiving what it transmits
+ *          LoopbackLayer self_link;
+ *          self_link.connectUpperLayer(service);
+ * 
+ *          // ground -> flight, and back
+ *          LoopbackLayer ground_link, flight_link;
+ *          ground_link.connectUpperLayer(ground_service);
+ *          flight_link.connectUpperLayer(flight_service);
+ *          ground_link.connectPeer(flight_link);
+ * @endcode
+ * 
+ * @details A SpTransferService keeps the sequence counts it receives apart from the ones it transmits:
+ *          looped back to itself, it accepts its own spacepackets, and its listeners see each of them
+ *          twice (once transmitted, once received).
+ */
+class LoopbackLayer : public ICommunicationLayer
+{
+public:
+    LoopbackLayer() = default;
+    LoopbackLayer(const LoopbackLayer& other) = delete;
+    LoopbackLayer& operator=(const LoopbackLayer& other) = delete;
+
+    ~LoopbackLayer() {
+        this->disconnectPeer();
+    }
+
+    /**
+     * @brief Send what is transmitted through this loopback to the upper layer of another one, and
+     *        the other way around
+     * 
+     * @param other The peer loopback
+     */
+    void connectPeer(LoopbackLayer& other) {
+        this->peer = &other;
+        other.peer = this;
+    }
+
+    /**
+     * @brief Send back what is transmitted to the upper layer of this loopback, in both loopbacks
+     *        if it had a peer
+     */
+    void disconnectPeer() {
+        if(this->peer != nullptr) {
+            this->peer->peer = nullptr;
+            this->peer = nullptr;
+        }
+    }
+
+private:
+    void receiveFromUpperLayer(const IBuffer& bytes) override {
+        LoopbackLayer* destination = (peer != nullptr) ? peer : this;
+        destination->pushToUpperLayer(bytes);
+    }
+
+    void receiveChainFromUpperLayer(const IBufferChain& chain) override {
+        LoopbackLayer* destination = (peer != nullptr) ? peer : this;
+        destination->pushToUpperLayer(chain);
+    }
+
+    void receiveFromSubLayer(const IBuffer& bytes) override {
+        this->pushToUpperLayer(bytes);
+    }
+
+    /** The loopback whose upper layer receives what is transmitted, nullptr for this one */
+    LoopbackLayer* peer = nullptr;
+};
+
+#endif //LOOPBACK_HPP
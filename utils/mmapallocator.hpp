@@ -0,0 +1,210 @@
+/**************************************************************************//**
+ * @file mmapallocator.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains an allocator that maps memory directly from the operating
+ *        system, with optional huge page support
+ * 
+ ******************************************************************************/
+#ifndef MMAPALLOCATOR_HPP
+#define MMAPALLOCATOR_HPP
+
+#include "utils/allocator.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * @brief Options of the MmapAllocator. They can be combined with a bitwise OR.
+ */
+enum MmapAllocatorOptions : unsigned int {
+    /** Plain anonymous mapping on regular pages */
+    MMAP_NONE       = 0,
+    /** Request explicit huge pages (MAP_HUGETLB). Falls back on regular pages if none are available */
+    MMAP_HUGETLB    = 1U << 0,
+    /** Advise the kernel to back the mapping with transparent huge pages (MADV_HUGEPAGE) */
+    MMAP_THP        = 1U << 1,
+    /** Pre-fault the whole mapping at allocation time, after the huge page advice */
+    MMAP_POPULATE   = 1U << 2,
+};
+
+/**
+ * @brief Allocator that obtains its memory from anonymous mmap() mappings instead of the heap.
+ * 
+ * @details Meant for large, long-lived memory sections (packet stores, replay buffers, etc.) where
+ *          TLB misses and page faults at startup matter. Every allocation is its own mapping, so
+ *          small allocations waste at least a page : use the DefaultAllocator for those.
+ * 
+ *          When MMAP_HUGETLB is requested, the size of the mapping is rounded up to a multiple of
+ *          the huge page size: @p HugePageSize if given (the mapping then asks the kernel for that
+ *          size with MAP_HUGE_SHIFT, and fails over if the system has no such pages), or the default
+ *          huge page size of the system (read once from /proc/meminfo). If the system has no huge page
+ *          available, the mapping is silently retried on regular pages (with the same rounded size, so
+ *          deallocate() does not need to know which kind of mapping was obtained).
+ * 
+ *          A regular mapping is advised (MMAP_THP) before it is pre-faulted (MMAP_POPULATE, with
+ *          MADV_POPULATE_WRITE or by touching each page), so that the pre-faulted memory is backed by
+ *          transparent huge pages. The allocator is stateless; wrap it in an AllocatorAdapter where
+ *          an IAllocator is expected.
+ * @code
+ *          // huge pages of the system, pre-faulted at allocation
+ *          using StoreAllocator = MmapAllocator<MMAP_HUGETLB | MMAP_POPULATE>;
+ *          // 1 GiB huge pages
+ *          using ArchiveAllocator = MmapAllocator<MMAP_HUGETLB, 1024U * 1024U * 1024U>;
+ * @endcode
+ * 
+ * @tparam Options A combination of MmapAllocatorOptions
+ * @tparam HugePageSize The size (in bytes) of the huge pages to map, 0 for the default of the system
+ */
+template<unsigned int Options = MMAP_THP,
+         std::size_t HugePageSize = 0>
+class MmapAllocator : public AllocatorBase<MmapAllocator<Options, HugePageSize>>
+{
+    static_assert((HugePageSize & (HugePageSize - 1)) == 0, "Huge page size must be a power of two");
+public:
+    using typename AllocatorBase<MmapAllocator<Options, HugePageSize>>::pointer;
+    using typename AllocatorBase<MmapAllocator<Options, HugePageSize>>::size_type;
+
+    pointer allocate(size_type nb_bytes) const {
+        if(nb_bytes == 0) {
+            return nullptr;
+        }
+
+        const size_type mapping_size = getMappingSize(nb_bytes);
+        const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        void* mapping = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+        if(Options & MMAP_HUGETLB) {
+            // huge pages are faulted in as huge pages: they can be populated by the mapping itself
+            int huge_flags = flags | MAP_HUGETLB | getHugePageFlags();
+#if defined(MAP_POPULATE)
+            if(Options & MMAP_POPULATE) {
+                huge_flags |= MAP_POPULATE;
+            }
+#endif
+            mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, huge_flags, -1, 0);
+        }
+#endif
+
+        if(mapping == MAP_FAILED) {
+            // no huge pages reserved on the system (or not requested), use regular pages
+            mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if(mapping == MAP_FAILED) {
+                return nullptr;
+            }
+
+#if defined(MADV_HUGEPAGE)
+            if(Options & MMAP_THP) {
+                // only an advice, the mapping is usable even if it is refused
+                (void)madvise(mapping, mapping_size, MADV_HUGEPAGE);
+            }
+#endif
+            if(Options & MMAP_POPULATE) {
+                populate(static_cast<pointer>(mapping), mapping_size);
+            }
+        }
+
+        return static_cast<pointer>(mapping);
+    }
+
+    void deallocate(pointer bytes, size_type nb_bytes) const noexcept {
+        if(bytes == nullptr || nb_bytes == 0) {
+            return;
+        }
+
+        munmap(bytes, getMappingSize(nb_bytes));
+    }
+
+    /**
+     * @brief Get the size of the mapping that backs an allocation of a given amount of bytes
+     * 
+     * @param nb_bytes The amount of bytes requested
+     * @return The size (in bytes) of the mapping
+     */
+    static size_type getMappingSize(size_type nb_bytes) {
+        if(Options & MMAP_HUGETLB) {
+            const size_type page_size = getHugePageSize();
+            return (nb_bytes + page_size - 1) & ~(page_size - 1);
+        } else {
+            return nb_bytes;
+        }
+    }
+
+    /**
+     * @return The size (in bytes) of the huge pages mapped: @p HugePageSize, or the default huge page
+     *         size of the system (2 MiB if it cannot be read)
+     */
+    static size_type getHugePageSize() {
+        static const size_type page_size = (HugePageSize != 0) ? HugePageSize : readSystemHugePageSize();
+        return page_size;
+    }
+
+private:
+    enum : size_type {
+        /** Huge page size assumed when the system does not tell it */
+        FALLBACK_HUGE_PAGE_SIZE = 2U * 1024U * 1024U,
+    };
+
+    /**
+     * @return The "Hugepagesize" of /proc/meminfo, in bytes
+     */
+    static size_type readSystemHugePageSize() {
+        std::FILE* meminfo = std::fopen("/proc/meminfo", "r");
+        if(meminfo == nullptr) {
+            return FALLBACK_HUGE_PAGE_SIZE;
+        }
+
+        size_type page_size = FALLBACK_HUGE_PAGE_SIZE;
+        char line[128];
+        unsigned long size_kb = 0;
+        while(std::fgets(line, sizeof(line), meminfo) != nullptr) {
+            if(std::sscanf(line, "Hugepagesize: %lu kB", &size_kb) == 1) {
+                if(size_kb > 0 && (size_kb & (size_kb - 1)) == 0) {
+                    page_size = static_cast<size_type>(size_kb) * 1024U;
+                }
+                break;
+            }
+        }
+        std::fclose(meminfo);
+        return page_size;
+    }
+
+    /**
+     * @return The MAP_HUGE_SHIFT flags asking for @p HugePageSize pages, 0 for the default size
+     */
+    static int getHugePageFlags() {
+#if defined(MAP_HUGE_SHIFT)
+        if(HugePageSize != 0) {
+            int log2_size = 0;
+            while((size_type(1) << log2_size) < HugePageSize) {
+                log2_size++;
+            }
+            return log2_size << MAP_HUGE_SHIFT;
+        }
+#endif
+        return 0;
+    }
+
+    /**
+     * @brief Fault in every page of a regular mapping, once it has been advised
+     */
+    static void populate(pointer mapping, size_type mapping_size) {
+#if defined(MADV_POPULATE_WRITE)
+        if(madvise(mapping, mapping_size, MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+#endif
+        // older kernels: write a byte in each page (a fresh anonymous mapping is zeroed)
+        long page_size = sysconf(_SC_PAGESIZE);
+        size_type step = (page_size > 0) ? static_cast<size_type>(page_size) : 4096U;
+        volatile uint8_t* bytes = mapping;
+        for(size_type offset = 0; offset < mapping_size; offset += step) {
+            bytes[offset] = 0;
+        }
+    }
+};
+
+#endif // MMAPALLOCATOR_HPP
@@ -9,6 +9,7 @@
 #define OBITSTREAM_HPP
 
 #include "utils/buffer.hpp"
+#include "utils/bufferchain.hpp"
 #include "utils/bitmask.hpp"
 #include <cstdint>
 #include <climits>
@@ -25,7 +26,8 @@
  *          can cause the stream's badbit to be raised, in which case the stream is not usable anymore and 
  *          cannot be recovered, unless the user attaches a new buffer. Illegal operations do no throw
  *          exceptions, it is the responsibility of the user to make sure that the stream functions
- *          correctly.
+ *          correctly. The underlying memory can also be a chain of buffers (@see{IBufferChain}), in
+ *          which case the segments are written one after the other as if they were contiguous.
  */
 class OBitStream
 {
@@ -35,7 +37,7 @@ public:
      *        is not usable by default (bad bit is set).
      */
     OBitStream()
-    : cur_buffer(nullptr), cur_bit_offset(0), bad_bit(true) {
+    : cur_buffer(nullptr), cur_chain(nullptr), cur_bit_offset(0), bad_bit(true) {
 
     }
 
@@ -45,7 +47,17 @@ public:
      * @param buf The buffer to which this stream should encode information
      */
     OBitStream(IBuffer& buf)
-    : cur_buffer(&buf), cur_bit_offset(0), bad_bit(false) {
+    : cur_buffer(&buf), cur_chain(nullptr), cur_bit_offset(0), bad_bit(false) {
+
+    }
+
+    /**
+     * @brief Construct an OutputBitStream with an underlying chain of buffers.
+     * 
+     * @param chain The chain to which this stream should encode information
+     */
+    OBitStream(IBufferChain& chain)
+    : cur_buffer(nullptr), cur_chain(&chain), cur_bit_offset(0), bad_bit(false) {
 
     }
 
@@ -57,10 +69,59 @@ public:
      */
     void attach(IBuffer& buf) {
         cur_buffer = &buf;
+        cur_chain = nullptr;
+        cur_bit_offset = 0;
+        bad_bit = false;
+    }
+
+    /**
+     * @brief Change the underlying memory of this OutputBitStream for a chain of buffers. 
+     * @note: This operation resets the stream to bit offset 0
+     * 
+     * @param chain The new chain to which this stream should encode information
+     */
+    void attach(IBufferChain& chain) {
+        cur_buffer = nullptr;
+        cur_chain = &chain;
+        chain_seg = 0;
+        chain_seg_start = 0;
         cur_bit_offset = 0;
         bad_bit = false;
     }
 
+    /**
+     * @brief Go back to the beginning of the underlying buffer, so it can be written again.
+     *        The content of the buffer is left untouched.
+     * @note: This operation clears the bad bit if a buffer is attached
+     */
+    void rewind() {
+        cur_bit_offset = 0;
+        chain_seg = 0;
+        chain_seg_start = 0;
+        bad_bit = (cur_buffer == nullptr && cur_chain == nullptr);
+    }
+
+    /**
+     * @brief Move forward in the underlying buffer without writing. The bits skipped keep their
+     *        current value.
+     * 
+     * @param width The amount of bits to skip
+     */
+    void skip(std::size_t width) {
+        if(bad_bit) {
+            //invalid operation, can't use a bad stream
+            return;
+        }
+
+        if(width > this->getMaxSize()*CHAR_BIT - cur_bit_offset) {
+            //invalid operation, can't skip past the end of the buffer
+            bad_bit = true;
+            return;
+        }
+
+        cur_bit_offset += width;
+    }
+
     /**
      * @brief Put an amount of bits in the underlying buffer.
      * @note The value put in the buffer are the least significant bits of @p t
@@ -82,23 +143,21 @@ public:
             return;
         }
 
-        if(cur_buffer == nullptr) {
+        if(cur_buffer == nullptr && cur_chain == nullptr) {
             bad_bit = true;
             return;
         }
 
-        IBuffer& buffer = *cur_buffer;
-        std::size_t current_byte_i = this->cur_bit_offset / CHAR_BIT;
-        uint8_t* current_byte = buffer.getStart() + current_byte_i;
-
         if(width > sizeof(T)*CHAR_BIT || 
-           width > buffer.getSize()*CHAR_BIT - cur_bit_offset) {
+           width > this->getMaxSize()*CHAR_BIT - cur_bit_offset) {
             //invalid operation, can't put any more bits
             bad_bit = true;
             return;
         }
 
         while(width > 0) {
+            uint8_t* current_byte = this->getByte(cur_bit_offset / CHAR_BIT);
+
             // index in the current byte we should be writing from
             uint8_t bit_index = CHAR_BIT - (cur_bit_offset % CHAR_BIT);
 
@@ -115,7 +174,6 @@ public:
             uint8_t shift = bit_index - nbBitsToAdd;
             *current_byte |= (value << shift);
 
-            current_byte++;
             width          -= nbBitsToAdd;
             cur_bit_offset += nbBitsToAdd;
         }
@@ -140,10 +198,12 @@ public:
      * @return The maximum amount of bytes that can be written to the underlying buffer
      */ 
     std::size_t getMaxSize() const {
-        if(cur_buffer == nullptr) {
-            return 0;
-        } else {
+        if(cur_buffer != nullptr) {
             return cur_buffer->getSize();
+        } else if(cur_chain != nullptr) {
+            return cur_chain->getSize();
+        } else {
+            return 0;
         }
     }
 
@@ -167,8 +227,8 @@ public:
 
         // can't transfer an out stream into itself
         if(&out == &other || 
-            out.cur_buffer == nullptr ||
-            other.cur_buffer == nullptr) {
+            out.getMaxSize() == 0 ||
+            other.getMaxSize() == 0) {
             out.bad_bit = true;
         } else {
             //append to this stream
@@ -176,12 +236,12 @@ public:
             std::size_t nb_bits       = other.cur_bit_offset % CHAR_BIT;
             
             for(std::size_t i = 0; i < nb_full_bytes; i++) {
-                out.put(*(other.cur_buffer->getStart() + i), CHAR_BIT);
+                out.put(*other.getByte(i), CHAR_BIT);
             }
 
             //might have remainder bits
             if(nb_bits > 0) {
-                out.put(*(other.cur_buffer->getStart() + nb_full_bytes), nb_bits);
+                out.put(*other.getByte(nb_full_bytes) >> (CHAR_BIT - nb_bits), nb_bits);
             }
         }
         return out;
@@ -205,8 +265,37 @@ public:
 
 private:
 
+    /**
+     * @brief Get the address of a byte of the underlying memory
+     * 
+     * @param byte_i The index of the byte, lower than getMaxSize()
+     * @return The address of the byte
+     */
+    uint8_t* getByte(std::size_t byte_i) const {
+        if(cur_buffer != nullptr) {
+            return cur_buffer->getStart() + byte_i;
+        }
+
+        // writes go forward, so the search starts from the segment of the last byte written
+        if(byte_i < chain_seg_start) {
+            chain_seg = 0;
+            chain_seg_start = 0;
+        }
+        while(byte_i >= chain_seg_start + cur_chain->getSegment(chain_seg).getSize()) {
+            chain_seg_start += cur_chain->getSegment(chain_seg).getSize();
+            chain_seg++;
+        }
+        return cur_chain->getSegment(chain_seg).getStart() + (byte_i - chain_seg_start);
+    }
+
     /** The underlying buffer this stream is currently attached to */
     IBuffer* cur_buffer;
+    /** The underlying chain of buffers this stream is currently attached to (if no buffer) */
+    IBufferChain* cur_chain;
+    /** Index of the chain segment that contains the last byte written */
+    mutable std::size_t chain_seg = 0;
+    /** Byte offset of the beginning of that segment, in the chain */
+    mutable std::size_t chain_seg_start = 0;
     /** The current bit offset (where we are in the buffer) */
     std::size_t cur_bit_offset;
     /** The state bit of the stream */
@@ -0,0 +1,110 @@
+/**************************************************************************//**
+ * @file span.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a class representing a view over contiguous objects
+ * 
+ ******************************************************************************/
+#ifndef SPAN_HPP
+#define SPAN_HPP
+
+#include <cstddef>
+
+/**
+ * @brief View over a contiguous sequence of objects held by someone else (like std::span in C++20).
+ *        Spans are cheap to copy and never own the objects they refer to.
+ * @code
+ *          UserBuffer packets[16];
+ *          std::size_t nb_packets = receiveMany(packets, 16);
+ *          Span<const UserBuffer> batch(packets, nb_packets);
+ *          for(const UserBuffer& packet : batch) { ... }
+ * @endcode
+ * 
+ * @tparam T The type of the objects
+ */
+template<typename T>
+class Span
+{
+public:
+    Span() = default;
+
+    /**
+     * @brief Construct a new Span object
+     * 
+     * @param data The first object
+     * @param size The amount of objects
+     */
+    Span(T* data, std::size_t size) : data(data), size(size) {}
+
+    /**
+     * @brief Construct a new Span object over a whole array
+     * 
+     * @param array The array
+     */
+    template<std::size_t N>
+    Span(T (&array)[N]) : data(array), size(N) {}
+
+    /**
+     * @brief Construct a span of const objects from a span of the same, non-const, objects
+     */
+    template<typename U>
+    Span(const Span<U>& other) : data(other.getData()), size(other.getSize()) {}
+
+    /**
+     * @return The first object
+     */
+    T* getData() const {
+        return data;
+    }
+
+    /**
+     * @return The amount of objects
+     */
+    std::size_t getSize() const {
+        return size;
+    }
+
+    /**
+     * @return true if the span has no object, false otherwise
+     */
+    bool isEmpty() const {
+        return size == 0;
+    }
+
+    T& operator[](std::size_t index) const {
+        return data[index];
+    }
+
+    /**
+     * @brief Get a view over a part of this span
+     * 
+     * @param offset The index of the first object of the part
+     * @param count The maximum amount of objects of the part
+     * @return The part, shorter than @p count if this span ends before
+     */
+    Span subspan(std::size_t offset, std::size_t count) const {
+        if(offset > size) {
+            offset = size;
+        }
+        if(count > size - offset) {
+            count = size - offset;
+        }
+        return Span(data + offset, count);
+    }
+
+    T* begin() const {
+        return data;
+    }
+
+    T* end() const {
+        return data + size;
+    }
+
+private:
+    /** The first object */
+    T* data = nullptr;
+    /** The amount of objects */
+    std::size_t size = 0;
+};
+
+#endif //SPAN_HPP
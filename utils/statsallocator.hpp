@@ -0,0 +1,343 @@
+/**************************************************************************//**
+ * @file statsallocator.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains an allocator decorator that keeps statistics on the memory
+ *        allocated through it
+ * 
+ ******************************************************************************/
+#ifndef STATSALLOCATOR_HPP
+#define STATSALLOCATOR_HPP
+
+#include "utils/allocator.hpp"
+#include "utils/printable.hpp"
+#include <atomic>
+#include <cstdint>
+#include <climits>
+
+/**
+ * @brief Snapshot of the allocation statistics of one call site. @see{AllocationStats}
+ */
+struct AllocationSiteStats {
+    /** Amount of successful allocations */
+    uint64_t nb_allocations = 0;
+    /** Amount of deallocations */
+    uint64_t nb_deallocations = 0;
+    /** Amount of allocations that returned no memory */
+    uint64_t nb_failures = 0;
+    /** Total amount of bytes allocated since the beginning */
+    uint64_t bytes_allocated = 0;
+    /** Amount of bytes currently allocated */
+    uint64_t live_bytes = 0;
+    /** Maximum amount of bytes that were allocated at the same time */
+    uint64_t high_water = 0;
+};
+
+/**
+ * @brief Allocation statistics, broken down by call site (@see{AllocationSite}).
+ * 
+ * @details Every counter is a relaxed atomic and each call site has its own cache line, so the
+ *          statistics can be updated from several threads at the same time and read from a
+ *          monitoring thread while allocations happen. The size histogram is optional (disabled
+ *          by default) : bucket #n counts the allocations of a size in [2^(n-1), 2^n[.
+ */
+class AllocationStats : public Printable
+{
+public:
+    enum {
+        /** Amount of buckets in the size histogram (one per bit of a 32-bit size, plus size 0) */
+        HISTOGRAM_NB_BUCKETS = 33
+    };
+
+    AllocationStats() = default;
+    AllocationStats(const AllocationStats& other) = delete;
+    AllocationStats& operator=(const AllocationStats& other) = delete;
+
+    /**
+     * @brief Get the statistics shared by every InstrumentedAllocator that was not given its own
+     * 
+     * @return The process-wide statistics
+     */
+    static AllocationStats& getGlobal() {
+        static AllocationStats global_stats;
+        return global_stats;
+    }
+
+    /**
+     * @brief Enable or disable the size histogram
+     * 
+     * @param enabled true to record the size of every allocation
+     */
+    void setHistogramEnabled(bool enabled) {
+        histogram_enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Record an allocation
+     * 
+     * @param site The call site that requested the allocation
+     * @param nb_bytes The amount of bytes allocated
+     * @param success false if the allocation returned no memory
+     */
+    void recordAllocation(AllocationSite site, std::size_t nb_bytes, bool success) {
+        SiteCounters& counters = sites[getIndex(site)];
+
+        if(!success) {
+            counters.nb_failures.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        counters.nb_allocations.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes_allocated.fetch_add(nb_bytes, std::memory_order_relaxed);
+        uint64_t live = counters.live_bytes.fetch_add(nb_bytes, std::memory_order_relaxed) + nb_bytes;
+        updateMax(counters.high_water, live);
+
+        live = total_live_bytes.fetch_add(nb_bytes, std::memory_order_relaxed) + nb_bytes;
+        updateMax(total_high_water, live);
+
+        if(histogram_enabled.load(std::memory_order_relaxed)) {
+            counters.histogram[getBucket(nb_bytes)].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Record a deallocation
+     * 
+     * @param site The call site given at allocation
+     * @param nb_bytes The amount of bytes that were allocated
+     */
+    void recordDeallocation(AllocationSite site, std::size_t nb_bytes) {
+        SiteCounters& counters = sites[getIndex(site)];
+
+        counters.nb_deallocations.fetch_add(1, std::memory_order_relaxed);
+        counters.live_bytes.fetch_sub(nb_bytes, std::memory_order_relaxed);
+        total_live_bytes.fetch_sub(nb_bytes, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Get the statistics of a call site
+     * 
+     * @param site The call site
+     * @return A snapshot of the statistics
+     */
+    AllocationSiteStats getSiteStats(AllocationSite site) const {
+        const SiteCounters& counters = sites[getIndex(site)];
+        AllocationSiteStats ret;
+
+        ret.nb_allocations   = counters.nb_allocations.load(std::memory_order_relaxed);
+        ret.nb_deallocations = counters.nb_deallocations.load(std::memory_order_relaxed);
+        ret.nb_failures      = counters.nb_failures.load(std::memory_order_relaxed);
+        ret.bytes_allocated  = counters.bytes_allocated.load(std::memory_order_relaxed);
+        ret.live_bytes       = counters.live_bytes.load(std::memory_order_relaxed);
+        ret.high_water       = counters.high_water.load(std::memory_order_relaxed);
+        return ret;
+    }
+
+    /**
+     * @brief Get the statistics of all the call sites combined
+     * 
+     * @return A snapshot of the statistics
+     * @note The high-water mark is the one of the combined live bytes, not the sum of each site's mark
+     */
+    AllocationSiteStats getTotalStats() const {
+        AllocationSiteStats ret;
+
+        for(std::size_t i = 0; i < ALLOC_SITE_MAX; i++) {
+            AllocationSiteStats site = getSiteStats(static_cast<AllocationSite>(i));
+            ret.nb_allocations   += site.nb_allocations;
+            ret.nb_deallocations += site.nb_deallocations;
+            ret.nb_failures      += site.nb_failures;
+            ret.bytes_allocated  += site.bytes_allocated;
+        }
+        ret.live_bytes = total_live_bytes.load(std::memory_order_relaxed);
+        ret.high_water = total_high_water.load(std::memory_order_relaxed);
+        return ret;
+    }
+
+    /**
+     * @brief Get the amount of allocations of a call site that fell in a histogram bucket
+     * 
+     * @param site The call site
+     * @param bucket The bucket index, lower than HISTOGRAM_NB_BUCKETS
+     * @return The amount of allocations
+     */
+    uint64_t getHistogramCount(AllocationSite site, std::size_t bucket) const {
+        if(bucket >= HISTOGRAM_NB_BUCKETS) {
+            return 0;
+        }
+        return sites[getIndex(site)].histogram[bucket].load(std::memory_order_relaxed);
+    }
+
+    void print() const override {
+        printf("%-24s %12s %12s %8s %14s %12s %12s\n",
+               "Site", "Allocs", "Deallocs", "Failed", "Bytes", "Live", "High water");
+
+        for(std::size_t i = 0; i < ALLOC_SITE_MAX; i++) {
+            AllocationSite site = static_cast<AllocationSite>(i);
+            AllocationSiteStats stats = getSiteStats(site);
+
+            if(stats.nb_allocations == 0 && stats.nb_failures == 0) {
+                continue;
+            }
+            printStats(getSiteName(site), i, stats);
+        }
+        printStats("Total", ALLOC_SITE_MAX, getTotalStats());
+    }
+
+    /**
+     * @brief Get a printable name for a call site
+     * 
+     * @param site The call site
+     * @return The name of the call site
+     */
+    static const char* getSiteName(AllocationSite site) {
+        switch(site) {
+            case ALLOC_SITE_UNKNOWN:            return "Unknown";
+            case ALLOC_SITE_SP_BUILDER:         return "SpBuilder";
+            case ALLOC_SITE_SP_IDLE_BUILDER:    return "SpIdleBuilder";
+            case ALLOC_SITE_TRANSFER_LISTENERS: return "Transfer listeners";
+            case ALLOC_SITE_TRANSFER_PACKET:    return "Transfer packets";
+            case ALLOC_SITE_ASYNC_QUEUE:        return "Async queues";
+            case ALLOC_SITE_SHARDS:             return "Transfer shards";
+            case ALLOC_SITE_REORDER:            return "Reorder windows";
+            case ALLOC_SITE_REASSEMBLY:         return "Reassembly";
+            case ALLOC_SITE_TELEMETRY:          return "Telemetry";
+            case ALLOC_SITE_SCHEDULER:          return "Transmit scheduler";
+            case ALLOC_SITE_DUPLICATES:         return "Duplicate filters";
+            case ALLOC_SITE_TRAFFIC:            return "Traffic generator";
+            default:                            return site >= ALLOC_SITE_USER ? "User" : "Reserved";
+        }
+    }
+
+private:
+    /** Counters of a single call site, on their own cache line */
+    struct alignas(64) SiteCounters {
+        std::atomic<uint64_t> nb_allocations{0};
+        std::atomic<uint64_t> nb_deallocations{0};
+        std::atomic<uint64_t> nb_failures{0};
+        std::atomic<uint64_t> bytes_allocated{0};
+        std::atomic<uint64_t> live_bytes{0};
+        std::atomic<uint64_t> high_water{0};
+        std::atomic<uint64_t> histogram[HISTOGRAM_NB_BUCKETS] = {};
+    };
+
+    static std::size_t getIndex(AllocationSite site) {
+        return site < ALLOC_SITE_MAX ? site : ALLOC_SITE_UNKNOWN;
+    }
+
+    static std::size_t getBucket(std::size_t nb_bytes) {
+        std::size_t bucket = 0;
+        while(nb_bytes != 0 && bucket < HISTOGRAM_NB_BUCKETS - 1) {
+            nb_bytes >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    static void updateMax(std::atomic<uint64_t>& max, uint64_t value) {
+        uint64_t current = max.load(std::memory_order_relaxed);
+        while(value > current &&
+              !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+            //current was reloaded, try again
+        }
+    }
+
+    static void printStats(const char* name, std::size_t index, const AllocationSiteStats& stats) {
+        char label[32];
+        if(index < ALLOC_SITE_MAX) {
+            snprintf(label, sizeof(label), "%s (%zu)", name, index);
+        } else {
+            snprintf(label, sizeof(label), "%s", name);
+        }
+        printf("%-24s %12llu %12llu %8llu %14llu %12llu %12llu\n", label,
+               static_cast<unsigned long long>(stats.nb_allocations),
+               static_cast<unsigned long long>(stats.nb_deallocations),
+               static_cast<unsigned long long>(stats.nb_failures),
+               static_cast<unsigned long long>(stats.bytes_allocated),
+               static_cast<unsigned long long>(stats.live_bytes),
+               static_cast<unsigned long long>(stats.high_water));
+    }
+
+    /** Counters of each call site */
+    SiteCounters sites[ALLOC_SITE_MAX];
+    /** Amount of bytes currently allocated, all sites combined */
+    alignas(64) std::atomic<uint64_t> total_live_bytes{0};
+    /** Maximum amount of bytes allocated at the same time, all sites combined */
+    std::atomic<uint64_t> total_high_water{0};
+    /** If the size of every allocation is recorded in the histogram */
+    std::atomic<bool> histogram_enabled{false};
+};
+
+/**
+ * @brief Allocator decorator that records, in an AllocationStats object, every call made to the
+ *        allocator it wraps.
+ * 
+ * @details The decorator only holds the wrapped allocator and a pointer to the statistics, so it
+ *          can be copied and held by value like any other allocator : every copy reports to the same
+ *          statistics. The call site given to allocateTagged() (and thus allocateBuffer()) is used
+ *          to break the statistics down; plain allocate() calls are reported as ALLOC_SITE_UNKNOWN.
+ * @code
+ *          AllocationStats stats;
+ *          InstrumentedAllocator<> alloc(stats);
+ *          SpBuilder<MySecHdr, InstrumentedAllocator<>> packet(256, alloc);
+ *          //...
+ *          stats.print();
+ * @endcode
+ * 
+ * @tparam Allocator The wrapped allocator. @see{isAllocator}
+ */
+template<typename Allocator = DefaultAllocator>
+class InstrumentedAllocator final : public IAllocator, private AllocatorHolder<Allocator>
+{
+public:
+    using IAllocator::pointer;
+    using IAllocator::size_type;
+    using IAllocator::allocateBuffer;
+    using IAllocator::deallocateBuffer;
+
+    /**
+     * @brief Construct a new InstrumentedAllocator object
+     * 
+     * @param stats The statistics to report to. Must outlive the allocator.
+     * @param alloc The allocator to wrap
+     */
+    InstrumentedAllocator(AllocationStats& stats = AllocationStats::getGlobal(),
+                          const Allocator& alloc = Allocator())
+    : AllocatorHolder<Allocator>(alloc), stats(&stats) {
+
+    }
+
+    pointer allocate(size_type nb_bytes) const override {
+        return this->allocateTagged(nb_bytes, ALLOC_SITE_UNKNOWN);
+    }
+
+    void deallocate(pointer bytes, size_type nb_bytes) const noexcept override {
+        this->deallocateTagged(bytes, nb_bytes, ALLOC_SITE_UNKNOWN);
+    }
+
+    pointer allocateTagged(size_type nb_bytes, AllocationSite site) const override {
+        pointer ret = this->getAllocator().allocateTagged(nb_bytes, site);
+        stats->recordAllocation(site, nb_bytes, ret != nullptr || nb_bytes == 0);
+        return ret;
+    }
+
+    void deallocateTagged(pointer bytes, size_type nb_bytes, AllocationSite site) const noexcept override {
+        if(bytes != nullptr || nb_bytes == 0) {
+            stats->recordDeallocation(site, nb_bytes);
+        }
+        this->getAllocator().deallocateTagged(bytes, nb_bytes, site);
+    }
+
+    /**
+     * @return The statistics this allocator reports to
+     */
+    AllocationStats& getStats() const {
+        return *stats;
+    }
+
+private:
+    /** Where the calls are recorded */
+    AllocationStats* stats;
+};
+
+#endif // STATSALLOCATOR_HPP
@@ -0,0 +1,156 @@
+/**************************************************************************//**
+ * @file tokenbucket.hpp
+ * @author Alexis Cabana-Loriaux
+ * 
+ * @brief Contains a token bucket, to limit the rate of a flow
+ * 
+ ******************************************************************************/
+#ifndef TOKENBUCKET_HPP
+#define TOKENBUCKET_HPP
+
+#include <cstdint>
+
+/**
+ * @brief Token bucket: tokens are added at a constant rate, up to a maximum (the burst), and each
+ *        unit of the flow (byte, bit, packet...) consumes one. The flow can thus go at the rate on
+ *        average, with bursts of at most the burst size.
+ * 
+ * @details The bucket is refilled from the time given by the caller (in nanoseconds, @see{MonotonicClock}),
+ *          so a single clock read can serve many buckets. Tokens are counted in billionths, so slow
+ *          rates are refilled exactly; the burst is thus limited to MAX_BURST tokens (about 9.2e9:
+ *          count bytes rather than bits for a larger burst), and the rate to MAX_RATE tokens per second.
+ *          Larger values are clamped. A bucket is not thread-safe.
+ */
+class TokenBucket
+{
+public:
+    enum : uint64_t {
+        /** Largest rate, in tokens per second */
+        MAX_RATE  = UINT64_MAX / 2,
+        /** Largest burst, in tokens: a full bucket counted in billionths fits in half of the range */
+        MAX_BURST = UINT64_MAX / 2 / 1000000000ULL,
+    };
+
+    /**
+     * @brief Construct an unlimited TokenBucket object
+     */
+    TokenBucket() = default;
+
+    /**
+     * @brief Set the rate of the bucket, and fill it
+     * 
+     * @param rate The amount of tokens added per second, 0 for no limit, at most MAX_RATE
+     * @param burst The maximum amount of tokens in the bucket, 0 for one second worth of tokens, at
+     *              most MAX_BURST
+     * @param now The current time, in nanoseconds
+     */
+    void configure(uint64_t rate, uint64_t burst, uint64_t now) {
+        this->rate = (rate < MAX_RATE) ? rate : static_cast<uint64_t>(MAX_RATE);
+        burst = (burst > 0) ? burst : this->rate;
+        this->burst = (burst < MAX_BURST) ? burst : static_cast<uint64_t>(MAX_BURST);
+        this->nano_tokens = this->burst * NANO_PER_SECOND;
+        this->last_refill = now;
+    }
+
+    /**
+     * @return true if the bucket never limits, false otherwise
+     */
+    bool isUnlimited() const {
+        return rate == 0;
+    }
+
+    /**
+     * @brief Check if tokens are available, without consuming them. An amount larger than the burst
+     *        is available when the bucket is full.
+     * 
+     * @param amount The amount of tokens
+     * @param now The current time, in nanoseconds
+     * @return true if the tokens are available, false otherwise
+     */
+    bool canConsume(uint64_t amount, uint64_t now) {
+        if(this->isUnlimited()) {
+            return true;
+        }
+
+        this->refill(now);
+        return nano_tokens >= this->getRequired(amount);
+    }
+
+    /**
+     * @brief Consume tokens, if they are available. @see{canConsume}
+     * 
+     * @param amount The amount of tokens
+     * @param now The current time, in nanoseconds
+     * @return true if the tokens were consumed, false if they were not available
+     */
+    bool tryConsume(uint64_t amount, uint64_t now) {
+        if(!this->canConsume(amount, now)) {
+            return false;
+        }
+        this->consume(amount);
+        return true;
+    }
+
+    /**
+     * @brief Consume tokens that were checked with canConsume()
+     * 
+     * @param amount The amount of tokens
+     */
+    void consume(uint64_t amount) {
+        if(!this->isUnlimited()) {
+            nano_tokens -= this->getRequired(amount);
+        }
+    }
+
+    /**
+     * @brief Get the time to wait for tokens to be available
+     * 
+     * @param amount The amount of tokens
+     * @param now The current time, in nanoseconds
+     * @return The time to wait, in nanoseconds, 0 if they are available now
+     */
+    uint64_t getDelay(uint64_t amount, uint64_t now) {
+        if(this->canConsume(amount, now)) {
+            return 0;
+        }
+        uint64_t missing = this->getRequired(amount) - nano_tokens;
+        return (missing + rate - 1) / rate;
+    }
+
+private:
+    enum : uint64_t {
+        NANO_PER_SECOND = 1000000000ULL,
+    };
+
+    /**
+     * @return The billionths of tokens needed for an amount, at most a full bucket
+     */
+    uint64_t getRequired(uint64_t amount) const {
+        return (amount < burst ? amount : burst) * NANO_PER_SECOND;
+    }
+
+    void refill(uint64_t now) {
+        if(now <= last_refill) {
+            return;
+        }
+
+        uint64_t full = burst * NANO_PER_SECOND;
+        // past the time to fill the bucket, the elapsed time no longer matters (and cannot overflow:
+        // before it, the tokens added are at most the room left)
+        uint64_t elapsed = now - last_refill;
+        uint64_t time_to_fill = (full - nano_tokens) / rate + 1;
+        nano_tokens = (elapsed >= time_to_fill) ? full : nano_tokens + elapsed * rate;
+        last_refill = now;
+    }
+
+    /** Tokens added per second, 0 for no limit */
+    uint64_t rate = 0;
+    /** Maximum amount of tokens */
+    uint64_t burst = 0;
+    /** Tokens in the bucket, in billionths */
+    uint64_t nano_tokens = 0;
+    /** When the bucket was last refilled, in nanoseconds */
+    uint64_t last_refill = 0;
+};
+
+#endif //TOKENBUCKET_HPP